@@ -0,0 +1,189 @@
+#include "calibration.h"
+#include "light.h"
+#include "logging.h"
+#include "config.h"
+
+#include <LittleFS.h>
+#include <ArduinoJson.h>
+
+
+namespace calibration
+{
+
+#define CAL_FILE "/calibration.json"
+#define CAL_MAX_POINTS 8
+#define CAL_DEFAULT_GAIN (65536 / 20)   // raw / 20 without calibration, in Q16 watts per raw unit
+#define CAL_SAME_BRIGHTNESS 20          // in per-mille, a new point closer than that replaces the old one
+#define CAL_MAX_STATE_AGE 2000          // in ms, the state used for a new point should be recent
+
+// Reference points, sorted by brightness
+struct Point
+{
+  uint16_t powerRaw;
+  uint16_t brightness;                  // STM32 level in per-mille
+  uint16_t watts;
+};
+Point points[CAL_MAX_POINTS];
+uint8_t nbPoints = 0;
+
+// Model precomputed from the reference points: the gain (watts per raw unit) is piecewise-linear over the brightness
+uint32_t knotGain[CAL_MAX_POINTS];      // in Q16
+int32_t segmentSlope[CAL_MAX_POINTS];   // gain change per per-mille between knot i and i+1, in Q8 of the gain
+
+void buildModel()
+{
+  for (uint8_t i = 0; i < nbPoints; i++)
+    knotGain[i] = ((uint32_t)points[i].watts << 16) / points[i].powerRaw;
+  for (uint8_t i = 0; i + 1 < nbPoints; i++)
+    segmentSlope[i] = ((int32_t)knotGain[i + 1] - (int32_t)knotGain[i]) * 256 / (points[i + 1].brightness - points[i].brightness);
+}
+
+uint16_t toWatts(uint16_t powerRaw, uint16_t brightness)
+{
+  uint32_t gain = CAL_DEFAULT_GAIN;
+  if (nbPoints > 0)
+  {
+    // Constant gain before the first and after the last point
+    if (brightness <= points[0].brightness)
+      gain = knotGain[0];
+    else if (brightness >= points[nbPoints - 1].brightness)
+      gain = knotGain[nbPoints - 1];
+    else
+    {
+      uint8_t i = 0;
+      while (brightness >= points[i + 1].brightness)
+        i++;
+      gain = knotGain[i] + (((int64_t)segmentSlope[i] * (brightness - points[i].brightness)) >> 8);
+    }
+  }
+  uint32_t watts = ((uint64_t)powerRaw * gain + 0x8000) >> 16;
+  return (watts > 0xFFFF) ? 0xFFFF : watts;
+}
+
+const char* pointsToJson()
+{
+  static char output[CAL_MAX_POINTS * 22 + 3];
+  char *ptr = &output[0];
+  ptr += sprintf(ptr, "[");
+  for (uint8_t i = 0; i < nbPoints; i++)
+    ptr += sprintf(ptr, "%s[%u,%u,%u]", i ? "," : "", points[i].powerRaw, points[i].brightness, points[i].watts);
+  sprintf(ptr, "]");
+  return output;
+}
+
+void save()
+{
+  File calFile = LittleFS.open(CAL_FILE, "w");
+  if (!calFile)
+  {
+    logging::getLogStream().printf("calibration: failed to open %s\n", CAL_FILE);
+    return;
+  }
+  calFile.print("{\"points\":");
+  calFile.print(pointsToJson());
+  calFile.print("}");
+  calFile.close();
+}
+
+void load()
+{
+  nbPoints = 0;
+  if (!LittleFS.exists(CAL_FILE))
+    return;
+  File calFile = LittleFS.open(CAL_FILE, "r");
+  if (!calFile)
+    return;
+  DynamicJsonDocument jsonBuffer(1024);
+  DeserializationError error = deserializeJson(jsonBuffer, calFile);
+  calFile.close();
+  if (error)
+  {
+    logging::getLogStream().printf("calibration: failed to load %s\n", CAL_FILE);
+    return;
+  }
+  JsonArray jsonPoints = jsonBuffer["points"].as<JsonArray>();
+  for (size_t i = 0; i < jsonPoints.size() && nbPoints < CAL_MAX_POINTS; i++)
+  {
+    Point p = { jsonPoints[i][0].as<uint16_t>(), jsonPoints[i][1].as<uint16_t>(), jsonPoints[i][2].as<uint16_t>() };
+    // The points are saved sorted, the invalid ones are skipped
+    if (p.powerRaw == 0 || p.watts == 0 || p.brightness > 1000 ||
+        (nbPoints > 0 && p.brightness <= points[nbPoints - 1].brightness))
+      continue;
+    points[nbPoints++] = p;
+  }
+  buildModel();
+}
+
+bool addPoint(uint16_t watts)
+{
+  const light::State &state = light::getState();
+  if (state.timestamp == 0 || millis() - state.timestamp > CAL_MAX_STATE_AGE)
+  {
+    logging::getLogStream().printf("calibration: no recent state of the STM32\n");
+    return false;
+  }
+  if (watts == 0 || state.powerRaw == 0 || state.brightness == 0)
+  {
+    logging::getLogStream().printf("calibration: the light should be on with a load\n");
+    return false;
+  }
+  Point p = { state.powerRaw, state.brightness, watts };
+
+  // Replace a point at about the same brightness, otherwise insert it in order
+  uint8_t i = 0;
+  while (i < nbPoints && points[i].brightness + CAL_SAME_BRIGHTNESS <= p.brightness)
+    i++;
+  if (i < nbPoints && points[i].brightness < p.brightness + CAL_SAME_BRIGHTNESS)
+    points[i] = p;
+  else
+  {
+    if (nbPoints == CAL_MAX_POINTS)
+    {
+      logging::getLogStream().printf("calibration: too many points, clear the calibration first\n");
+      return false;
+    }
+    memmove(&points[i + 1], &points[i], (nbPoints - i) * sizeof(Point));
+    points[i] = p;
+    nbPoints++;
+  }
+  buildModel();
+  save();
+  logging::getLogStream().printf("calibration: %d W for raw power %d at %d‰\n", watts, p.powerRaw, p.brightness);
+  return true;
+}
+
+void clear()
+{
+  nbPoints = 0;
+  if (LittleFS.exists(CAL_FILE))
+    LittleFS.remove(CAL_FILE);
+  logging::getLogStream().printf("calibration: cleared, back to raw/20\n");
+}
+
+void print()
+{
+  logging::getLogStream().printf("calibration: %d points [raw, brightness, watts]: %s\n", nbPoints, pointsToJson());
+}
+
+void command(const char* str)
+{
+  while (*str == ' ')
+    str++;
+  uint16_t watts;
+  if (*str == 0x00 || *str == '\r')
+    print();
+  else if (strncmp(str, "clear", 5) == 0)
+    clear();
+  else if (helpers::convertToInteger(str, watts, 6))
+    addPoint(watts);
+  else
+    logging::getLogStream().printf("calibration: wrong command %s\n", str);
+}
+
+void setup()
+{
+  load();
+  print();
+}
+
+} // namespace calibration
@@ -0,0 +1,25 @@
+#ifndef CALIBRATION
+#define CALIBRATION
+
+#include <Arduino.h>
+
+
+namespace calibration
+{
+  // Wattage from the raw power counter and the brightness level (in per-mille) of the STM32
+  uint16_t toWatts(uint16_t powerRaw, uint16_t brightness);
+
+  // Add a reference point from the last state of the STM32 for a load of known wattage
+  bool addPoint(uint16_t watts);
+  void clear();
+  void print();
+  // JSON array of the reference points: [[powerRaw, brightness, watts], ...]
+  const char* pointsToJson();
+
+  // Telnet command: "" to print, "clear" or the wattage of the load
+  void command(const char* str);
+
+  void setup();
+}
+
+#endif
@@ -47,6 +47,55 @@ namespace helpers {
     return false;
   }
 
+  bool convertPercentToPerMille(const char* str, uint16_t &val, uint8_t maxLength)
+  {
+    if (str==NULL)
+      return false;
+    uint8_t len=strlen(str);
+    if (len==0 || len>maxLength)
+      return false;
+
+    // Integer part, then the first decimal; the other decimals are ignored
+    uint8_t i=0;
+    uint32_t v=0;
+    uint8_t nbDigits=0;
+    while (i<len && str[i]>='0' && str[i]<='9' && nbDigits<5)
+    {
+      v=v*10+(str[i]-'0');
+      i++;
+      nbDigits++;
+    }
+    v*=10;
+    if (i<len && (str[i]=='.' || str[i]==','))
+    {
+      i++;
+      if (i<len && str[i]>='0' && str[i]<='9')
+      {
+        v+=str[i]-'0';
+        nbDigits++;
+      }
+      while (i<len && str[i]>='0' && str[i]<='9')
+        i++;
+    }
+    // Only white spaces are accepted after the number (e.g. CR for telnet)
+    while (i<len && (str[i]==' ' || str[i]=='\r' || str[i]=='\n'))
+      i++;
+    if (nbDigits==0 || i<len || v>0xFFFF)
+      return false;
+    val=v;
+    return true;
+  }
+
+  const char* perMilleToPercentStr(uint16_t val)
+  {
+    static char output[8];
+    if (val%10==0)
+      sprintf(output, "%d", val/10);
+    else
+      sprintf(output, "%d.%d", val/10, val%10);
+    return output;
+  }
+
   const char* hexToStr(const uint8_t *s, uint8_t len)
   {
     static char output[1000];
@@ -25,6 +25,10 @@ namespace helpers {
 
   bool isInteger(const char* str, uint8_t maxLength=10);
   bool convertToInteger(const char* str, uint16_t &val, uint8_t maxLength=10);
+  // Percent with an optional decimal (e.g. "12.5") to per-mille
+  bool convertPercentToPerMille(const char* str, uint16_t &val, uint8_t maxLength=10);
+  // Per-mille to percent, with a decimal only when needed
+  const char* perMilleToPercentStr(uint16_t val);
   const char* hexToStr(const uint8_t *s, uint8_t len);
 }
 
@@ -0,0 +1,219 @@
+#include "effects.h"
+#include "light.h"
+#include "logging.h"
+
+
+namespace effects
+{
+
+#define EFFECT_TABLE_SIZE 256
+#define EFFECT_FRAME_INTERVAL 50        // in ms, at most 20 brightness frames per second
+
+#define BREATHE_DEFAULT_PERIOD 4        // in s
+#define BREATHE_MAX_PERIOD 60           // in s
+#define SUNRISE_DEFAULT_DURATION 900    // in s
+#define SUNRISE_MAX_DURATION 7200       // in s
+
+// The waveforms are computed by the compiler and stored in flash
+// The values are in Q16: 0 for minBrightness and 0xFFFF for maxBrightness
+struct EffectTable
+{
+  uint16_t v[EFFECT_TABLE_SIZE];
+};
+
+// Taylor series of the cosine, only evaluated at compile time; x in [-pi, pi]
+constexpr double constexprCos(double x)
+{
+  double term = 1.0, sum = 1.0;
+  for (int n = 1; n < 16; n++)
+  {
+    term *= -x * x / ((2 * n - 1) * (2 * n));
+    sum += term;
+  }
+  return sum;
+}
+
+// Breathing: raised cosine, starting and ending at the lowest level
+constexpr EffectTable makeBreatheTable()
+{
+  EffectTable t{};
+  for (int i = 0; i < EFFECT_TABLE_SIZE; i++)
+  {
+    double x = 3.14159265358979323846 * (2.0 * i / EFFECT_TABLE_SIZE - 1.0);
+    t.v[i] = (uint16_t)((1.0 + constexprCos(x)) / 2.0 * 65535.0 + 0.5);
+  }
+  return t;
+}
+
+// Candle: pseudo-random flicker between 55% and 100%, smoothed over neighbouring samples
+constexpr EffectTable makeCandleTable()
+{
+  EffectTable t{};
+  uint32_t seed = 0x2545F491;
+  uint32_t raw[EFFECT_TABLE_SIZE] = {};
+  for (int i = 0; i < EFFECT_TABLE_SIZE; i++)
+  {
+    seed = seed * 1664525u + 1013904223u;       // LCG from Numerical Recipes
+    raw[i] = seed >> 16;
+  }
+  for (int i = 0; i < EFFECT_TABLE_SIZE; i++)
+  {
+    uint32_t avg = (raw[(i + EFFECT_TABLE_SIZE - 1) % EFFECT_TABLE_SIZE] + 2 * raw[i] + raw[(i + 1) % EFFECT_TABLE_SIZE]) / 4;
+    t.v[i] = 36045 + avg * (65535 - 36045) / 65535;
+  }
+  return t;
+}
+
+// Sunrise: cubic ramp, the perceived lightness grows roughly linearly
+constexpr EffectTable makeSunriseTable()
+{
+  EffectTable t{};
+  for (uint64_t i = 0; i < EFFECT_TABLE_SIZE; i++)
+    t.v[i] = i * i * i * 65535 / ((EFFECT_TABLE_SIZE - 1) * (EFFECT_TABLE_SIZE - 1) * (EFFECT_TABLE_SIZE - 1));
+  return t;
+}
+
+static constexpr EffectTable breatheTable PROGMEM = makeBreatheTable();
+static constexpr EffectTable candleTable PROGMEM = makeCandleTable();
+static constexpr EffectTable sunriseTable PROGMEM = makeSunriseTable();
+
+enum Effect { EFFECT_NONE, EFFECT_BREATHE, EFFECT_CANDLE, EFFECT_SUNRISE };
+const char *EFFECT_NAME[] = { "none", "breathe", "candle", "sunrise" };
+
+Effect effect = EFFECT_NONE;
+uint32_t effectDuration = 0;            // period or duration in ms
+unsigned long effectStartTime = 0;
+unsigned long lastFrameTime = 0;
+uint16_t lastLevel = 0;
+bool firstFrame = true;
+
+// Value of the table at pos, in Q8 of the table index, with linear interpolation
+uint16_t interpolate(const EffectTable &table, uint32_t pos, bool periodic)
+{
+  uint16_t idx = pos >> 8;
+  uint16_t next = idx + 1;
+  if (next == EFFECT_TABLE_SIZE)
+    next = periodic ? 0 : idx;
+  int32_t a = pgm_read_word(&table.v[idx]);
+  int32_t b = pgm_read_word(&table.v[next]);
+  return a + (((b - a) * (int32_t)(pos & 0xFF)) >> 8);
+}
+
+bool start(const char *payload)
+{
+  if (payload == NULL)
+    return false;
+
+  // The effect name followed by an optional duration in seconds
+  char name[10];
+  uint8_t i = 0;
+  while (*payload == ' ')
+    payload++;
+  while (*payload >= 'a' && *payload <= 'z' && i < sizeof(name) - 1)
+    name[i++] = *payload++;
+  name[i] = 0x00;
+  uint32_t seconds = strtoul(payload, NULL, 10);
+
+  Effect newEffect;
+  if (strcmp(name, "breathe") == 0)
+  {
+    newEffect = EFFECT_BREATHE;
+    if (seconds == 0 || seconds > BREATHE_MAX_PERIOD)
+      seconds = BREATHE_DEFAULT_PERIOD;
+  }
+  else if (strcmp(name, "candle") == 0)
+  {
+    newEffect = EFFECT_CANDLE;
+    // One sample of the table per frame
+    seconds = 0;
+  }
+  else if (strcmp(name, "sunrise") == 0)
+  {
+    newEffect = EFFECT_SUNRISE;
+    if (seconds == 0 || seconds > SUNRISE_MAX_DURATION)
+      seconds = SUNRISE_DEFAULT_DURATION;
+  }
+  else if (strcmp(name, "stop") == 0 || name[0] == 0x00)
+  {
+    stop();
+    return true;
+  }
+  else
+  {
+    logging::getLogStream().printf("effects: unknown effect \"%s\"\n", name);
+    return false;
+  }
+
+  logging::getLogStream().printf("effects: start %s (%d s)\n", EFFECT_NAME[newEffect], seconds);
+  effectDuration = seconds * 1000;
+  effectStartTime = millis();
+  lastFrameTime = effectStartTime - EFFECT_FRAME_INTERVAL;
+  firstFrame = true;
+  effect = newEffect;
+  return true;
+}
+
+void stop()
+{
+  if (effect == EFFECT_NONE)
+    return;
+  logging::getLogStream().printf("effects: stop %s\n", EFFECT_NAME[effect]);
+  effect = EFFECT_NONE;
+  // Come back to the brightness level before the effect
+  light::restoreBrightness();
+}
+
+void cancel()
+{
+  effect = EFFECT_NONE;
+}
+
+bool isRunning()
+{
+  return effect != EFFECT_NONE;
+}
+
+void handle()
+{
+  if (effect == EFFECT_NONE)
+    return;
+  unsigned long now = millis();
+  if (now - lastFrameTime < EFFECT_FRAME_INTERVAL)
+    return;
+  lastFrameTime = now;
+
+  uint32_t elapsed = now - effectStartTime;
+  uint16_t level;
+  switch (effect)
+  {
+    case EFFECT_BREATHE:
+      level = interpolate(breatheTable, (uint64_t)(elapsed % effectDuration) * (EFFECT_TABLE_SIZE << 8) / effectDuration, true);
+      break;
+    case EFFECT_CANDLE:
+      level = interpolate(candleTable, ((elapsed / EFFECT_FRAME_INTERVAL) % EFFECT_TABLE_SIZE) << 8, true);
+      break;
+    case EFFECT_SUNRISE:
+      if (elapsed >= effectDuration)
+      {
+        // The sunrise ends with the light on
+        logging::getLogStream().printf("effects: end of sunrise\n");
+        effect = EFFECT_NONE;
+        light::lightOn(false, 0);
+        return;
+      }
+      level = interpolate(sunriseTable, (uint64_t)elapsed * ((EFFECT_TABLE_SIZE - 1) << 8) / effectDuration, false);
+      break;
+    default:
+      return;
+  }
+
+  // Only send the frames which change the brightness
+  if (firstFrame || level != lastLevel)
+  {
+    light::setEffectLevel(level);
+    lastLevel = level;
+    firstFrame = false;
+  }
+}
+
+} // namespace effects
@@ -0,0 +1,19 @@
+#ifndef EFFECTS
+#define EFFECTS
+
+#include <Arduino.h>
+
+
+namespace effects
+{
+  // payload: "breathe [period in s]", "candle", "sunrise [duration in s]" or "stop"
+  bool start(const char *payload);
+  // Stop the effect and come back to the brightness of the light
+  void stop();
+  // Stop the effect without restoring the brightness
+  void cancel();
+  bool isRunning();
+  void handle();
+}
+
+#endif
@@ -0,0 +1,111 @@
+#include "levels.h"
+
+
+namespace levels
+{
+
+uint16_t minLevel = 0;                  // STM32 brightness window, in per-mille
+uint16_t maxLevel = 500;
+uint8_t curve = BRIGHTNESS_CURVE_LINEAR;
+
+bool pending = false;
+uint16_t pendingLevel = 0;              // in per-mille
+uint16_t pendingTransition = 0;         // in ms
+uint32_t coalescedCount = 0;
+
+// Perceptual curve computed by the compiler and stored in flash
+// The user level is the CIE 1976 lightness L* (in per-mille) and the table gives the luminance Y in Q16
+struct BrightnessCurve
+{
+  uint16_t v[1001];
+};
+
+constexpr BrightnessCurve makePerceptualCurve()
+{
+  BrightnessCurve c{};
+  for (int i = 0; i <= 1000; i++)
+  {
+    double l = i / 10.0;
+    double y = (l > 8.0) ? ((l + 16.0) / 116.0) * ((l + 16.0) / 116.0) * ((l + 16.0) / 116.0) : l / 903.3;
+    c.v[i] = (uint16_t)(y * 65535.0 + 0.5);
+  }
+  return c;
+}
+
+static constexpr BrightnessCurve perceptualCurve PROGMEM = makePerceptualCurve();
+
+void setMinimum(uint16_t level)
+{
+  if (level > 200)
+    level = 200;
+  minLevel = level;
+}
+
+void setMaximum(uint16_t level)
+{
+  if (level < minLevel)
+    level = minLevel;
+  if (level > 1000)
+    level = 1000;
+  maxLevel = level;
+}
+
+uint16_t minimum()
+{
+  return minLevel;
+}
+
+uint16_t maximum()
+{
+  return maxLevel;
+}
+
+void setCurve(uint8_t c)
+{
+  curve = (c == BRIGHTNESS_CURVE_PERCEPTUAL) ? BRIGHTNESS_CURVE_PERCEPTUAL : BRIGHTNESS_CURVE_LINEAR;
+}
+
+uint16_t toSTM32(uint16_t b)
+{
+  if (b > 1000)
+    b = 1000;
+  if (curve == BRIGHTNESS_CURVE_PERCEPTUAL)
+    return fromWindow(pgm_read_word(&perceptualCurve.v[b]));
+  return minLevel + ((uint32_t)(maxLevel - minLevel) * b + 500) / 1000;
+}
+
+uint16_t fromWindow(uint16_t level)
+{
+  return minLevel + (((uint32_t)(maxLevel - minLevel) * level + 0x8000) >> 16);
+}
+
+void request(uint16_t level, uint16_t transition)
+{
+  if (pending)
+    coalescedCount++;
+  pendingLevel = level;
+  pendingTransition = transition;
+  pending = true;
+}
+
+void cutOff()
+{
+  request(0, 0);
+}
+
+bool take(uint16_t &level, uint16_t &transition)
+{
+  if (!pending)
+    return false;
+  level = pendingLevel;
+  transition = pendingTransition;
+  pending = false;
+  return true;
+}
+
+uint32_t coalesced()
+{
+  return coalescedCount;
+}
+
+}
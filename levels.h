@@ -0,0 +1,36 @@
+#ifndef LEVELS
+#define LEVELS
+
+#include <Arduino.h>
+
+
+// Brightness levels of the STM32, in per-mille
+// Mapping of the user level into the brightness window, and last-writer-wins slot of the level to be sent
+namespace levels
+{
+  #define BRIGHTNESS_CURVE_LINEAR 0
+  #define BRIGHTNESS_CURVE_PERCEPTUAL 1
+
+  // Brightness window: the minimum is clamped to [0, 200] and the maximum to [minimum, 1000]
+  void setMinimum(uint16_t level);
+  void setMaximum(uint16_t level);
+  uint16_t minimum();
+  uint16_t maximum();
+  void setCurve(uint8_t curve);
+
+  // User level in per-mille to the STM32 level, within the brightness window
+  uint16_t toSTM32(uint16_t b);
+  // Level in Q16 of the brightness window to the STM32 level, for the effects
+  uint16_t fromWindow(uint16_t level);
+
+  // Request an STM32 level with a transition (in ms); only the last request is kept
+  void request(uint16_t level, uint16_t transition);
+  // Request the level 0 at once, below the minimum of the window: the load is switched off
+  void cutOff();
+  // Take the pending request, false if there is none
+  bool take(uint16_t &level, uint16_t &transition);
+  // Requests replaced by a newer one before being taken
+  uint32_t coalesced();
+}
+
+#endif
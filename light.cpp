@@ -6,7 +6,16 @@
 #include "config.h"
 #include "light.h"
 #include "switches.h"
+#include "effects.h"
+#include "calibration.h"
+#include "trace.h"
 #include "stm32flash.h"
+#include "stm32image.h"
+#include "stm32frames.h"
+#include "levels.h"
+
+#include <LittleFS.h>
+#include <ESP8266HTTPClient.h>
 
 
 
@@ -14,14 +23,55 @@ namespace light {
 
 // For booting the STM
 bool cmdVersionReceived=false;
-unsigned long STM32ResetTime=0;
+
+// Link supervisor: reset with exponential backoff until the STM32 answers, then heartbeat
+enum LinkState { LINK_RESET, LINK_BOOTING, LINK_UP };
+const char *LINK_STATE_STR[] = { "reset", "booting", "up" };
+#define LINK_RESET_DURATION 50          // in ms, NRST low, then the time for the STM32 to boot
+#define LINK_BOOT_TIMEOUT 300           // in ms, first wait for the version after a reset
+#define LINK_BACKOFF_MAX 60000          // in ms
+#define LINK_HEARTBEAT_INTERVAL 5000    // in ms, CMD_GET_VERSION
+#define LINK_TIMEOUT 15000              // in ms without any valid frame before resetting the STM32
+#define LINK_BUCKET_DURATION 10000      // in ms, the last minute is made of LINK_NB_BUCKETS buckets
+#define LINK_NB_BUCKETS 6
+LinkState linkState = LINK_BOOTING;
+unsigned long linkStateTime = 0;
+bool linkVersionSent = false;
+uint32_t linkBackoff = LINK_BOOT_TIMEOUT;
+unsigned long lastHeartbeatTime = 0;
+unsigned long lastValidFrameTime = 0;
+
+// Counters of the link, since the boot and for the last minute
+enum LinkCounter { LINK_FRAMES, LINK_CRC_ERRORS, LINK_END_ERRORS, LINK_SKIPPED_BYTES, LINK_OVERFLOWS, LINK_RX_TIMEOUTS, LINK_ACKS,
+                   LINK_RETRANSMITS, LINK_LOST_ACKS, LINK_LATE_ACKS, LINK_ACK_LATENCY, LINK_RESETS, LINK_NB_COUNTERS };
+const char *LINK_COUNTER_STR[] = { "frames", "crcErrors", "endErrors", "skippedBytes", "overflows", "rxTimeouts", "acks",
+                                   "retransmits", "lostAcks", "lateAcks", "ackLatencySum", "resets" };
+uint32_t linkTotal[LINK_NB_COUNTERS] = {0};
+uint32_t linkBuckets[LINK_NB_BUCKETS][LINK_NB_COUNTERS] = {{0}};
+uint8_t linkBucket = 0;
+unsigned long linkBucketTime = 0;
+uint32_t linkAckLatencyMax = 0;         // in us
+
+void countLinkEvent(LinkCounter c, uint32_t n = 1)
+{
+  linkTotal[c] += n;
+  linkBuckets[linkBucket][c] += n;
+}
+
+uint32_t linkLastMinute(LinkCounter c)
+{
+  uint32_t sum = 0;
+  for (uint8_t i = 0; i < LINK_NB_BUCKETS; i++)
+    sum += linkBuckets[i][c];
+  return sum;
+}
 
 // The light parameters
-volatile uint8_t minBrightness = 0;   // brightness values in %
-volatile uint8_t maxBrightness = 50;
-volatile uint8_t brightness = 0;
-uint8_t publishedBrightness = 0;      // The last brigthness value published to MQTT
-uint8_t wattage = 0;
+volatile uint16_t brightness = 0;       // level requested by the user in per-mille, mapped into the window by levels::toSTM32()
+uint16_t publishedBrightness = 0;       // The last brigthness value published to MQTT
+
+// Transition time when the light is switched on/off, in ms
+uint16_t transitionTime = 0;
 
 // For the auto-off timer
 uint16_t autoOffDuration = 0;         // In seconds
@@ -33,15 +83,29 @@ unsigned long startBlinkingTime = 0;
 uint16_t blinkingTimerDuration = 5;  // In seconds
 bool blinking = false;
 
-// For the blinking pattern
-unsigned long lastBlinkingLightStateTime = 0;
-bool blinkingLightState = false;
-uint16_t blinkingPattern[10] = {500, 500, 0, 0, 0, 0, 0, 0, 0, 0};   // in ms; if 0, no blinking
-
-
-
-uint8_t &getWattage() {
-  return wattage;
+// For the blinking pattern: each step has a duration and a brightness level
+// blinkingStepEnd[] holds the prefix sums of the durations, in ms from the start of the cycle
+#define BLINK_MAX_STEPS 32
+#define BLINK_MIN_STEP_DURATION 200     // in ms
+uint32_t blinkingStepEnd[BLINK_MAX_STEPS] = {500, 1000};
+uint16_t blinkingStepLevel[BLINK_MAX_STEPS] = {1000, 0};    // in per-mille
+uint8_t blinkingNbSteps = 2;
+uint8_t blinkingStep = 0;
+unsigned long blinkingCycleStartTime = 0;
+unsigned long nextBlinkingTime = 0;     // end of the current step
+
+
+
+// The last state received from the STM32, polled in the background
+State state = {0};
+#define STATE_POLL_FAST 250           // in ms, while the brightness is changing
+#define STATE_POLL_SLOW 10000         // in ms, when idle
+#define STATE_FAST_POLL_DURATION 3000 // in ms, fast polling after a brightness change
+unsigned long lastStatePollTime = 0;
+unsigned long fastPollEndTime = 0;     // millis() until which the state is polled fast
+
+const State &getState() {
+  return state;
 }
 
 WiFiManagerParameter wifiManagerCustomButtons[] = 
@@ -54,11 +118,14 @@ WiFiManagerParameter wifiManagerCustomButtons[] =
 WiFiManagerParameter wifiManagerCustomParams[] = 
 {
   WiFiManagerParameter("<br/><br/><hr><h3>Light parameters</h3>"),
-  WiFiManagerParameter("minBrightness", "Minimum brightness (0% to 20%)", "0", 3),
-  WiFiManagerParameter("maxBrightness", "Maximum brightness (0% to 100%)", "50", 3),
+  WiFiManagerParameter("minBrightness", "Minimum brightness (0% to 20%, e.g. 2.5)", "0", 5),
+  WiFiManagerParameter("maxBrightness", "Maximum brightness (0% to 100%, e.g. 62.5)", "50", 5),
+  WiFiManagerParameter("brightnessCurve", "Brightness curve (0: linear, 1: perceptual for LED loads)", "0", 1),
   WiFiManagerParameter("autoOffTimer", "Auto-off timer (value in seconds)", "", 3),
+  WiFiManagerParameter("transitionTime", "Transition time for switching on/off (value in ms, 0: no transition)", "0", 5),
   WiFiManagerParameter("dimmingType", "Dimming type (0: trailing edge (LED), 1: leading edge (halogen))", "0", 1),
   WiFiManagerParameter("flickerDebounce", "Anti-flickering debounce (50 - 150)", "100", 3),
+  WiFiManagerParameter("stm32FlashBaud", "Baud rate for updating the STM32 firmware (up to 921600, 115200 if it fails)", "115200", 6),
 };
 
 const uint8_t CMD_SET_BRIGHTNESS = 0x02;
@@ -70,26 +137,132 @@ const uint8_t CMD_SET_DIMMING_TYPE_2 = 0x30;
 const uint8_t CMD_SET_DIMMING_TYPE_3 = 0x31;
 const uint8_t CMD_SET_WARM_UP_TIME = 0x21;
 
+#define FADE_TICK_DURATION 10             // in ms, period of the fade engine of the STM32 (assumed)
+#define FADE_RATE_MIN 1                   // in per-mille per tick, the slowest fade takes 10 ms per per-mille of change
+#define FADE_RATE_MAX 1000                // in per-mille per tick, the whole range in one tick
+
 #define LEADING_EDGE 0x01
 #define TRAILING_EDGE 0x02
 
 volatile uint8_t _packet_counter = 0;
-#define _packet_start_marker 0x01
-#define _packet_end_marker 0x04
 
-#define rx_buffer_size 255
-uint8_t rx_buffer[rx_buffer_size];
-uint8_t rx_idx = 0;
-uint8_t rx_payload_size = 0;
-uint8_t rx_payload_cmd = 0;
-#define rx_max_payload_size 255
-uint8_t rx_payload[rx_max_payload_size];
+// Frames received from the STM32, see stm32frames.cpp
+// A frame left incomplete for this long is dropped: a corrupted payload size would otherwise make the parser
+// wait for bytes that may never come, while the STM32 only talks when asked
+#define RX_FRAME_TIMEOUT 50             // in ms, a frame of 262 bytes takes 23 ms at 115200 bauds
+unsigned long lastRxTime = 0;           // when the last byte was received
+
+// Queue of the commands to be sent to the STM32
+// Only one command is in flight at a time. It leaves the queue when the STM32 answers with a frame
+// having the same command and packet counter, otherwise it is sent again after a timeout
+#define CMD_QUEUE_SIZE 8
+#define CMD_MAX_PAYLOAD_SIZE 12         // bigger payloads are only made of zeros (CMD_SET_DIMMING_TYPE_2/3)
+#define CMD_ACK_TIMEOUT 100000          // in us
+#define CMD_MAX_RETRIES 3
+struct Command
+{
+  uint8_t cmd;
+  uint8_t len;
+  bool zeroPayload;                     // the payload is len zeros and is not stored
+  uint8_t payload[CMD_MAX_PAYLOAD_SIZE];
+};
+Command cmdQueue[CMD_QUEUE_SIZE];
+uint8_t cmdQueueHead = 0;               // command in flight or next command to be sent
+uint8_t cmdQueueCount = 0;
+bool cmdInFlight = false;
+uint8_t cmdInFlightCounter = 0;         // packet counter used for the last transmission of the head
+uint8_t cmdRetries = 0;
+unsigned long cmdSentTime = 0;          // in us
+
+// Statistics of the queue; the acknowledgements are counted by the link supervisor
+uint32_t cmdQueueOverflows = 0;         // oldest commands dropped to make room
+
+// The brightness waits in the last-writer-wins slot of levels.cpp; see sendCmdSetBrightness() and flushBrightness()
+#define BRIGHTNESS_MIN_INTERVAL 40      // in ms, at most 25 brightness frames per second
+uint16_t sentLevel = 0;                 // level of the last brightness frame, in per-mille
+unsigned long lastBrightnessFrameTime = 0;
+uint32_t brightnessFrames = 0;
+
+// Dimming parameters requested by the configuration and acknowledged by the STM32 (0: unknown)
+uint8_t requestedDimmingType = 0, requestedDebounce = 0;
+uint8_t ackedDimmingType = 0, ackedDebounce = 0;
+uint8_t pendingDimmingType = 0, pendingDebounce = 0;    // values of the frames in the queue
+bool dimmingParamsInQueue = false;
+bool dimmingParamsLost = false;
 
 // For uploading the STM32 firmware
 stm32_t *stm32=NULL;
+bool      stm32Bootloader=false;        // the serial link is used by the bootloader, from STM32FlashInit() to STM32FlashRelease()
 uint32_t  stm32Addr=0;
+uint32_t  stm32ErasedAddr=0;            // end of the pages erased so far, the pages are erased just ahead of stm32Addr
+uint16_t  stm32PagesErased=0;
+unsigned long stm32EraseTime=0;         // in ms
+uint32_t  stm32Crc=STM32_CRC_INIT;      // CRC of the uploaded image, computed while the STM32 writes the blocks
+uint32_t  stm32CrcLen=0;                // length of the image with the padding of the blocks
+// Diff mode: the image is buffered page by page, only the pages which differ from the flash are erased and written
+#define STM32_DIFF_MAX_PAGE_SIZE 4096
+bool      stm32Diff=false;
+uint8_t   *stm32PageBuf=NULL;
+uint32_t  stm32PageAddr=0;              // start of the page being buffered
+uint32_t  stm32PageSize=0;
+uint32_t  stm32PageLen=0;               // bytes of the page buffered so far
+uint16_t  stm32PagesSkipped=0;
+unsigned long stm32CompareTime=0;       // in ms, to read back or get the CRC of the pages
+unsigned long stm32WriteTime=0;         // in ms, to write the pages which differ
 char stm32FirmwareUpdMsg[256]={0x00};
-
+// Image pulled from a URL, decoded as it arrives and flashed in diff mode without being stored
+// There is no check pass: a failure of the download, of the decoding or of the verification fetches the image again,
+// only the pages which still differ are then written
+WiFiClient stm32FetchClient;
+HTTPClient stm32Fetch;
+char stm32FetchURL[200] = {0x00};
+uint8_t stm32FetchAttempts = 0;
+unsigned long stm32FetchTime = 0;       // last data received
+#define STM32_FETCH_TIMEOUT 5000        // ms without data from the HTTP server before giving up
+#define STM32_FETCH_MAX_ATTEMPTS 3
+#define STM32_FETCH_CHUNK 256           // bytes waited for before decoding, so that the loop is not blocked by the network
+uint32_t  stm32VerifyAddr=0;            // next address to read back for the verification
+uint32_t  stm32VerifyCrc=STM32_CRC_INIT;
+// The update runs from loop() with a bounded step each time, the main loop keeps running meanwhile
+// The image (binary or Intel HEX, optionally compressed with gzip) is decoded once to be checked before the STM32 is touched
+#define STM32_FLASH_BASE 0x08000000     // start of the flash of every STM32, the HEX records are checked against it
+#define STM32_FLASH_MAX_SIZE 0x10000   // largest flash of the devices of stm32dev_table.h, the bound of the check
+enum FlashJobState {FLASH_IDLE, FLASH_CHECKING, FLASH_WRITING, FLASH_VERIFYING, FLASH_SUCCEEDED, FLASH_FAILED};
+FlashJobState flashJobState=FLASH_IDLE;
+uint32_t  flashJobSize=0;               // size of the decoded image
+uint32_t  flashJobDone=0;               // bytes of the image given to the flasher
+const char* flashJobPath="";          // image being flashed, file or URL
+bool flashJobFetch=false;               // the image is streamed from stm32FetchURL
+uint8_t   flashJobPublishedPercent=0xFF;
+// Wall-clock time of the phases of the update, the bootloader commands are timed by stm32flash (stm32_stats)
+unsigned long flashJobPhaseStart=0;     // in ms
+unsigned long flashJobCheckTime=0;      // in ms
+unsigned long flashJobWriteTime=0;      // in ms, erasing included
+unsigned long flashJobVerifyTime=0;     // in ms
+char flashJobStats[200]={0x00};
+// The bootloader detects the baud rate from the init byte, 115200 is used if the configured one fails
+#define STM32_FLASH_DEFAULT_BAUD 115200
+#define STM32_FLASH_MAX_BAUD 921600
+uint32_t  stm32FlashBaud=STM32_FLASH_DEFAULT_BAUD;
+uint32_t  stm32CurrentBaud=STM32_FLASH_DEFAULT_BAUD;
+// Blocks of 256 bytes accumulated across the upload chunks, only the last one of the image can be shorter
+uint8_t   stm32Block[256];
+uint16_t  stm32BlockLen=0;
+uint32_t  stm32Writes=0;
+unsigned long stm32WriteLatency=0;      // in us, sum over the write commands
+unsigned long stm32WriteLatencyMax=0;   // in us
+// Known-good image flashed when the STM32 reports another version, tried once per boot
+#define STM32_IMAGE_FILE "/stm32.bin"
+// The uploads are staged in another file, the known-good image is only replaced by a complete upload stored with ?store=1
+#define STM32_UPLOAD_FILE "/stm32upload.tmp"
+#define STM32_EXPECTED_VERSION_0 0x3F
+#define STM32_EXPECTED_VERSION_1 0x02
+bool stm32ProvisionPending=false;
+bool stm32ProvisionTried=false;
+
+void sendCommand(uint8_t cmd, const uint8_t *payload, uint8_t len);
+
+// Start the reset of the STM32; the end of the reset is done by superviseLink()
 void STM32reset()
 {
   pinMode(STM_NRST_PIN, OUTPUT);
@@ -98,10 +271,17 @@ void STM32reset()
   digitalWrite(STM_BOOT0_PIN, LOW); // boot stm from its own flash memory
 
   digitalWrite(STM_NRST_PIN, LOW); // start stm reset
-  delay(50);
-  digitalWrite(STM_NRST_PIN, HIGH); // end stm reset
-  delay(50);
-  sendCmdGetVersion();
+  linkState = LINK_RESET;
+  linkStateTime = millis();
+  linkVersionSent = false;
+  countLinkEvent(LINK_RESETS);
+
+  // The STM32 has lost the command in flight and the dimming parameters
+  cmdVersionReceived = false;
+  cmdInFlight = false;
+  ackedDimmingType = 0;
+  ackedDebounce = 0;
+  sentLevel = 0;
 }
 
 void STM32ResetToDFUMode()
@@ -124,60 +304,318 @@ void STM32ResetToDFUMode()
   delay(50); // wait 50ms fot the co-processor to come online
 }
 
+// Reset the STM32 in its bootloader and connect to it at this baud rate
+bool STM32FlashInit(uint32_t baud)
+{
+  Serial.end();
+  stm32Bootloader = true;
+  Serial.begin(baud, SERIAL_8E1);
+  STM32ResetToDFUMode();
+  stm32CurrentBaud = baud;
+  stm32 = stm32_init(&Serial, STREAM_SERIAL, 1);
+  return stm32 != NULL;
+}
+
+// Leave the bootloader and restart the STM32 in normal mode
+void STM32FlashRelease()
+{
+  if (stm32)
+    stm32_close(stm32);
+  stm32=NULL;
+  stm32Addr=0;
+  Serial.end();
+  STM32reset();
+  Serial.begin(115200, SERIAL_8N1);
+  stm32Bootloader = false;
+}
+
+// After a failure at a higher baud rate, connect again at 115200; the flash keeps what has been erased and written
+bool STM32FlashFallback()
+{
+  if (stm32CurrentBaud == STM32_FLASH_DEFAULT_BAUD)
+    return false;
+  logging::getLogStream().printf("light: STM32 bootloader failure at %u bauds, falling back to %u bauds\n",
+                                 stm32CurrentBaud, STM32_FLASH_DEFAULT_BAUD);
+  if (stm32)
+    stm32_close(stm32);
+  return STM32FlashInit(STM32_FLASH_DEFAULT_BAUD);
+}
+
+
+// Erase the pages up to end which have not been erased yet
+bool STM32FlashErase(uint32_t end)
+{
+  if (end > stm32->dev->fl_end)
+    end = stm32->dev->fl_end;
+  if (end <= stm32ErasedAddr)
+    return true;
+  int spage = flash_addr_to_page_floor(stm32, stm32ErasedAddr);
+  int epage = flash_addr_to_page_ceil(stm32, end);
+  unsigned long t0 = millis();
+  stm32_err_t s_err = stm32_erase_memory(stm32, spage, epage - spage);
+  if (s_err != STM32_ERR_OK && STM32FlashFallback())
+    s_err = stm32_erase_memory(stm32, spage, epage - spage);
+  if (s_err != STM32_ERR_OK)
+  {
+    sprintf(stm32FirmwareUpdMsg,"failed to erase the STM32 pages %d to %d with error code %d",spage,epage-1,s_err);
+    logging::getLogStream().printf("light: %s\n",stm32FirmwareUpdMsg);
+    return false;
+  }
+  stm32EraseTime += millis() - t0;
+  stm32PagesErased += epage - spage;
+  stm32ErasedAddr = flash_page_to_addr(stm32, epage);
+  return true;
+}
 
+// The flash can only be programmed once erased: a block which may have been partly programmed is written again
+// after erasing its page, the blocks of the page written before it are read back and written again
+stm32_err_t STM32RewritePage(uint32_t addr, const uint8_t data[], unsigned int len)
+{
+  uint32_t pageAddr = flash_page_to_addr(stm32, flash_addr_to_page_floor(stm32, addr));
+  uint32_t before = addr - pageAddr;
+  uint8_t *saved = NULL;
+  stm32_err_t s_err = STM32_ERR_OK;
+  if (before > 0)
+  {
+    saved = (uint8_t*)malloc(before);
+    if (saved == NULL)
+      return STM32_ERR_UNKNOWN;
+    for (uint32_t offset = 0; offset < before && s_err == STM32_ERR_OK; offset += 256)
+      s_err = stm32_read_memory(stm32, pageAddr + offset, saved + offset, min(before - offset, (uint32_t)256));
+  }
+  if (s_err == STM32_ERR_OK)
+  {
+    uint32_t erasedAddr = stm32ErasedAddr;
+    stm32ErasedAddr = pageAddr;
+    if (!STM32FlashErase(addr + len))
+      s_err = STM32_ERR_UNKNOWN;
+    stm32ErasedAddr = max(stm32ErasedAddr, erasedAddr);
+  }
+  for (uint32_t offset = 0; offset < before && s_err == STM32_ERR_OK; offset += 256)
+    s_err = stm32_write_memory(stm32, pageAddr + offset, saved + offset, min(before - offset, (uint32_t)256));
+  if (saved)
+    free(saved);
+  if (s_err == STM32_ERR_OK)
+    s_err = stm32_write_memory_and_crc(stm32, addr, data, len, &stm32Crc);
+  return s_err;
+}
+
+// Write a block with the CRC computed on the way, the latency of the write command is recorded
+bool STM32WriteBlock(uint32_t addr, const uint8_t data[], unsigned int len)
+{
+  unsigned long t0 = micros();
+  uint32_t crc = stm32Crc;
+  stm32_err_t s_err = stm32_write_memory_and_crc(stm32, addr, data, len, &stm32Crc);
+  if (s_err != STM32_ERR_OK && STM32FlashFallback())
+  {
+    // The CRC may already include the failed block
+    stm32Crc = crc;
+    s_err = STM32RewritePage(addr, data, len);
+  }
+  unsigned long latency = micros() - t0;
+  stm32Writes++;
+  stm32WriteLatency += latency;
+  if (latency > stm32WriteLatencyMax)
+    stm32WriteLatencyMax = latency;
+  if (s_err != STM32_ERR_OK)
+  {
+    sprintf(stm32FirmwareUpdMsg,"failed to upload the STM32 firmware at 0x%08X with error code %d",addr,s_err);
+    return false;
+  }
+  return true;
+}
+
+// Erase ahead and write the accumulated block
+bool STM32FlashBlock()
+{
+  if (!STM32FlashErase(stm32Addr + stm32BlockLen) || !STM32WriteBlock(stm32Addr, stm32Block, stm32BlockLen))
+  {
+    logging::getLogStream().printf("light: %s\n",stm32FirmwareUpdMsg);
+    return false;
+  }
+  stm32Addr += stm32BlockLen;
+  stm32CrcLen += (stm32BlockLen + 3) & ~3;
+  stm32BlockLen = 0;
+  return true;
+}
+
+// The data is accumulated in blocks of 256 bytes whatever the size of the chunks, only full blocks are written
 bool STM32FlashUpload(const uint8_t data[], unsigned int size)
 {
-  if (stm32==NULL)
+  // After a failure, stm32 is kept until STM32FlashEnd() has restored the serial link
+  if (stm32==NULL || strlen(stm32FirmwareUpdMsg) != 0)
     return false;
-  unsigned int  len;
-  uint8_t   buffer[256];
-  const uint8_t *p_st = data;
-  uint32_t end = stm32Addr + size;
-  while (stm32Addr < end)
-  {
-    uint32_t left = end - stm32Addr;
-    if (left<sizeof(buffer))
-      len=left;
-    else
-      len=sizeof(buffer);
+  while (size > 0)
+  {
+    unsigned int len = sizeof(stm32Block) - stm32BlockLen;
+    if (len > size)
+      len = size;
+    memcpy(stm32Block + stm32BlockLen, data, len);
+    stm32BlockLen += len;
+    data += len;
+    size -= len;
+    if (stm32BlockLen == sizeof(stm32Block) && !STM32FlashBlock())
+      return false;
+  }
+  return true;
+}
 
-    memcpy(buffer, p_st, len);  // We need 4-byte bounadry flash access
-    p_st += len;
 
-    stm32_err_t s_err= stm32_write_memory(stm32, stm32Addr, buffer, len);
+// Size of the page starting at addr
+uint32_t STM32PageSize(uint32_t addr)
+{
+  int page = flash_addr_to_page_floor(stm32, addr);
+  return flash_page_to_addr(stm32, page + 1) - flash_page_to_addr(stm32, page);
+}
+
+// Compare the page buffered with the flash, with the CRC command of the bootloader if it has one
+bool STM32PageUnchanged(uint32_t len, bool &unchanged)
+{
+  uint32_t crc = 0;
+  stm32_err_t s_err = stm32_crc_memory(stm32, stm32PageAddr, len, &crc);
+  if (s_err == STM32_ERR_OK)
+  {
+    unchanged = (crc == stm32_sw_crc(STM32_CRC_INIT, stm32PageBuf, len));
+    return true;
+  }
+  if (s_err != STM32_ERR_NO_CMD)
+  {
+    sprintf(stm32FirmwareUpdMsg,"failed to get the CRC of the STM32 page at 0x%08X with error code %d",stm32PageAddr,s_err);
+    return false;
+  }
+
+  // Otherwise the page is read back in blocks of 256 bytes
+  uint8_t buffer[256];
+  unchanged = true;
+  for (uint32_t offset = 0; offset < len && unchanged; offset += sizeof(buffer))
+  {
+    uint32_t n = (len - offset < sizeof(buffer)) ? len - offset : sizeof(buffer);
+    s_err = stm32_read_memory(stm32, stm32PageAddr + offset, buffer, n);
     if (s_err != STM32_ERR_OK)
     {
-      // Error
-      sprintf(stm32FirmwareUpdMsg,"failed to upload the STM32 firmware with error code %d",s_err);
-      logging::getLogStream().printf("light: %s\n",stm32FirmwareUpdMsg);
-      stm32=NULL;
-      stm32Addr=0;
+      sprintf(stm32FirmwareUpdMsg,"failed to read back the STM32 flash at 0x%08X with error code %d",stm32PageAddr+offset,s_err);
       return false;
     }
-    else
-      logging::getLogStream().printf("light: uploading firmware for STM32 with size %d\n",len);
+    unchanged = (memcmp(buffer, stm32PageBuf + offset, n) == 0);
+  }
+  return true;
+}
 
-    stm32Addr  += len;
+// Write the page buffered if it differs from the flash
+bool STM32FlashPage()
+{
+  // Padded like the blocks written by stm32_write_memory()
+  uint32_t len = (stm32PageLen + 3) & ~3;
+  memset(stm32PageBuf + stm32PageLen, 0xFF, len - stm32PageLen);
+
+  bool unchanged = false;
+  unsigned long t0 = millis();
+  bool ok = STM32PageUnchanged(len, unchanged);
+  stm32CompareTime += millis() - t0;
+  if (ok && unchanged)
+  {
+    stm32Crc = stm32_sw_crc(stm32Crc, stm32PageBuf, len);
+    stm32PagesSkipped++;
+  }
+  else if (ok)
+  {
+    // Erase only this page
+    stm32ErasedAddr = stm32PageAddr;
+    ok = STM32FlashErase(stm32PageAddr + len);
+    t0 = millis();
+    for (uint32_t offset = 0; offset < len && ok; offset += sizeof(stm32Block))
+    {
+      uint32_t n = (len - offset < sizeof(stm32Block)) ? len - offset : sizeof(stm32Block);
+      ok = STM32WriteBlock(stm32PageAddr + offset, stm32PageBuf + offset, n);
+    }
+    stm32WriteTime += millis() - t0;
   }
+  if (!ok)
+  {
+    logging::getLogStream().printf("light: %s\n",stm32FirmwareUpdMsg);
+    return false;
+  }
+  logging::getLogStream().printf("light: STM32 page at 0x%08X %s\n", stm32PageAddr, unchanged ? "unchanged" : "written");
+
+  stm32CrcLen += len;
+  stm32PageAddr += stm32PageSize;
+  stm32PageLen = 0;
+  if (stm32PageAddr < stm32->dev->fl_end)
+    stm32PageSize = STM32PageSize(stm32PageAddr);
   return true;
 }
 
+// Diff mode: buffer the data up to the end of the page
+bool STM32FlashUploadDiff(const uint8_t data[], unsigned int size)
+{
+  // After a failure, stm32 is kept until STM32FlashEnd() has restored the serial link
+  if (stm32==NULL || strlen(stm32FirmwareUpdMsg) != 0)
+    return false;
+  while (size > 0)
+  {
+    if (stm32PageAddr >= stm32->dev->fl_end)
+    {
+      sprintf(stm32FirmwareUpdMsg,"the STM32 firmware is larger than the flash");
+      logging::getLogStream().printf("light: %s\n",stm32FirmwareUpdMsg);
+      return false;
+    }
+    if (stm32PageSize > STM32_DIFF_MAX_PAGE_SIZE)
+    {
+      sprintf(stm32FirmwareUpdMsg,"the STM32 pages of %u bytes are too large for the diff mode",stm32PageSize);
+      logging::getLogStream().printf("light: %s\n",stm32FirmwareUpdMsg);
+      return false;
+    }
+    uint32_t len = stm32PageSize - stm32PageLen;
+    if (len > size)
+      len = size;
+    memcpy(stm32PageBuf + stm32PageLen, data, len);
+    stm32PageLen += len;
+    data += len;
+    size -= len;
+    stm32Addr += len;
+    if (stm32PageLen == stm32PageSize && !STM32FlashPage())
+      return false;
+  }
+  return true;
+}
 
-bool STM32FlashBegin()
+bool STM32FlashBegin(bool diff)
 {
-  Serial.end();
-  Serial.begin(115200, SERIAL_8E1);
-  STM32ResetToDFUMode();
-  
-  logging::getLogStream().println("light: start updating firmware for the STM32");
+  logging::getLogStream().printf("light: start updating firmware for the STM32 at %u bauds\n", stm32FlashBaud);
 
-  stm32 = stm32_init(&Serial, STREAM_SERIAL, 1);
+  stm32_stats_reset();
+  if (!STM32FlashInit(stm32FlashBaud))
+    STM32FlashFallback();
   stm32Addr = 0;
   if (stm32)
   {
-    logging::getLogStream().println("light: STM32 erase memory");
-    stm32_erase_memory(stm32, 0, STM32_MASS_ERASE);
+    // The pages are erased while the firmware is uploaded, only the pages of the image are erased
     stm32Addr = stm32->dev->fl_start;
+    stm32ErasedAddr = stm32Addr;
+    stm32PagesErased = 0;
+    stm32EraseTime = 0;
+    stm32Crc = STM32_CRC_INIT;
+    stm32CrcLen = 0;
+    stm32BlockLen = 0;
+    stm32Writes = 0;
+    stm32WriteLatency = 0;
+    stm32WriteLatencyMax = 0;
+    stm32Diff = diff;
+    if (diff)
+    {
+      stm32PageAddr = stm32Addr;
+      stm32PageSize = STM32PageSize(stm32Addr);
+      stm32PageLen = 0;
+      stm32PagesSkipped = 0;
+      stm32CompareTime = 0;
+      stm32WriteTime = 0;
+      stm32PageBuf = (uint8_t*)malloc(STM32_DIFF_MAX_PAGE_SIZE);
+      if (stm32PageBuf == NULL)
+      {
+        logging::getLogStream().printf("light: not enough memory for the diff mode, all the pages are written\n");
+        stm32Diff = false;
+      }
+    }
     return true;
   }
   else
@@ -188,21 +626,484 @@ bool STM32FlashBegin()
   }
 }
 
-void STM32FlashEnd()
+// Write the tail of the image: the last page in diff mode, otherwise the last block
+void STM32FlashTail()
+{
+  if (stm32 != NULL && strlen(stm32FirmwareUpdMsg) == 0)
+  {
+    if (stm32Diff && stm32PageLen > 0)
+      STM32FlashPage();
+    else if (!stm32Diff && stm32BlockLen > 0)
+      STM32FlashBlock();
+  }
+  if (stm32Writes > 0)
+    logging::getLogStream().printf("light: %u write commands to the STM32, %lu us on average, %lu us at most\n",
+                                   stm32Writes, stm32WriteLatency / stm32Writes, stm32WriteLatencyMax);
+}
+
+// Compare the CRC of the flash with the one of the uploaded image, one block at a time
+// Returns true when the verification is finished
+bool STM32VerifyStep()
+{
+  if (stm32 == NULL || stm32CrcLen == 0 || strlen(stm32FirmwareUpdMsg) != 0)
+    return true;
+  uint32_t start = stm32->dev->fl_start;
+  stm32_err_t s_err = STM32_ERR_OK;
+  if (stm32VerifyAddr == start)
+  {
+    // At once with the CRC command of the bootloader if it has one
+    uint32_t crc = 0;
+    s_err = stm32_crc_memory(stm32, start, stm32CrcLen, &crc);
+    if (s_err == STM32_ERR_OK)
+    {
+      stm32VerifyCrc = crc;
+      stm32VerifyAddr = start + stm32CrcLen;
+    }
+  }
+  if (s_err == STM32_ERR_NO_CMD || (s_err == STM32_ERR_OK && stm32VerifyAddr < start + stm32CrcLen))
+  {
+    // Otherwise the flash is read back
+    uint8_t buffer[256];
+    uint32_t len = start + stm32CrcLen - stm32VerifyAddr;
+    if (len > sizeof(buffer))
+      len = sizeof(buffer);
+    s_err = stm32_read_memory(stm32, stm32VerifyAddr, buffer, len);
+    if (s_err != STM32_ERR_OK && STM32FlashFallback())
+      s_err = stm32_read_memory(stm32, stm32VerifyAddr, buffer, len);
+    if (s_err == STM32_ERR_OK)
+    {
+      stm32VerifyCrc = stm32_sw_crc(stm32VerifyCrc, buffer, len);
+      stm32VerifyAddr += len;
+    }
+  }
+  if (s_err != STM32_ERR_OK)
+    sprintf(stm32FirmwareUpdMsg, "STM32 firmware verification failed: cannot read the CRC of the flash (error code %d)", s_err);
+  else if (stm32VerifyAddr < start + stm32CrcLen)
+    return false;
+  else if (stm32VerifyCrc != stm32Crc)
+    sprintf(stm32FirmwareUpdMsg, "STM32 firmware verification failed: CRC of the flash 0x%08X, expected 0x%08X", stm32VerifyCrc, stm32Crc);
+  else
+    logging::getLogStream().printf("light: STM32 firmware verified, CRC 0x%08X for %u bytes\n", stm32VerifyCrc, stm32CrcLen);
+  if (strlen(stm32FirmwareUpdMsg) != 0)
+    logging::getLogStream().printf("light: %s\n", stm32FirmwareUpdMsg);
+  return true;
+}
+
+// Returns true if the firmware has been written and verified
+bool STM32FlashEnd()
 {
   logging::getLogStream().println("light: finish updating firmware for STM32");
-  if (stm32)
-    stm32_close(stm32);
-  stm32=NULL;
-  stm32Addr=0;
-  Serial.end();
-  STM32reset();
-  Serial.begin(115200, SERIAL_8N1);
+  bool succeeded = (stm32 != NULL && strlen(stm32FirmwareUpdMsg) == 0);
+  if (stm32 && stm32Diff && strlen(stm32FirmwareUpdMsg) == 0)
+  {
+    // Compared to erasing and writing the unchanged pages, at the average time of the pages written
+    uint16_t nbPages = stm32PagesSkipped + stm32PagesErased;
+    if (stm32PagesErased > 0)
+    {
+      long saved = (long)((stm32EraseTime + stm32WriteTime) * stm32PagesSkipped / stm32PagesErased) - (long)stm32CompareTime;
+      sprintf(stm32FirmwareUpdMsg, "STM32 firmware update succeeded and verified (CRC 0x%08X): %d of %d pages skipped, %lu ms to compare (about %ld ms saved)",
+              stm32Crc, stm32PagesSkipped, nbPages, stm32CompareTime, saved);
+    }
+    else
+      sprintf(stm32FirmwareUpdMsg, "STM32 firmware already up to date (CRC 0x%08X): %d of %d pages skipped, %lu ms to compare",
+              stm32Crc, stm32PagesSkipped, nbPages, stm32CompareTime);
+    logging::getLogStream().printf("light: %s\n", stm32FirmwareUpdMsg);
+  }
+  else if (stm32 && stm32PagesErased > 0 && strlen(stm32FirmwareUpdMsg) == 0)
+  {
+    // Compared to erasing every page of the flash, at the average erase time per page
+    int nbPages = flash_addr_to_page_ceil(stm32, stm32->dev->fl_end);
+    unsigned long saved = stm32EraseTime * (nbPages - stm32PagesErased) / stm32PagesErased;
+    sprintf(stm32FirmwareUpdMsg, "STM32 firmware update succeeded and verified (CRC 0x%08X): %d of %d pages erased in %lu ms (about %lu ms saved)",
+            stm32Crc, stm32PagesErased, nbPages, stm32EraseTime, saved);
+    logging::getLogStream().printf("light: %s\n", stm32FirmwareUpdMsg);
+  }
+  else if (succeeded)
+    sprintf(stm32FirmwareUpdMsg, "STM32 firmware update succeeded and verified (CRC 0x%08X)", stm32Crc);
+  if (stm32PageBuf)
+    free(stm32PageBuf);
+  stm32PageBuf=NULL;
+  stm32Diff=false;
+  STM32FlashRelease();
+  return succeeded;
 }
 
+const char* flashJobStateStr()
+{
+  switch (flashJobState)
+  {
+    case FLASH_CHECKING: return "checking";
+    case FLASH_WRITING: return "writing";
+    case FLASH_VERIFYING: return "verifying";
+    case FLASH_SUCCEEDED: return "succeeded";
+    case FLASH_FAILED: return "failed";
+    default: return "idle";
+  }
+}
 
+bool isFlashJobRunning()
+{
+  return flashJobState == FLASH_CHECKING || flashJobState == FLASH_WRITING || flashJobState == FLASH_VERIFYING;
+}
+
+// Progress in percent: 10% for checking the image, 70% for writing it and 20% for the verification
+// An image fetched from a URL is not checked, its progress is the one of the download
+uint8_t flashJobPercent()
+{
+  if (flashJobState == FLASH_SUCCEEDED)
+    return 100;
+  if (flashJobState == FLASH_CHECKING && stm32image::fileSize() > 0)
+    return 10 * stm32image::filePosition() / stm32image::fileSize();
+  if (flashJobState == FLASH_WRITING && flashJobFetch && stm32image::fileSize() > 0)
+    return 10 + 70 * stm32image::filePosition() / stm32image::fileSize();
+  if (flashJobState == FLASH_WRITING && flashJobSize > 0)
+    return 10 + 70 * flashJobDone / flashJobSize;
+  if (flashJobState == FLASH_VERIFYING && stm32 != NULL && stm32CrcLen > 0)
+    return 80 + 20 * (stm32VerifyAddr - stm32->dev->fl_start) / stm32CrcLen;
+  return 0;
+}
 
-ICACHE_RAM_ATTR uint16_t crc(uint8_t *buffer, uint8_t len) {
+// Progress on MQTT, at every 10% and at the end
+void publishFlashJob()
+{
+  const char* topic = wifi::getParamValueFromID("pubMqttSTM32Update");
+  if (topic == NULL)
+    return;
+  uint8_t percent = flashJobPercent() / 10 * 10;
+  if (flashJobState == FLASH_SUCCEEDED || flashJobState == FLASH_FAILED)
+  {
+    mqtt::publishMQTT(topic, stm32FirmwareUpdMsg);
+    mqtt::publishMQTT(topic, flashJobStats);
+  }
+  else if (percent != flashJobPublishedPercent)
+  {
+    char payload[24];
+    sprintf(payload, "%s %d%%", flashJobStateStr(), percent);
+    mqtt::publishMQTT(topic, payload);
+  }
+  flashJobPublishedPercent = percent;
+}
+
+// Where the time of the update went, with the average and maximum latencies of the write commands
+void summarizeFlashJob()
+{
+  const struct stm32_stat *cmd = &stm32_stats[STM32_STAT_WM_CMD];
+  const struct stm32_stat *addr = &stm32_stats[STM32_STAT_WM_ADDR];
+  const struct stm32_stat *data = &stm32_stats[STM32_STAT_WM_DATA];
+  snprintf(flashJobStats, sizeof(flashJobStats),
+           "init %lu ms, check %lu ms, erase %lu ms, write %lu ms (%lu B/s), verify %lu ms; ACK avg/max in us: cmd %lu/%lu, addr %lu/%lu, data %lu/%lu",
+           (unsigned long)stm32_stats[STM32_STAT_INIT].total / 1000, flashJobCheckTime,
+           (unsigned long)stm32_stats[STM32_STAT_ERASE].total / 1000, flashJobWriteTime,
+           flashJobWriteTime > 0 ? (unsigned long)flashJobDone * 1000 / flashJobWriteTime : 0, flashJobVerifyTime,
+           cmd->count ? (unsigned long)(cmd->total / cmd->count) : 0, (unsigned long)cmd->max,
+           addr->count ? (unsigned long)(addr->total / addr->count) : 0, (unsigned long)addr->max,
+           data->count ? (unsigned long)(data->total / data->count) : 0, (unsigned long)data->max);
+  logging::getLogStream().printf("light: STM32 update timing: %s\n", flashJobStats);
+}
+
+// The staged upload is not needed anymore once the job has ended
+void removeStagedImage()
+{
+  if (!flashJobFetch && strcmp(flashJobPath, STM32_UPLOAD_FILE) == 0)
+    LittleFS.remove(STM32_UPLOAD_FILE);
+}
+
+void failFlashJob()
+{
+  logging::getLogStream().printf("light: %s\n", stm32FirmwareUpdMsg);
+  summarizeFlashJob();
+  removeStagedImage();
+  flashJobState = FLASH_FAILED;
+  publishFlashJob();
+}
+
+// Start updating the STM32 with an image stored on LittleFS, the work is done by handleFlashJob()
+bool startFlashJob(const char* path, bool diff)
+{
+  // The bootloader is also used by the read-out of the flash
+  if (isFlashJobRunning() || stm32Bootloader)
+  {
+    logging::getLogStream().printf("light: the STM32 firmware is already being updated or read\n");
+    return false;
+  }
+  memset(stm32FirmwareUpdMsg,0x00,sizeof(stm32FirmwareUpdMsg));
+  flashJobPath = path;
+  flashJobFetch = false;
+  if (!stm32image::open(flashJobPath, STM32_FLASH_BASE, STM32_FLASH_MAX_SIZE))
+  {
+    snprintf(stm32FirmwareUpdMsg, sizeof(stm32FirmwareUpdMsg), "STM32 image: %s", stm32image::error());
+    failFlashJob();
+    return false;
+  }
+  logging::getLogStream().printf("light: checking the STM32 image %s (%s, %u bytes)\n",
+                                 flashJobPath, stm32image::formatStr(), stm32image::fileSize());
+  stm32Diff = diff;
+  flashJobSize = 0;
+  flashJobDone = 0;
+  flashJobState = FLASH_CHECKING;
+  flashJobPublishedPercent = 0xFF;
+  flashJobCheckTime = flashJobWriteTime = flashJobVerifyTime = 0;
+  flashJobStats[0] = 0x00;
+  flashJobPhaseStart = millis();
+  return true;
+}
+
+// Send the GET request and connect to the bootloader, the image is then decoded from the body of the answer
+// Called again for each attempt
+bool startFetchAttempt()
+{
+  stm32FetchAttempts++;
+  memset(stm32FirmwareUpdMsg,0x00,sizeof(stm32FirmwareUpdMsg));
+  logging::getLogStream().printf("light: fetching the STM32 image from %s (attempt %d of %d)\n",
+                                 stm32FetchURL, stm32FetchAttempts, STM32_FETCH_MAX_ATTEMPTS);
+  // HTTP/1.0 so that the body is not chunked and can be decoded as it is
+  stm32Fetch.useHTTP10(true);
+  stm32Fetch.setTimeout(STM32_FETCH_TIMEOUT);
+  int code = stm32Fetch.begin(stm32FetchClient, stm32FetchURL) ? stm32Fetch.GET() : -1;
+  if (code != HTTP_CODE_OK)
+  {
+    snprintf(stm32FirmwareUpdMsg, sizeof(stm32FirmwareUpdMsg), "STM32 image: cannot fetch %s (HTTP %d %s)",
+             stm32FetchURL, code, code < 0 ? stm32Fetch.errorToString(code).c_str() : "");
+    stm32Fetch.end();
+    return false;
+  }
+  int size = stm32Fetch.getSize();
+  // Diff mode: the pages written by a failed attempt are not written again
+  if (!STM32FlashBegin(true))
+  {
+    stm32Fetch.end();
+    STM32FlashEnd();
+    return false;
+  }
+  // The decoder stops at the end of the flash, the image cannot be checked before being written
+  if (!stm32image::open(*stm32Fetch.getStreamPtr(), size > 0 ? size : 0, stm32->dev->fl_start, stm32->dev->fl_end - stm32->dev->fl_start))
+  {
+    snprintf(stm32FirmwareUpdMsg, sizeof(stm32FirmwareUpdMsg), "STM32 image: %s", stm32image::error());
+    stm32Fetch.end();
+    STM32FlashEnd();
+    return false;
+  }
+  logging::getLogStream().printf("light: flashing the STM32 with the %s image of %d bytes\n", stm32image::formatStr(), size);
+  stm32FetchTime = millis();
+  flashJobSize = 0;
+  flashJobDone = 0;
+  flashJobState = FLASH_WRITING;
+  flashJobPhaseStart = millis();
+  return true;
+}
+
+// Update the STM32 with an image downloaded from a HTTP server, the work is done by handleFlashJob()
+bool startFlashJobFromURL(const char* url)
+{
+  // The bootloader is also used by the read-out of the flash
+  if (isFlashJobRunning() || stm32Bootloader)
+  {
+    logging::getLogStream().printf("light: the STM32 firmware is already being updated or read\n");
+    return false;
+  }
+  if (strlen(url) >= sizeof(stm32FetchURL))
+  {
+    snprintf(stm32FirmwareUpdMsg, sizeof(stm32FirmwareUpdMsg), "STM32 image: the URL is longer than %d characters", (int)sizeof(stm32FetchURL) - 1);
+    failFlashJob();
+    return false;
+  }
+  strcpy(stm32FetchURL, url);
+  flashJobPath = stm32FetchURL;
+  flashJobFetch = true;
+  stm32FetchAttempts = 0;
+  flashJobPublishedPercent = 0xFF;
+  flashJobCheckTime = flashJobWriteTime = flashJobVerifyTime = 0;
+  flashJobStats[0] = 0x00;
+  if (!startFetchAttempt())
+  {
+    failFlashJob();
+    return false;
+  }
+  return true;
+}
+
+// Data of the HTTP server ready to be decoded: a chunk or the end of the body
+// Returns false while waiting, an error message is set if the server is silent for too long
+bool fetchReady()
+{
+  WiFiClient *stream = stm32Fetch.getStreamPtr();
+  if (stream == NULL || !stream->connected())
+    return true;
+  int available = stream->available();
+  uint32_t left = stm32image::fileSize() - stm32image::filePosition();
+  if (available >= STM32_FETCH_CHUNK || (stm32image::fileSize() > 0 && (uint32_t)available >= left))
+  {
+    stm32FetchTime = millis();
+    return true;
+  }
+  if (millis() - stm32FetchTime > STM32_FETCH_TIMEOUT)
+    snprintf(stm32FirmwareUpdMsg, sizeof(stm32FirmwareUpdMsg), "STM32 image: download timed out at %u bytes", stm32image::filePosition());
+  return strlen(stm32FirmwareUpdMsg) != 0;
+}
+
+// End of an attempt of a fetched image: true if another attempt has been started
+bool retryFetch()
+{
+  stm32Fetch.end();
+  if (!flashJobFetch || stm32FetchAttempts >= STM32_FETCH_MAX_ATTEMPTS)
+    return false;
+  logging::getLogStream().printf("light: %s\n", stm32FirmwareUpdMsg);
+  return startFetchAttempt();
+}
+
+// One bounded step of the update at each loop: a block of the image to check or to write, or a block of the verification
+void handleFlashJob()
+{
+  uint8_t buffer[256];
+  if (flashJobState == FLASH_CHECKING)
+  {
+    int len = stm32image::read(buffer, sizeof(buffer));
+    if (len > 0)
+      return;
+    if (len < 0)
+    {
+      snprintf(stm32FirmwareUpdMsg, sizeof(stm32FirmwareUpdMsg), "STM32 image: %s", stm32image::error());
+      stm32image::close();
+      failFlashJob();
+      return;
+    }
+    // The image is valid, it is decoded again for writing it
+    flashJobSize = stm32image::imageSize();
+    stm32image::close();
+    flashJobCheckTime = millis() - flashJobPhaseStart;
+    if (!STM32FlashBegin(stm32Diff))
+    {
+      STM32FlashEnd();
+      failFlashJob();
+      return;
+    }
+    // The size of the flash is only known once the bootloader is connected, nothing has been erased yet
+    if (flashJobSize > stm32->dev->fl_end - stm32->dev->fl_start)
+    {
+      snprintf(stm32FirmwareUpdMsg, sizeof(stm32FirmwareUpdMsg), "STM32 image: %u bytes do not fit in the %u bytes of the flash",
+               flashJobSize, stm32->dev->fl_end - stm32->dev->fl_start);
+      STM32FlashEnd();
+      failFlashJob();
+      return;
+    }
+    logging::getLogStream().printf("light: flashing the STM32 with %u bytes\n", flashJobSize);
+    if (!stm32image::open(flashJobPath, stm32->dev->fl_start, stm32->dev->fl_end - stm32->dev->fl_start))
+    {
+      snprintf(stm32FirmwareUpdMsg, sizeof(stm32FirmwareUpdMsg), "STM32 image: %s", stm32image::error());
+      STM32FlashEnd();
+      failFlashJob();
+      return;
+    }
+    flashJobState = FLASH_WRITING;
+    flashJobPhaseStart = millis();
+  }
+  else if (flashJobState == FLASH_WRITING)
+  {
+    if (flashJobFetch && !fetchReady())
+      return;
+    int len = (strlen(stm32FirmwareUpdMsg) == 0) ? stm32image::read(buffer, sizeof(buffer)) : -1;
+    if (len > 0)
+    {
+      if (stm32Diff ? STM32FlashUploadDiff(buffer, len) : STM32FlashUpload(buffer, len))
+        flashJobDone += len;
+    }
+    else if (len < 0)
+    {
+      if (strlen(stm32FirmwareUpdMsg) == 0)
+        snprintf(stm32FirmwareUpdMsg, sizeof(stm32FirmwareUpdMsg), "STM32 image: %s", stm32image::error());
+      logging::getLogStream().printf("light: %s\n", stm32FirmwareUpdMsg);
+    }
+    if (stm32 == NULL || strlen(stm32FirmwareUpdMsg) != 0 || len <= 0)
+    {
+      stm32image::close();
+      STM32FlashTail();
+      if (flashJobFetch)
+        flashJobSize = flashJobDone;
+      stm32VerifyAddr = (stm32 != NULL) ? stm32->dev->fl_start : 0;
+      stm32VerifyCrc = STM32_CRC_INIT;
+      flashJobState = FLASH_VERIFYING;
+      flashJobWriteTime = millis() - flashJobPhaseStart;
+      flashJobPhaseStart = millis();
+    }
+  }
+  else if (flashJobState == FLASH_VERIFYING)
+  {
+    if (STM32VerifyStep())
+    {
+      flashJobVerifyTime = millis() - flashJobPhaseStart;
+      bool succeeded = STM32FlashEnd();
+      if (!succeeded && retryFetch())
+        return;
+      stm32Fetch.end();
+      flashJobState = succeeded ? FLASH_SUCCEEDED : FLASH_FAILED;
+      summarizeFlashJob();
+      removeStagedImage();
+    }
+  }
+  else
+    return;
+  publishFlashJob();
+}
+
+// Automatic update when the version handshake has reported another firmware
+void provisionSTM32()
+{
+  if (!stm32ProvisionPending || stm32Bootloader)
+    return;
+  stm32ProvisionPending = false;
+  stm32ProvisionTried = true;
+  logging::getLogStream().printf("light: provisioning the STM32 from %s\n", STM32_IMAGE_FILE);
+  startFlashJob(STM32_IMAGE_FILE, true);
+}
+
+// Telnet command: flash the stored image now, whatever the version of the STM32
+void flashStoredImage()
+{
+  stm32ProvisionPending = true;
+  provisionSTM32();
+}
+
+// Throughput of the CRC used to verify the STM32 flash, over the size of a 64 KB image
+void benchmarkCRC()
+{
+  const unsigned int blockSize = 4096, nbBlocks = 16;
+  uint8_t *buf = (uint8_t*)malloc(blockSize);
+  if (buf == NULL)
+  {
+    logging::getLogStream().printf("light: not enough memory for the CRC benchmark\n");
+    return;
+  }
+  for (unsigned int i = 0; i < blockSize; i++)
+    buf[i] = i * 7 + (i >> 8);
+
+  uint32_t crcs[2];
+  unsigned long durations[2];
+  for (uint8_t impl = 0; impl < 2; impl++)
+  {
+    uint32_t crc = STM32_CRC_INIT;
+    durations[impl] = 0;
+    for (unsigned int n = 0; n < nbBlocks; n++)
+    {
+      unsigned long startTime = micros();
+      crc = impl ? stm32_sw_crc(crc, buf, blockSize) : stm32_sw_crc_bitwise(crc, buf, blockSize);
+      durations[impl] += micros() - startTime;
+      // Keep the watchdog and the WiFi stack fed between the blocks
+      yield();
+    }
+    crcs[impl] = crc;
+  }
+  free(buf);
+
+  for (uint8_t impl = 0; impl < 2; impl++)
+    logging::getLogStream().printf("light: CRC %s: %u bytes in %lu us, %lu bytes/s\n", impl ? "table" : "bitwise",
+                                   blockSize * nbBlocks, durations[impl],
+                                   (unsigned long)((uint64_t)blockSize * nbBlocks * 1000000 / (durations[impl] ? durations[impl] : 1)));
+  logging::getLogStream().printf("light: CRC 0x%08X and 0x%08X, %s\n", crcs[0], crcs[1], (crcs[0] == crcs[1]) ? "identical" : "MISMATCH");
+}
+
+
+
+uint16_t crc(uint8_t *buffer, uint8_t len) {
   uint16_t c = 0;
   for (int i = 1; i < len; i++) {
     c += buffer[i];
@@ -210,13 +1111,13 @@ ICACHE_RAM_ATTR uint16_t crc(uint8_t *buffer, uint8_t len) {
   return c;
 }
 
-ICACHE_RAM_ATTR void sendCommand(uint8_t cmd, uint8_t *payload, uint8_t len)
+void sendCommand(uint8_t cmd, const uint8_t *payload, uint8_t len)
 {
 #define tx_buffer_size 255
   uint8_t tx_buffer[tx_buffer_size];
   uint8_t b = 0;
 
-  tx_buffer[b++] = _packet_start_marker;
+  tx_buffer[b++] = STM32_FRAME_START_MARKER;
   tx_buffer[b++] = _packet_counter;
   tx_buffer[b++] = cmd;
   tx_buffer[b++] = len;
@@ -224,65 +1125,347 @@ ICACHE_RAM_ATTR void sendCommand(uint8_t cmd, uint8_t *payload, uint8_t len)
   if (payload) {
     memcpy(tx_buffer + b, payload, len);
   }
+  else {
+    memset(tx_buffer + b, 0x00, len);
+  }
   b += len;
 
-  uint16_t c = crc(tx_buffer, b);
+  uint16_t c = crc(tx_buffer, b);
+
+  tx_buffer[b++] = c >> 8; // crc first byte (big/network endian)
+  tx_buffer[b++] = c; // crc second byte (big/network endian)
+  tx_buffer[b] = STM32_FRAME_END_MARKER;
+
+  b++;
+
+  Serial.write(tx_buffer, b);
+  trace::record(trace::TRACE_TX, trace::TRACE_OK, tx_buffer, b);
+  //logging::getLogStream().printf("light: send packet %s\n", helpers::hexToStr(tx_buffer, b));
+
+  _packet_counter++;
+
+}
+
+// Book-keeping when a command leaves the queue
+void forgetCommand(uint8_t cmd, bool acked)
+{
+  if (cmd == CMD_SET_DIMMING_PARAMETERS || cmd == CMD_SET_DIMMING_TYPE_2 || cmd == CMD_SET_DIMMING_TYPE_3)
+  {
+    if (!acked)
+      dimmingParamsLost = true;
+    // The dimming parameters are only applied once the last frame of the sequence is acknowledged
+    if (cmd == CMD_SET_DIMMING_TYPE_3)
+    {
+      if (!dimmingParamsLost)
+      {
+        ackedDimmingType = pendingDimmingType;
+        ackedDebounce = pendingDebounce;
+      }
+      dimmingParamsInQueue = false;
+    }
+  }
+}
+
+// True if a command is waiting in the queue or in flight
+bool isQueued(uint8_t cmd)
+{
+  for (uint8_t i = 0; i < cmdQueueCount; i++)
+    if (cmdQueue[(cmdQueueHead + i) % CMD_QUEUE_SIZE].cmd == cmd)
+      return true;
+  return false;
+}
+
+// Add a command to the queue; it is sent from handle()
+// When the queue is full, the oldest command which is not in flight is dropped
+// A NULL payload means len zeros
+bool queueCommand(uint8_t cmd, const uint8_t *payload, uint8_t len)
+{
+  if (payload != NULL && len > CMD_MAX_PAYLOAD_SIZE)
+    return false;
+
+  // Commands without payload (version, state) are only queued once
+  if (len == 0 && isQueued(cmd))
+    return true;
+  if (cmdQueueCount == CMD_QUEUE_SIZE)
+  {
+    // Drop the oldest command; the command in flight stays at the head
+    uint8_t first = cmdInFlight ? 1 : 0;
+    forgetCommand(cmdQueue[(cmdQueueHead + first) % CMD_QUEUE_SIZE].cmd, false);
+    for (uint8_t i = first; i + 1 < cmdQueueCount; i++)
+      cmdQueue[(cmdQueueHead + i) % CMD_QUEUE_SIZE] = cmdQueue[(cmdQueueHead + i + 1) % CMD_QUEUE_SIZE];
+    cmdQueueCount--;
+    cmdQueueOverflows++;
+  }
+  Command &c = cmdQueue[(cmdQueueHead + cmdQueueCount) % CMD_QUEUE_SIZE];
+  c.cmd = cmd;
+  c.len = len;
+  c.zeroPayload = (payload == NULL);
+  if (payload != NULL)
+    memcpy(c.payload, payload, len);
+  cmdQueueCount++;
+  return true;
+}
+
+// Remove the command at the head of the queue
+void popCommand(bool acked)
+{
+  forgetCommand(cmdQueue[cmdQueueHead].cmd, acked);
+  cmdQueueHead = (cmdQueueHead + 1) % CMD_QUEUE_SIZE;
+  cmdQueueCount--;
+  cmdInFlight = false;
+}
+
+void sendQueueHead()
+{
+  const Command &c = cmdQueue[cmdQueueHead];
+  cmdInFlightCounter = _packet_counter;
+  sendCommand(c.cmd, c.zeroPayload ? NULL : c.payload, c.len);
+  cmdSentTime = micros();
+  cmdInFlight = true;
+}
+
+void sendCmdSetDimmingParameters(uint8_t dimmingType, uint8_t debounce);
+
+// Send the next command of the queue, or the command in flight again if it has not been acknowledged
+void processCommandQueue()
+{
+  // The serial link is used by the bootloader while the STM32 firmware is updated
+  if (stm32Bootloader)
+    return;
+
+  if (cmdInFlight)
+  {
+    if (micros() - cmdSentTime < CMD_ACK_TIMEOUT)
+      return;
+    const Command &c = cmdQueue[cmdQueueHead];
+    if (cmdRetries < CMD_MAX_RETRIES)
+    {
+      cmdRetries++;
+      countLinkEvent(LINK_RETRANSMITS);
+      logging::getLogStream().printf("light: no acknowledgement for command 0x%02X, sending it again\n", c.cmd);
+      sendQueueHead();
+      return;
+    }
+    countLinkEvent(LINK_LOST_ACKS);
+    logging::getLogStream().printf("light: command 0x%02X lost after %d retries\n", c.cmd, cmdRetries);
+    popCommand(false);
+  }
+
+  // Wait for the STM32 to be up after a reset
+  if (!cmdVersionReceived)
+    return;
+
+  // Send the dimming parameters if the STM32 does not have them yet
+  if (!dimmingParamsInQueue && requestedDimmingType != 0 && CMD_QUEUE_SIZE - cmdQueueCount >= 3 &&
+      (requestedDimmingType != ackedDimmingType || requestedDebounce != ackedDebounce))
+    sendCmdSetDimmingParameters(requestedDimmingType, requestedDebounce);
+
+  if (cmdQueueCount > 0)
+  {
+    cmdRetries = 0;
+    sendQueueHead();
+  }
+}
+
+// Match a frame received from the STM32 with the command in flight
+void acknowledgeCommand(uint8_t counter, uint8_t cmd)
+{
+  if (!cmdInFlight || counter != cmdInFlightCounter || cmd != cmdQueue[cmdQueueHead].cmd)
+  {
+    // Answer to the version request sent after a reset
+    if (cmd == CMD_GET_VERSION && !cmdVersionReceived)
+      return;
+    // Answer to a transmission which has already timed out
+    countLinkEvent(LINK_LATE_ACKS);
+    logging::getLogStream().printf("light: late acknowledgement for command 0x%02X with packet counter 0x%02X\n", cmd, counter);
+    return;
+  }
+
+  uint32_t latency = micros() - cmdSentTime;
+  countLinkEvent(LINK_ACK_LATENCY, latency);
+  if (latency > linkAckLatencyMax)
+    linkAckLatencyMax = latency;
+  countLinkEvent(LINK_ACKS);
+  popCommand(true);
+}
+
+void printCommandStats()
+{
+  logging::getLogStream().printf("light: commands acknowledged: %u, retransmitted: %u, lost: %u, late acks: %u, dropped: %u\n",
+                                 linkTotal[LINK_ACKS], linkTotal[LINK_RETRANSMITS], linkTotal[LINK_LOST_ACKS], linkTotal[LINK_LATE_ACKS], cmdQueueOverflows);
+  logging::getLogStream().printf("light: brightness frames: %u, coalesced values: %u\n", brightnessFrames, levels::coalesced());
+  logging::getLogStream().printf("light: acknowledgement latency avg: %u us, max: %u us, queued: %d\n",
+                                 linkTotal[LINK_ACKS] ? linkTotal[LINK_ACK_LATENCY] / linkTotal[LINK_ACKS] : 0, linkAckLatencyMax, cmdQueueCount);
+}
+
+void superviseLink()
+{
+  // The serial link is used by the bootloader while the STM32 firmware is updated
+  if (stm32Bootloader)
+    return;
+
+  unsigned long now = millis();
+  // Move to the next bucket of the last minute
+  for (uint8_t i = 0; i < LINK_NB_BUCKETS && now - linkBucketTime >= LINK_BUCKET_DURATION; i++)
+  {
+    linkBucket = (linkBucket + 1) % LINK_NB_BUCKETS;
+    memset(linkBuckets[linkBucket], 0x00, sizeof(linkBuckets[linkBucket]));
+    linkBucketTime += LINK_BUCKET_DURATION;
+  }
+  if (now - linkBucketTime >= LINK_BUCKET_DURATION)
+    linkBucketTime = now;
+
+  switch (linkState)
+  {
+    case LINK_RESET:
+      if (now - linkStateTime >= LINK_RESET_DURATION)
+      {
+        digitalWrite(STM_NRST_PIN, HIGH); // end stm reset
+        linkState = LINK_BOOTING;
+        linkStateTime = now;
+      }
+      break;
+    case LINK_BOOTING:
+      if (cmdVersionReceived)
+      {
+        logging::getLogStream().printf("light: link to the STM32 up after %lu ms\n", now - linkStateTime);
+        linkState = LINK_UP;
+        linkBackoff = LINK_BOOT_TIMEOUT;
+        lastHeartbeatTime = now;
+      }
+      else if (!linkVersionSent && now - linkStateTime >= LINK_RESET_DURATION)
+      {
+        // The queue is on hold until the STM32 answers to this one
+        sendCommand(CMD_GET_VERSION, NULL, 0);
+        linkVersionSent = true;
+      }
+      else if (now - linkStateTime >= linkBackoff)
+      {
+        logging::getLogStream().printf("light: no answer from the STM32 after %u ms, resetting it\n", linkBackoff);
+        linkBackoff = (linkBackoff * 2 > LINK_BACKOFF_MAX) ? LINK_BACKOFF_MAX : linkBackoff * 2;
+        STM32reset();
+      }
+      break;
+    case LINK_UP:
+      if (now - lastValidFrameTime > LINK_TIMEOUT)
+      {
+        logging::getLogStream().printf("light: no valid frame from the STM32 for %lu ms, resetting it\n", now - lastValidFrameTime);
+        STM32reset();
+      }
+      else if (now - lastHeartbeatTime >= LINK_HEARTBEAT_INTERVAL)
+      {
+        queueCommand(CMD_GET_VERSION, NULL, 0);
+        lastHeartbeatTime = now;
+      }
+      break;
+  }
+}
+
+void printLinkStats()
+{
+  logging::getLogStream().printf("light: link %s, backoff %u ms, last valid frame %lu ms ago\n",
+                                 LINK_STATE_STR[linkState], linkBackoff, millis() - lastValidFrameTime);
+  for (uint8_t i = 0; i < LINK_NB_COUNTERS; i++)
+    logging::getLogStream().printf("light:   %s: %u (last minute: %u)\n", LINK_COUNTER_STR[i], linkTotal[i], linkLastMinute((LinkCounter)i));
+}
+
+uint16_t readUint16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);        // little endian
+}
 
-  tx_buffer[b++] = c >> 8; // crc first byte (big/network endian)
-  tx_buffer[b++] = c; // crc second byte (big/network endian)
-  tx_buffer[b] = _packet_end_marker;
+uint32_t readUint32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-  b++;
+void decodeState(const uint8_t* payload, uint8_t payload_size)
+{
+  if (payload_size < 12)
+  {
+    logging::getLogStream().printf("light: state too short: %s\n", helpers::hexToStr(payload, payload_size));
+    return;
+  }
+  state.status = readUint16(&payload[0]);
+  state.brightness = readUint16(&payload[2]);
+  state.reserved = readUint16(&payload[4]);
+  state.powerRaw = readUint16(&payload[6]);
+  state.flags = readUint32(&payload[8]);
+  state.wattage = calibration::toWatts(state.powerRaw, state.brightness);
+  state.size = payload_size;
+  memset(state.raw, 0x00, sizeof(state.raw));
+  memcpy(state.raw, payload, min((size_t)payload_size, sizeof(state.raw)));
+  state.timestamp = millis();
 
-  Serial.write(tx_buffer, b);
-  //logging::getLogStream().printf("light: send packet %s\n", helpers::hexToStr(tx_buffer, b));
+  /*
+     See here:
+     https://github.com/arendst/Tasmota/issues/6914
+     https://github.com/KoljaWindeler/ESP8266_mqtt_pwm_pir_temp/blob/master/JKW_MQTT_PWM_PIR_TEMP/src/src/cap_shelly_dimmer.cpp#L49
+     https://github.com/KoljaWindeler/ESP8266_mqtt_pwm_pir_temp/blob/a3db486daedcd629183dabf4c0cd33842dca4f19/JKW_MQTT_PWM_PIR_TEMP/src/src/cap_shelly_dimmer.cpp#L108
+     https://github.com/wichers/shelly_dimmer/blob/master/shelly_dimmer.cpp#L286
+     https://gist.github.com/wichers/3c401f6dc6c61b4175ace7bc08cb6f8a -> 100% matching calibration algorithm
+
+     Power 116 W
+     at 75% -> 00 00 EE 02 00 00 78 09 00 00 00 80 00 00 00 00 -> 2424   -> Shelly firmware: 121 W
+     at 50% -> 00 00 F4 01 00 00 E1 05 00 00 00 80 00 00 00 00 -> 1505   -> Shelly firmware: 77 W
+     at 25% -> 00 00 FA 00 00 00 91 01 00 00 00 80 00 00 00 00 -> 401    -> Shelly firmware: 21 W
+
+     Power 46 w
+     at 75% -> 00 00 EE 02 00 00 C5 03 00 00 00 80 00 00 00 00 -> 965
+     at 50% -> 00 00 F4 01 00 00 66 02 00 00 00 80 00 00 00 00 -> 614
+     at 25% -> 00 00 FA 00 00 00 AB 00 00 00 00 80 00 00 00 00 -> 171
+  */
+}
 
-  _packet_counter++;
+void printState()
+{
+  if (state.timestamp == 0)
+  {
+    logging::getLogStream().printf("light: no state received from the STM32 yet\n");
+    return;
+  }
+  logging::getLogStream().printf("light: state received %lu ms ago: %s\n", millis() - state.timestamp, helpers::hexToStr(state.raw, min((size_t)state.size, sizeof(state.raw))));
+  logging::getLogStream().printf("light: brightness level: %d‰, power counter: %d, wattage level: %d watts\n", state.brightness, state.powerRaw, state.wattage);
+  logging::getLogStream().printf("light: status: 0x%04X, reserved: 0x%04X, flags: 0x%08X\n", state.status, state.reserved, state.flags);
+}
 
+// Poll the state fast while the brightness is changing and slowly when idle
+void pollState()
+{
+  if (stm32Bootloader)
+    return;
+  unsigned long now = millis();
+  unsigned long interval = ((long)(fastPollEndTime - now) > 0) ? STATE_POLL_FAST : STATE_POLL_SLOW;
+  if (now - lastStatePollTime >= interval)
+  {
+    lastStatePollTime = now;
+    queueCommand(CMD_GET_STATE, NULL, 0);
+  }
 }
 
-void processReceivedPacket(uint8_t payload_cmd, uint8_t* payload, uint8_t payload_size)
+void processReceivedPacket(uint8_t payload_cmd, const uint8_t* payload, uint8_t payload_size)
 {
-  logging::getLogStream().println("light: received packet");
   // Command for getting the version of the STM firmware
   if (payload_cmd == CMD_GET_VERSION)
   {
-    logging::getLogStream().printf("light: STM Firmware version: %s\n", helpers::hexToStr(payload, payload_size));
-    if (payload[0] != 0x3F || payload[1] != 0x02)
-      logging::getLogStream().printf("light: STM Firmware is 0x%02X,0x%02X. It should be 0x3F,0x02\n", payload[0], payload[1]);
+    // Only logged after a reset, not for the heartbeat
+    if (!cmdVersionReceived)
+    {
+      logging::getLogStream().printf("light: STM Firmware version: %s\n", helpers::hexToStr(payload, payload_size));
+      if (payload_size >= 2 && (payload[0] != STM32_EXPECTED_VERSION_0 || payload[1] != STM32_EXPECTED_VERSION_1))
+      {
+        logging::getLogStream().printf("light: STM Firmware is 0x%02X,0x%02X. It should be 0x%02X,0x%02X\n", payload[0], payload[1],
+                                       STM32_EXPECTED_VERSION_0, STM32_EXPECTED_VERSION_1);
+        // Flashed from handle(), not while parsing the frames
+        if (!stm32ProvisionTried && LittleFS.exists(STM32_IMAGE_FILE))
+          stm32ProvisionPending = true;
+      }
+    }
     cmdVersionReceived=true;
   }
   // Command for getting the state (brigthness level, wattage, etc)
   else if (payload_cmd == CMD_GET_STATE)
-  {
-    logging::getLogStream().printf("light: state: %s\n", helpers::hexToStr(payload, payload_size));
-    // Bightness level: payload[3] payload[2]
-    brightness = ((payload[3] << 8) + payload[2]) / 10;
-    wattage = ((payload[7] << 8) + payload[6]) / 20;
-    logging::getLogStream().printf("light: brightness level: %d%%\n", brightness);
-    logging::getLogStream().printf("light: wattage level: %d watts\n", wattage);
-
-    // To be done: other state values
-    // See here:
-    // https://github.com/arendst/Tasmota/issues/6914
-    // https://github.com/KoljaWindeler/ESP8266_mqtt_pwm_pir_temp/blob/master/JKW_MQTT_PWM_PIR_TEMP/src/src/cap_shelly_dimmer.cpp#L49
-    // https://github.com/KoljaWindeler/ESP8266_mqtt_pwm_pir_temp/blob/a3db486daedcd629183dabf4c0cd33842dca4f19/JKW_MQTT_PWM_PIR_TEMP/src/src/cap_shelly_dimmer.cpp#L108
-    // https://github.com/wichers/shelly_dimmer/blob/master/shelly_dimmer.cpp#L286
-    // https://gist.github.com/wichers/3c401f6dc6c61b4175ace7bc08cb6f8a -> 100% matching calibration algorithm
-
-    /*
-       Power 116 W
-      at 75% -> 00 00 EE 02 00 00 78 09 00 00 00 80 00 00 00 00 -> 2424   -> Shelly firmware: 121 W
-      at 50% -> 00 00 F4 01 00 00 E1 05 00 00 00 80 00 00 00 00 -> 1505   -> Shelly firmware: 77 W
-      at 25% -> 00 00 FA 00 00 00 91 01 00 00 00 80 00 00 00 00 -> 401    -> Shelly firmware: 21 W
-
-      Power 46 w
-      at 75% -> 00 00 EE 02 00 00 C5 03 00 00 00 80 00 00 00 00 -> 965
-      at 50% -> 00 00 F4 01 00 00 66 02 00 00 00 80 00 00 00 00 -> 614
-      at 25% -> 00 00 FA 00 00 00 AB 00 00 00 00 80 00 00 00 00 -> 171
-
-    */
-  }
+    decodeState(payload, payload_size);
   else if (payload_cmd == CMD_SET_BRIGHTNESS)
     logging::getLogStream().printf("light: acknowledgement frame for changing brightness: %s\n", helpers::hexToStr(payload, payload_size));
   else if (payload_cmd == CMD_SET_BRIGHTNESS_ADVANCED)
@@ -297,88 +1480,154 @@ void processReceivedPacket(uint8_t payload_cmd, uint8_t* payload, uint8_t payloa
     logging::getLogStream().printf("light: unknown command: 0x%02X\n", payload_cmd);
 }
 
-void receivePacket() {
-  while (Serial.available() > 0)
+// Process all the complete frames available in the ring buffer
+void parseFrames()
+{
+  const uint8_t *frame;
+  uint16_t len;
+  stm32frames::Result result;
+  while ((result = stm32frames::next(frame, len)) != stm32frames::FRAME_NONE)
   {
-    uint8_t b = Serial.read();
-    //logging::getLogStream().printf("rx_idx: %d  byte: %02X\n", rx_idx, b);
-    rx_buffer[rx_idx] = b;
-
-    if (rx_idx == 0 && b != _packet_start_marker) { // start marker
-      logging::getLogStream().printf("light: received wrong start marker: 0x%02X\n", b);
-      rx_idx = 0;
-      continue;
+    if (result == stm32frames::FRAME_BAD_CRC)
+    {
+      logging::getLogStream().printf("light: received wrong checksum for command 0x%02X\n", frame[2]);
+      trace::record(trace::TRACE_RX, trace::TRACE_BAD_CRC, frame, len);
+      countLinkEvent(LINK_CRC_ERRORS);
+    }
+    else if (result == stm32frames::FRAME_BAD_END)
+    {
+      logging::getLogStream().printf("light: received wrong end marker: 0x%02X\n", frame[len - 1]);
+      trace::record(trace::TRACE_RX, trace::TRACE_BAD_END, frame, len);
+      countLinkEvent(LINK_END_ERRORS);
+    }
+    else
+    {
+      trace::record(trace::TRACE_RX, trace::TRACE_OK, frame, len);
+      countLinkEvent(LINK_FRAMES);
+      lastValidFrameTime = millis();
+      // packet counter and command are the same as the command in flight
+      acknowledgeCommand(frame[1], frame[2]);
+
+      // Process the packet which has just been received. The payload points into the ring buffer
+      processReceivedPacket(frame[2], &frame[4], frame[3]);
     }
+  }
+}
 
-    if (rx_idx == rx_buffer_size - 1) {
+void receivePacket()
+{
+  // The serial link is used by the bootloader while the STM32 firmware is updated
+  if (stm32Bootloader)
+    return;
+
+  // Move everything waiting in the UART FIFO into the ring buffer and process all the complete frames
+  while (Serial.available() > 0)
+  {
+    uint16_t room = stm32frames::room();
+    if (room == 0)
+    {
+      // Should not happen since a frame is always smaller than the ring buffer
       logging::getLogStream().println(F("light: rx buffer overflow"));
-      rx_idx = 0;
+      trace::record(trace::TRACE_RX, trace::TRACE_OVERFLOW, NULL, 0);
+      countLinkEvent(LINK_OVERFLOWS);
+      stm32frames::resync();
       continue;
     }
-
-    if (rx_idx == 1 && b != _packet_counter - 1) { // packet counter is same as previous tx packet
-      logging::getLogStream().printf("light: packet counter seems to be wrong: 0x%02X\n", b);
-      //rx_idx = 0;
-      //continue;
-    }
-
-    if (rx_idx == 2) { // command
-      rx_payload_cmd = b;
+    while (room > 0 && Serial.available() > 0)
+    {
+      stm32frames::push(Serial.read());
+      room--;
     }
+    lastRxTime = millis();
+    parseFrames();
+  }
 
-    if (rx_idx == 3) { // payload size
-      rx_payload_size = b;
-      if (rx_payload_size > rx_max_payload_size)
-        logging::getLogStream().printf("light: overflow with payload size %d\n", rx_payload_size);
-    }
+  uint16_t len;
+  const uint8_t *frame = stm32frames::pending(len);
+  if (frame != NULL && millis() - lastRxTime > RX_FRAME_TIMEOUT)
+  {
+    logging::getLogStream().printf("light: incomplete frame of %d bytes dropped\n", len);
+    trace::record(trace::TRACE_RX, trace::TRACE_TIMEOUT, frame, len);
+    countLinkEvent(LINK_RX_TIMEOUTS);
+    stm32frames::resync();
+    parseFrames();
+  }
 
-    if (rx_idx == (3 + rx_payload_size + 2)) { // checksum
-      uint16_t c = (rx_buffer[rx_idx - 1] << 8) + b;
-      if (c != crc(rx_buffer, rx_idx - 1)) {
-        logging::getLogStream().printf("light: received wrong checksum at rx_idx: %d\n", rx_idx);
-        rx_idx = 0;
-        continue;
-      }
-      // Copy the payload
-      if (rx_payload_size > 0)
-      {
-        memcpy(rx_payload, &rx_buffer[rx_idx - 1 - rx_payload_size], rx_payload_size);
-      }
-    }
+  // A single line for all the bytes dropped instead of one line per byte
+  uint16_t skipped = stm32frames::takeSkipped();
+  if (skipped > 0)
+  {
+    logging::getLogStream().printf("light: skipped %d bytes while looking for the start marker\n", skipped);
+    trace::record(trace::TRACE_RX, trace::TRACE_SKIPPED, NULL, skipped);
+    countLinkEvent(LINK_SKIPPED_BYTES, skipped);
+  }
+}
 
-    if (rx_idx == (3 + rx_payload_size + 3) && b != _packet_end_marker) { // end marker
-      logging::getLogStream().printf("light: received wrong end marker: 0x%02X\n", b);
-      rx_idx = 0;
-      continue;
-    }
+// Change the brightness (STM32 level in per-mille); with a transition (in ms), the ramp is done by the fade engine of the STM32
+// Only the last value is kept; it is sent by flushBrightness() from handle()
+void sendCmdSetBrightness(uint16_t level, uint16_t transition)
+{
+  //logging::getLogStream().printf("light: set brightness to %d‰\n", level);
+  levels::request(level, transition);
 
-    if (rx_idx == (3 + rx_payload_size + 3)) { // end marker
-      //logging::getLogStream().println(F("light: received packet"));
-      //helpers::hexToStr(rx_buffer, rx_idx + 1);
-      // Process the packet which has just been received
-      processReceivedPacket(rx_payload_cmd, rx_payload, rx_payload_size);
-      rx_idx = 0;
-      continue;
-    }
+  // Poll the state faster while the brightness is changing
+  fastPollEndTime = millis() + transition + STATE_FAST_POLL_DURATION;
+}
 
-    rx_idx++;
-  }
+void sendCmdSetBrightness(uint16_t level)
+{
+  sendCmdSetBrightness(level, 0);
 }
 
-ICACHE_RAM_ATTR void sendCmdSetBrightness(uint8_t b)
+// Send the last requested brightness, at most once per loop and every BRIGHTNESS_MIN_INTERVAL
+// Nothing is sent while the previous brightness frame is not acknowledged
+void flushBrightness()
 {
-  //logging::getLogStream().printf("light: set brightness to %d‰\n", b);
+  if (millis() - lastBrightnessFrameTime < BRIGHTNESS_MIN_INTERVAL)
+    return;
+  if (isQueued(CMD_SET_BRIGHTNESS) || isQueued(CMD_SET_BRIGHTNESS_ADVANCED))
+    return;
 
-  /*
+  uint16_t level, transition;
+  if (!levels::take(level, transition))
+    return;
+
+  uint16_t fadeRate = 0;                // 0 to jump to the level
+  uint16_t delta = abs(level - sentLevel);
+  if (transition > 0 && delta > 0)
+  {
     // see https://github.com/wichers/shelly_dimmer/blob/master/shelly_dimmer.cpp#L210
+    // and https://github.com/arendst/Tasmota/blob/development/tasmota/tasmota_xdrv_driver/xdrv_45_shelly_dimmer.ino
+    // The fade rate is the change of the brightness level (in per-mille) at each fade tick of the STM32
+    // The whole transition is done by the STM32: beyond the range of the fade rate, it is shorter or longer than requested
+    fadeRate = ((uint32_t)delta * FADE_TICK_DURATION + transition - 1) / transition;
+    if (fadeRate < FADE_RATE_MIN)
+      fadeRate = FADE_RATE_MIN;
+    if (fadeRate > FADE_RATE_MAX)
+      fadeRate = FADE_RATE_MAX;
+  }
+
+  bool queued;
+  if (fadeRate == 0)
+  {
+    uint8_t payload[] = { (uint8_t)level, (uint8_t)(level >> 8)};             // brightness level in per-mille (little endian)
+    queued = queueCommand(CMD_SET_BRIGHTNESS, payload, sizeof(payload));
+  }
+  else
+  {
     uint8_t payload[] = {
-    (uint8_t)(b * 1), (uint8_t)((b * 1) >> 8),             // b*10 second byte, b*10 first byte (little endian)
-    0x00, 0x00,
-    0x00, 0x00                                            // fade_rate
+      (uint8_t)level, (uint8_t)(level >> 8),          // brightness level in per-mille (little endian)
+      0x00, 0x00,
+      (uint8_t)fadeRate, (uint8_t)(fadeRate >> 8)     // fade_rate (little endian)
     };
-    sendCommand(CMD_SET_BRIGHTNESS_ADVANCED, payload, sizeof(payload));*/
-  uint8_t payload[] = { (uint8_t)(b * 10), (uint8_t)((b * 10) >> 8)};             // b*10 second byte, b*10 first byte (little endian)
-  sendCommand(CMD_SET_BRIGHTNESS, payload, sizeof(payload));
+    queued = queueCommand(CMD_SET_BRIGHTNESS_ADVANCED, payload, sizeof(payload));
+  }
+  if (queued)
+  {
+    sentLevel = level;
+    lastBrightnessFrameTime = millis();
+    brightnessFrames++;
+  }
 }
 
 void sendCmdSetDimmingParameters(uint8_t dimmingType, uint8_t debounce)
@@ -400,21 +1649,17 @@ void sendCmdSetDimmingParameters(uint8_t dimmingType, uint8_t debounce)
   payload[2] = dimmingType;
   // Set the anti-flickering debounce parameter
   payload[6] = debounce;
-  // Send the frame to change the dimming parameters
-  sendCommand(CMD_SET_DIMMING_PARAMETERS, payload, sizeof(payload));
-  // This is needed otherwise the STM32 stop working (most probably serial overflow)
-  delay(12);
-  receivePacket();
+  // Send the frames to change the dimming parameters
+  // They are paced by the acknowledgements of the STM32, otherwise it stops working (most probably serial overflow)
+  pendingDimmingType = dimmingType;
+  pendingDebounce = debounce;
+  dimmingParamsInQueue = true;
+  dimmingParamsLost = false;
+  queueCommand(CMD_SET_DIMMING_PARAMETERS, payload, sizeof(payload));
 
   // I do not knwo the use of this but this is needed for changing the dimming type trailinh/heading edge
-  uint8_t payload2[0xC8] = {0x00};
-  sendCommand(CMD_SET_DIMMING_TYPE_2, payload2, sizeof(payload2));
-  delay(12);
-  receivePacket();
-
-  sendCommand(CMD_SET_DIMMING_TYPE_3, payload2, sizeof(payload2));
-  delay(12);
-  receivePacket();
+  queueCommand(CMD_SET_DIMMING_TYPE_2, NULL, 0xC8);
+  queueCommand(CMD_SET_DIMMING_TYPE_3, NULL, 0xC8);
 }
 
 void setBlinkingDuration(const char* durationStr)
@@ -436,14 +1681,22 @@ void setBlinkingDuration(const char* durationStr)
 
 }
 
+void applyBlinkingStep()
+{
+  sendCmdSetBrightness(levels::toSTM32(blinkingStepLevel[blinkingStep]));
+}
+
 void startBlinking()
 {
   logging::getLogStream().printf("light: start blinking\n");
-  // start blinking
-  blinkingLightState = false;              // light should be switched on
-  lastBlinkingLightStateTime = millis();   // reset blinking timer
-  startBlinkingTime = millis();            // Save the stating time of blinking
+  effects::cancel();
+  // start blinking with the first step of the pattern
+  blinkingStep = 0;
+  blinkingCycleStartTime = millis();
+  nextBlinkingTime = blinkingCycleStartTime + blinkingStepEnd[0];
+  startBlinkingTime = blinkingCycleStartTime;    // Save the stating time of blinking
   blinking = true;
+  applyBlinkingStep();
 }
 
 void stopBlinking()
@@ -451,78 +1704,127 @@ void stopBlinking()
   logging::getLogStream().printf("light: stop blinking\n");
   // stopping blinking
   // Comme back to the initial brightness level
-  sendCmdSetBrightness(brightness);
+  sendCmdSetBrightness(levels::toSTM32(brightness));
   blinking = false;
 }
 
+// Move to the step which contains currTime; usually only the next one
+void updateBlinking(unsigned long currTime)
+{
+  uint32_t cycleDuration = blinkingStepEnd[blinkingNbSteps - 1];
+  // If the loop has been stalled for more than a cycle, skip the whole cycles
+  if (currTime - blinkingCycleStartTime >= 2 * cycleDuration)
+    blinkingCycleStartTime += ((currTime - blinkingCycleStartTime) / cycleDuration - 1) * cycleDuration;
+  do
+  {
+    blinkingStep++;
+    if (blinkingStep == blinkingNbSteps)
+    {
+      // At the end of the pattern, we come back
+      blinkingStep = 0;
+      blinkingCycleStartTime += cycleDuration;
+    }
+    nextBlinkingTime = blinkingCycleStartTime + blinkingStepEnd[blinkingStep];
+  }
+  while ((long)(currTime - nextBlinkingTime) >= 0);
+  applyBlinkingStep();
+}
+
 void setBlinkingPattern(const char *payload)
 {
-  // payload should contain a sequence of int for the pattern of the blink (duration in ms for the light on, light off, etc)
-  uint8_t nbPattern = 0;
-  if (payload!=nullptr)
+  // payload should contain a sequence of steps separated by spaces or commas
+  // Each step is "duration" or "duration:level", with the duration in tenths of second and the level in percent (e.g. 12.5)
+  // Without level, the steps alternate between on and off, starting with on
+  uint8_t nbSteps = 0;
+  uint32_t cycleDuration = 0;
+  if (payload != nullptr)
   {
-    logging::getLogStream().printf("light: setting pattern to %s\n",payload);
-    uint16_t strl = strlen(payload);
-    memset(blinkingPattern, 0x00, sizeof(blinkingPattern));
-    int i=0, j=0;
-    char temp[10];
-    memset(temp,0x00,sizeof(temp));
-    for (i = 0; i <= strl; i++)
+    logging::getLogStream().printf("light: setting pattern to %s\n", payload);
+    const char *p = payload;
+    while (*p != '\0' && nbSteps < BLINK_MAX_STEPS)
     {
-      if (i == strl || payload[i]<'0' || payload[i]>'9')
+      // Skip the separators
+      if (*p < '0' || *p > '9')
       {
-        if (helpers::isInteger(temp, sizeof(temp) - 1))
-        {
-          if (nbPattern < 10)
-          {
-            blinkingPattern[nbPattern] = atoi(temp)*100;
-            logging::getLogStream().printf("light: adding pattern %d\n",blinkingPattern[nbPattern]);
-            if (blinkingPattern[nbPattern]<200)
-            {
-              logging::getLogStream().printf("light: pattern duration to short. Set to 200\n");
-              blinkingPattern[nbPattern]=200;
-            }
-            nbPattern++;
-          }
-        }
-        j = 0;
-        memset(temp,0x00,sizeof(temp));
+        p++;
+        continue;
       }
-      else
+      char *end;
+      uint32_t duration = strtoul(p, &end, 10) * 100;
+      uint16_t level = (nbSteps % 2 == 0) ? 1000 : 0;
+      if (*end == ':' && end[1] >= '0' && end[1] <= '9')
       {
-        if (j < sizeof(temp) - 1)
+        unsigned long l = strtoul(end + 1, &end, 10) * 10;
+        if (*end == '.' && end[1] >= '0' && end[1] <= '9')
         {
-          temp[j] = payload[i];
-          j++;
+          l += end[1] - '0';
+          strtoul(end + 1, &end, 10);
         }
+        level = (l > 1000) ? 1000 : l;
+      }
+      p = end;
+      if (duration < BLINK_MIN_STEP_DURATION)
+      {
+        logging::getLogStream().printf("light: pattern duration to short. Set to %d\n", BLINK_MIN_STEP_DURATION);
+        duration = BLINK_MIN_STEP_DURATION;
       }
+      cycleDuration += duration;
+      blinkingStepEnd[nbSteps] = cycleDuration;
+      blinkingStepLevel[nbSteps] = level;
+      nbSteps++;
     }
-    logging::getLogStream().printf("light: new blinking pattern %d %d %d %d %d %d %d %d %d %d\n",
-                                    blinkingPattern[0],blinkingPattern[1],blinkingPattern[2],blinkingPattern[3],blinkingPattern[4],
-                                    blinkingPattern[5],blinkingPattern[6],blinkingPattern[7],blinkingPattern[8],blinkingPattern[9]);
   }
-  if (nbPattern<2)
+  if (nbSteps < 2)
   {
     // If the blinking pattern is malformed (i.e. sequence smaller than 2)
     logging::getLogStream().printf("light: blinking pattern to short or not defined. Set back to default value\n");
-    memset(blinkingPattern,0x00,sizeof(blinkingPattern));
-    blinkingPattern[0]=500;
-    blinkingPattern[1]=500;
+    blinkingStepEnd[0] = 500;
+    blinkingStepEnd[1] = 1000;
+    blinkingStepLevel[0] = 1000;
+    blinkingStepLevel[1] = 0;
+    nbSteps = 2;
   }
+  blinkingNbSteps = nbSteps;
+  logging::getLogStream().printf("light: new blinking pattern with %d steps, cycle of %d ms\n",
+                                 blinkingNbSteps, blinkingStepEnd[blinkingNbSteps - 1]);
+}
+
+// For the effects: level in Q16 of the brightness window
+// The brightness of the light is not changed
+void setEffectLevel(uint16_t level)
+{
+  sendCmdSetBrightness(levels::fromWindow(level));
+}
+
+void restoreBrightness()
+{
+  sendCmdSetBrightness(levels::toSTM32(brightness));
+}
+
+void startEffect(const char *payload)
+{
+  if (blinking)
+    stopBlinking();
+  effects::start(payload);
 }
 
 void mqttCallback(const char* paramID, const char* payload)
 {
+  // For switching on/off, an optional payload gives the transition time in ms
+  uint16_t transition = TRANSITION_DEFAULT;
+  if (helpers::isInteger(payload, 5))
+    helpers::convertToInteger(payload, transition, 5);
+
   if (strcmp(paramID, "subMqttLightOn") == 0 || strcmp(paramID, "subMqttLightAllOn") == 0)
   {
-    lightOn();
+    lightOn(false, transition);
   }
   else if (strcmp(paramID, "subMqttLightToggle") == 0)
   {
-    lightToggle();
+    lightToggle(false, transition);
   }
   else if (strcmp(paramID, "subMqttLightOff") == 0 || strcmp(paramID, "subMqttLightAllOff") == 0)
-    lightOff();
+    lightOff(transition);
   else if (strcmp(paramID, "subMqttBlinkingPattern") == 0)
   {
     setBlinkingPattern(payload);
@@ -533,17 +1835,45 @@ void mqttCallback(const char* paramID, const char* payload)
   {
     setBlinkingDuration(payload);
   }
+  else if (strcmp(paramID, "subMqttBrightness") == 0)
+  {
+    setBrightnessPercent(payload, TRANSITION_DEFAULT);
+  }
+  else if (strcmp(paramID, "subMqttEffect") == 0)
+  {
+    startEffect(payload);
+  }
+  else if (strcmp(paramID, "subMqttSTM32Fetch") == 0)
+  {
+    // "<url>", the progress and the CRC are published on pubMqttSTM32Update
+    // The image is always flashed in diff mode, " diff" after the URL is accepted for compatibility
+    char url[100];
+    if (strlen(payload) >= sizeof(url))
+    {
+      char msg[80];
+      sprintf(msg, "STM32 image: the URL is longer than %d characters", (int)sizeof(url) - 1);
+      logging::getLogStream().printf("light: %s\n", msg);
+      const char* topic = wifi::getParamValueFromID("pubMqttSTM32Update");
+      if (topic != NULL)
+        mqtt::publishMQTT(topic, msg);
+      return;
+    }
+    strcpy(url, payload);
+    char *diff = strstr(url, " diff");
+    if (diff != NULL)
+      *diff = 0x00;
+    startFlashJobFromURL(url);
+  }
 }
 
 void sendCmdGetVersion()
 {
-  sendCommand(CMD_GET_VERSION, 0, 0);
+  queueCommand(CMD_GET_VERSION, NULL, 0);
 }
 
 void sendCmdGetState()
 {
-  logging::getLogStream().printf("light: get state\n");
-  sendCommand(CMD_GET_STATE, NULL, 0);
+  queueCommand(CMD_GET_STATE, NULL, 0);
 }
 
 void setDimmingParameters(const char* dimmingTypeStr, const char* debounceStr)
@@ -567,37 +1897,35 @@ void setDimmingParameters(const char* dimmingTypeStr, const char* debounceStr)
       debounce = 150;
   }
 
-  sendCmdSetDimmingParameters(dimmingType, debounce);
+  // The frames are sent by processCommandQueue() if the STM32 does not already have these values
+  requestedDimmingType = dimmingType;
+  requestedDebounce = debounce;
 }
 
 void setMinBrightness(const char* str)
 {
-  if (!helpers::isInteger(str, 3))
-    return;
-
   // Make the conversion
-  minBrightness = atoi (str);
-
-  // Check if minBrightness between 0 and 200
-  if (minBrightness < 0)
-    minBrightness = 0;
-  if (minBrightness > 20)
-    minBrightness = 20;
+  uint16_t b;
+  if (!helpers::convertPercentToPerMille(str, b, 5))
+    return;
+  levels::setMinimum(b);
 }
 
 void setMaxBrightness(const char* str)
 {
-  if (!helpers::isInteger(str, 3))
-    return;
-
   // Make the conversion
-  maxBrightness = atoi (str);
+  uint16_t b;
+  if (!helpers::convertPercentToPerMille(str, b, 5))
+    return;
+  levels::setMaximum(b);
+}
 
-  // Check if maxBrightness between minBrightness and 1000
-  if (maxBrightness < minBrightness)
-    maxBrightness = minBrightness;
-  if (maxBrightness > 100)
-    maxBrightness = 100;
+void setBrightnessCurve(const char* str)
+{
+  uint16_t c = BRIGHTNESS_CURVE_LINEAR;
+  if (!helpers::convertToInteger(str, c, 1))
+    c = BRIGHTNESS_CURVE_LINEAR;
+  levels::setCurve(c);
 }
 
 void setAutoOffTimer(const char* str)
@@ -610,13 +1938,51 @@ void setAutoOffTimer(const char* str)
   autoOffDuration = atoi (str);
 }
 
-void setBrightness(uint8_t b)
+void setSTM32FlashBaud(const char* str)
+{
+  uint32_t baud = (str != NULL) ? strtoul(str, NULL, 10) : 0;
+  if (baud >= 9600 && baud <= STM32_FLASH_MAX_BAUD)
+    stm32FlashBaud = baud;
+  else
+    stm32FlashBaud = STM32_FLASH_DEFAULT_BAUD;
+}
+
+void setTransitionTime(const char* str)
+{
+  uint16_t t = 0;
+  if (helpers::convertToInteger(str, t, 5))
+    transitionTime = t;
+  else
+    transitionTime = 0;
+}
+
+// b: user level in per-mille
+void setBrightness(uint16_t b, uint16_t transition)
 {
-  sendCmdSetBrightness(b);
+  // A new brightness stops the effect
+  effects::cancel();
+  if (b > 1000)
+    b = 1000;
+  if (transition == TRANSITION_DEFAULT)
+    transition = transitionTime;
+  sendCmdSetBrightness(levels::toSTM32(b), transition);
   brightness = b;
 }
 
-ICACHE_RAM_ATTR void lightOn(bool noLightAutoTurnOff)
+// str: brightness in percent, with an optional decimal (e.g. 12.5)
+bool setBrightnessPercent(const char* str, uint16_t transition)
+{
+  uint16_t b;
+  if (!helpers::convertPercentToPerMille(str, b, 6) || b > 1000)
+  {
+    logging::getLogStream().printf("light: wrong value for the brightness: %s\n", str);
+    return false;
+  }
+  setBrightness(b, transition);
+  return true;
+}
+
+void lightOn(bool noLightAutoTurnOff, uint16_t transition)
 {
   //logging::getLogStream().printf("light: switch on\n");
   if (noLightAutoTurnOff==true)
@@ -627,51 +1993,41 @@ ICACHE_RAM_ATTR void lightOn(bool noLightAutoTurnOff)
   else
     // Reset auto turn off timer
     lastLightOnTime=millis();
-  setBrightness(maxBrightness);
-  brightness = maxBrightness;
+  setBrightness(1000, transition);
 }
 
-ICACHE_RAM_ATTR void lightOff()
+void lightOff(uint16_t transition)
 {
   //logging::getLogStream().printf("light: switch off\n");
   lastLightOnTime = 0;
   lightAutoTurnOffDisable =false;
-  setBrightness(minBrightness);
-  brightness = minBrightness;
+  setBrightness(0, transition);
 }
 
-ICACHE_RAM_ATTR void lightToggle(bool noLightAutoTurnOff)
+void lightToggle(bool noLightAutoTurnOff, uint16_t transition)
 {
-  // If brighness different from minBrightness
-  if (brightness == minBrightness)
-  {
-    if (noLightAutoTurnOff==true)
-    {
-      lightAutoTurnOffDisable =true;
-      lastLightOnTime=0;
-    }
-    else
-      // Reset auto turn off timer
-      lastLightOnTime=millis();
-
-    // Switch on the light
-    sendCmdSetBrightness(maxBrightness);
-    brightness = maxBrightness;
-  }
+  // If the light is off
+  if (brightness == 0)
+    lightOn(noLightAutoTurnOff, transition);
   else
-  {
-    // Set the timer to 0
-    lastLightOnTime = 0;
-    lightAutoTurnOffDisable =false;
-    // Switch off te light
-    sendCmdSetBrightness(minBrightness);
-    brightness = minBrightness;
-  }
+    lightOff(transition);
+}
+
+bool lightIsOn()
+{
+  return brightness != 0;
 }
 
-ICACHE_RAM_ATTR bool lightIsOn()
+// Switch the load off at once: the level 0 is sent as is, not mapped into the window whose minimum
+// may keep the light on, and the blinking and the effect are stopped without restoring the brightness
+void cutOff()
 {
-  return brightness != minBrightness;
+  effects::cancel();
+  blinking = false;
+  levels::cutOff();
+  fastPollEndTime = millis() + STATE_FAST_POLL_DURATION;
+  brightness = 0;
+  lastLightOnTime = 0;
 }
 
 void setup()
@@ -679,7 +2035,15 @@ void setup()
   pinMode(STM_NRST_PIN, OUTPUT);
   pinMode(STM_BOOT0_PIN, OUTPUT);
   delay(50);
-  sendCmdGetVersion();
+  // The queue is on hold until the STM32 answers to this one
+  sendCommand(CMD_GET_VERSION, NULL, 0);
+  linkState = LINK_BOOTING;
+  linkStateTime = millis();
+  linkVersionSent = true;
+  linkBucketTime = linkStateTime;
+
+  // Load the power calibration
+  calibration::setup();
 }
 
 void updateParams()
@@ -687,15 +2051,19 @@ void updateParams()
   logging::getLogStream().printf("light: updateParams\n");
   setMinBrightness(wifi::getParamValueFromID("minBrightness"));
   setMaxBrightness(wifi::getParamValueFromID("maxBrightness"));
+  setBrightnessCurve(wifi::getParamValueFromID("brightnessCurve"));
   setAutoOffTimer(wifi::getParamValueFromID("autoOffTimer"));
+  setTransitionTime(wifi::getParamValueFromID("transitionTime"));
+  setDimmingParameters(wifi::getParamValueFromID("dimmingType"), wifi::getParamValueFromID("flickerDebounce"));
+  setSTM32FlashBaud(wifi::getParamValueFromID("stm32FlashBaud"));
 }
 
   
 void handleUploadSTM32Firmware()
 {
-  char temp[700];
+  char temp[1200];
 
-  snprintf ( temp, 700,
+  snprintf ( temp, 1200,
              "<!DOCTYPE html>\
               <html>\
                 <head>\
@@ -706,9 +2074,12 @@ void handleUploadSTM32Firmware()
                 </head>\
                 <body>\
                   <form action=\"/doUploadSTM32Firmware\" method=\"post\" enctype=\"multipart/form-data\">\
-                    <input type=\"file\" name=\"data\">\
+                    <input type=\"file\" name=\"data\" accept=\".bin,.hex,.gz\">\
                     <button>Update STM32 Firmware</button>\
+                    <button formaction=\"/doUploadSTM32Firmware?diff=1\">Update only the changed pages</button>\
+                    <button formaction=\"/doUploadSTM32Firmware?store=1\">Store for the automatic update</button>\
                    </form>\
+                  <p><a href=\"/downloadSTM32Firmware\">Download a backup of the STM32 flash</a></p>\
                 </body>\
               </html>");
   wifi::getWifiManager().server.get()->send ( 200, "text/html", temp );
@@ -720,30 +2091,253 @@ void handleDoUploadSTM32Firmware()
   if (wifi::getWifiManager().server.get()->uri() != "/doUploadSTM32Firmware")
     return;
   HTTPUpload& upload = wifi::getWifiManager().server.get()->upload();
+  // The firmware is first stored on LittleFS, then flashed from loop() by handleFlashJob()
+  static File imageFile;
   if (upload.status == UPLOAD_FILE_START)
   {
-    logging::getLogStream().printf("wifi: start uploading STM32 firmware\n");
-    memset(stm32FirmwareUpdMsg,0x00,sizeof(stm32FirmwareUpdMsg));
-    if (STM32FlashBegin()==false)
+    if (isFlashJobRunning())
+      sprintf(stm32FirmwareUpdMsg,"the STM32 firmware is already being updated");
+    else
+    {
+      logging::getLogStream().printf("wifi: start storing STM32 firmware in %s\n", STM32_UPLOAD_FILE);
+      imageFile = LittleFS.open(STM32_UPLOAD_FILE, "w");
+      if (!imageFile)
+        sprintf(stm32FirmwareUpdMsg,"failed to open %s", STM32_UPLOAD_FILE);
+      else
+        memset(stm32FirmwareUpdMsg,0x00,sizeof(stm32FirmwareUpdMsg));
+    }
+  }
+  else if (upload.status == UPLOAD_FILE_WRITE && imageFile)
+  {
+    if (imageFile.write(upload.buf, upload.currentSize) != upload.currentSize)
     {
-      // Fail to init the STM32. Close the connection
-      wifi::getWifiManager().server.get()->send(500, F("text / plain"), F("Failed to init the STM32. RX and TX lines should be disconnected"));
-      WiFiClient theClient=wifi::getWifiManager().server.get()->client();
-      theClient.stop();
+      sprintf(stm32FirmwareUpdMsg,"failed to write %s, not enough space on LittleFS", STM32_UPLOAD_FILE);
+      imageFile.close();
+      LittleFS.remove(STM32_UPLOAD_FILE);
     }
   }
-  else if (upload.status == UPLOAD_FILE_WRITE)
+  else if (upload.status == UPLOAD_FILE_ABORTED)
   {
-    STM32FlashUpload(upload.buf, upload.currentSize);
+    // The truncated upload is never flashed nor stored
+    if (imageFile)
+      imageFile.close();
+    LittleFS.remove(STM32_UPLOAD_FILE);
+    sprintf(stm32FirmwareUpdMsg,"STM32 firmware upload aborted");
+    logging::getLogStream().printf("wifi: %s\n", stm32FirmwareUpdMsg);
   }
-  else if (upload.status == UPLOAD_FILE_END)
+  else if (upload.status == UPLOAD_FILE_END && imageFile)
   {
-    STM32FlashEnd();
-    // If not message, the firmware update has succeeded
-    if (strlen(stm32FirmwareUpdMsg)==0)
-      sprintf(stm32FirmwareUpdMsg,"STM32 firmware update succeeded");
+    imageFile.close();
+    // With ?store=1, the firmware is only stored for the automatic update
+    if (wifi::getWifiManager().server.get()->hasArg("store"))
+    {
+      // LittleFS replaces the destination of a rename, the known-good image is never missing
+      if (LittleFS.rename(STM32_UPLOAD_FILE, STM32_IMAGE_FILE))
+      {
+        sprintf(stm32FirmwareUpdMsg,"STM32 firmware stored in %s (%u bytes)", STM32_IMAGE_FILE, (unsigned int)upload.totalSize);
+        // A new image is tried again if the STM32 has not the expected version
+        stm32ProvisionTried = false;
+      }
+      else
+      {
+        sprintf(stm32FirmwareUpdMsg,"failed to store the STM32 firmware in %s", STM32_IMAGE_FILE);
+        LittleFS.remove(STM32_UPLOAD_FILE);
+      }
+    }
+    // With ?diff=1, only the pages which differ from the flash are erased and written
+    else if (startFlashJob(STM32_UPLOAD_FILE, wifi::getWifiManager().server.get()->hasArg("diff")))
+      sprintf(stm32FirmwareUpdMsg,"STM32 firmware update started (%u bytes), progress on /stm32update", (unsigned int)upload.totalSize);
+  }
+  if (upload.status == UPLOAD_FILE_END)
+    logging::getLogStream().printf("wifi: %s\n", stm32FirmwareUpdMsg);
+}
+
+// Backup of the STM32 flash: read by blocks of 256 bytes from handle() and sent in HTTP chunks as they are read,
+// the image is not buffered. The CRC of the bytes sent is given in the trailer of the answer (X-STM32-CRC),
+// the bootloader of the STM32F0 has no CRC command
+#define STM32_READOUT_TIMEOUT 10000     // ms without room in the TCP window before giving up
+bool stm32Readout = false;
+WiFiClient stm32ReadoutClient;          // kept after the handler has returned
+uint32_t stm32ReadoutAddr = 0;
+uint32_t stm32ReadoutCrc = STM32_CRC_INIT;
+unsigned long stm32ReadoutStart = 0;
+unsigned long stm32ReadoutTime = 0;     // last block sent
+
+void handleDownloadSTM32Firmware()
+{
+  ESP8266WebServer *server = wifi::getWifiManager().server.get();
+  if (isFlashJobRunning() || stm32Bootloader)
+  {
+    server->send(409, "text/plain", "the STM32 firmware is being updated or read");
+    return;
+  }
+  logging::getLogStream().printf("light: start reading the STM32 flash at %u bauds\n", stm32FlashBaud);
+  if (!STM32FlashInit(stm32FlashBaud))
+    STM32FlashFallback();
+  if (stm32 == NULL)
+  {
+    STM32FlashRelease();
+    sprintf(stm32FirmwareUpdMsg, "STM32 flash read-out failed: cannot connect to the bootloader");
+    logging::getLogStream().printf("light: %s\n", stm32FirmwareUpdMsg);
+    server->send(500, "text/plain", stm32FirmwareUpdMsg);
+    return;
+  }
+
+  // The answer is written directly on the connection, chunked so that the CRC can follow the data
+  char headers[300];
+  snprintf(headers, sizeof(headers),
+           "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Disposition: attachment; filename=\"stm32.bin\"\r\n"
+           "X-STM32-Size: %u\r\nTransfer-Encoding: chunked\r\nTrailer: X-STM32-CRC\r\nConnection: close\r\n\r\n",
+           stm32->dev->fl_end - stm32->dev->fl_start);
+  stm32ReadoutClient = server->client();
+  stm32ReadoutClient.write((const uint8_t*)headers, strlen(headers));
+  stm32ReadoutAddr = stm32->dev->fl_start;
+  stm32ReadoutCrc = STM32_CRC_INIT;
+  stm32ReadoutStart = stm32ReadoutTime = millis();
+  memset(stm32FirmwareUpdMsg,0x00,sizeof(stm32FirmwareUpdMsg));
+  stm32Readout = true;
+}
+
+// One block of the read-out at each loop, once the TCP window has room for it
+void handleReadout()
+{
+  if (!stm32Readout)
+    return;
+  uint32_t end = stm32->dev->fl_end;
+  uint8_t buffer[256];
+  uint32_t len = end - stm32ReadoutAddr;
+  if (len > sizeof(buffer))
+    len = sizeof(buffer);
+  stm32_err_t s_err = STM32_ERR_OK;
+  if (!stm32ReadoutClient.connected())
+    sprintf(stm32FirmwareUpdMsg, "STM32 flash read-out aborted by the client at 0x%08X", stm32ReadoutAddr);
+  else if (len > 0 && stm32ReadoutClient.availableForWrite() < (int)len + 8)
+  {
+    if (millis() - stm32ReadoutTime <= STM32_READOUT_TIMEOUT)
+      return;
+    sprintf(stm32FirmwareUpdMsg, "STM32 flash read-out: the client stopped reading at 0x%08X", stm32ReadoutAddr);
+  }
+  else if (len > 0)
+  {
+    s_err = stm32_read_memory(stm32, stm32ReadoutAddr, buffer, len);
+    if (s_err != STM32_ERR_OK && STM32FlashFallback())
+      s_err = stm32_read_memory(stm32, stm32ReadoutAddr, buffer, len);
+    if (s_err != STM32_ERR_OK)
+      sprintf(stm32FirmwareUpdMsg, "STM32 flash read-out failed at 0x%08X (error code %d)", stm32ReadoutAddr, s_err);
+    else
+    {
+      char size[8];
+      sprintf(size, "%X\r\n", len);
+      stm32ReadoutClient.write((const uint8_t*)size, strlen(size));
+      stm32ReadoutClient.write(buffer, len);
+      stm32ReadoutClient.write((const uint8_t*)"\r\n", 2);
+      stm32ReadoutCrc = stm32_sw_crc(stm32ReadoutCrc, buffer, len);
+      stm32ReadoutAddr += len;
+      stm32ReadoutTime = millis();
+      if (stm32ReadoutAddr < end)
+        return;
+    }
+  }
+
+  uint32_t start = stm32->dev->fl_start;
+  if (strlen(stm32FirmwareUpdMsg) == 0)
+  {
+    // Last chunk and trailer
+    char trailer[48];
+    sprintf(trailer, "0\r\nX-STM32-CRC: 0x%08X\r\n\r\n", stm32ReadoutCrc);
+    stm32ReadoutClient.write((const uint8_t*)trailer, strlen(trailer));
+    sprintf(stm32FirmwareUpdMsg, "STM32 flash read-out: CRC 0x%08X of %u bytes in %lu ms",
+            stm32ReadoutCrc, end - start, millis() - stm32ReadoutStart);
+  }
+  // Without the last chunk, the client sees a truncated download
+  stm32ReadoutClient.stop();
+  stm32ReadoutClient = WiFiClient();
+  stm32Readout = false;
+  STM32FlashRelease();
+  logging::getLogStream().printf("light: %s\n", stm32FirmwareUpdMsg);
+}
+
+// Update of the STM32 with the image at the URL given with "?url=", e.g. /fetchSTM32Firmware?url=http://192.168.1.10/stm32.bin.gz
+void handleFetchSTM32Firmware()
+{
+  ESP8266WebServer *server = wifi::getWifiManager().server.get();
+  if (!server->hasArg("url"))
+  {
+    server->send(400, "text/plain", "missing url");
+    return;
+  }
+  if (startFlashJobFromURL(server->arg("url").c_str()))
+    sprintf(stm32FirmwareUpdMsg, "STM32 firmware update started, progress on /stm32update");
+  else if (strlen(stm32FirmwareUpdMsg) == 0)
+    sprintf(stm32FirmwareUpdMsg, "the STM32 firmware is already being updated");
+  server->send(200, "text/plain", stm32FirmwareUpdMsg);
+}
+
+// Progress of the STM32 firmware update
+void handleFlashJobProgress()
+{
+  char temp[600];
+  snprintf(temp, sizeof(temp), "{\"state\":\"%s\",\"percent\":%d,\"size\":%u,\"written\":%u,\"message\":\"%s\",\"stats\":\"%s\"}",
+           flashJobStateStr(), flashJobPercent(), flashJobSize, flashJobDone, stm32FirmwareUpdMsg, flashJobStats);
+  wifi::getWifiManager().server.get()->send(200, "application/json", temp);
+}
+
+// Timing of the last STM32 update: the phases in ms and the histograms of the bootloader commands
+void handleFlashJobStats()
+{
+  char temp[1400];
+  char *ptr = &temp[0];
+  ptr += sprintf(ptr, "{\"phases\":{\"check\":%lu,\"write\":%lu,\"verify\":%lu},\"bytes\":%u,\"bounds\":[",
+                 flashJobCheckTime, flashJobWriteTime, flashJobVerifyTime, flashJobDone);
+  for (uint8_t i = 0; i < STM32_STAT_BUCKETS - 1; i++)
+    ptr += sprintf(ptr, "%s%u", i ? "," : "", stm32_stat_bounds[i]);
+  ptr += sprintf(ptr, "]");
+  for (uint8_t s = 0; s < STM32_STAT_NB; s++)
+  {
+    const struct stm32_stat *st = &stm32_stats[s];
+    ptr += sprintf(ptr, ",\"%s\":{\"count\":%u,\"total\":%u,\"max\":%u,\"hist\":[",
+                   stm32_stat_name((stm32_stat_t)s), st->count, st->total, st->max);
+    for (uint8_t i = 0; i < STM32_STAT_BUCKETS; i++)
+      ptr += sprintf(ptr, "%s%u", i ? "," : "", st->hist[i]);
+    ptr += sprintf(ptr, "]}");
   }
+  sprintf(ptr, "}");
+  wifi::getWifiManager().server.get()->send(200, "application/json", temp);
+}
+
+// Transition time given with "?transition=" in the HTTP request
+uint16_t getTransitionArg()
+{
+  uint16_t transition = TRANSITION_DEFAULT;
+  if (wifi::getWifiManager().server.get()->hasArg("transition"))
+    helpers::convertToInteger(wifi::getWifiManager().server.get()->arg("transition").c_str(), transition, 5);
+  return transition;
+}
 
+void handleState()
+{
+  char temp[300];
+  snprintf(temp, sizeof(temp),
+           "{\"age\":%lu,\"brightness\":%d,\"powerRaw\":%d,\"wattage\":%d,\"status\":%d,\"reserved\":%d,\"flags\":%u,\"raw\":\"%s\"}",
+           state.timestamp ? millis() - state.timestamp : 0, state.brightness, state.powerRaw, state.wattage,
+           state.status, state.reserved, state.flags, state.size ? helpers::hexToStr(state.raw, min((size_t)state.size, sizeof(state.raw))) : "");
+  wifi::getWifiManager().server.get()->send(200, "application/json", temp);
+}
+
+// Health of the link to the STM32
+void handleLink()
+{
+  char temp[1024];
+  char *ptr = &temp[0];
+  ptr += sprintf(ptr, "{\"state\":\"%s\",\"backoff\":%u,\"lastValidFrame\":%lu,\"ackLatencyMax\":%u,\"total\":{",
+                 LINK_STATE_STR[linkState], linkBackoff, millis() - lastValidFrameTime, linkAckLatencyMax);
+  for (uint8_t i = 0; i < LINK_NB_COUNTERS; i++)
+    ptr += sprintf(ptr, "%s\"%s\":%u", i ? "," : "", LINK_COUNTER_STR[i], linkTotal[i]);
+  ptr += sprintf(ptr, "},\"lastMinute\":{");
+  for (uint8_t i = 0; i < LINK_NB_COUNTERS; i++)
+    ptr += sprintf(ptr, "%s\"%s\":%u", i ? "," : "", LINK_COUNTER_STR[i], linkLastMinute((LinkCounter)i));
+  sprintf(ptr, "}}");
+  wifi::getWifiManager().server.get()->send(200, "application/json", temp);
 }
 
 void addWifiManagerCustomButtons()
@@ -765,7 +2359,7 @@ void bindServerCallback()
   wifi::getWifiManager().server.get()->on("/on", []()
                                 {
                                   // Light on
-                                  lightOn();
+                                  lightOn(false, getTransitionArg());
                                   // Send OK text
                                   wifi::getWifiManager().server.get()->send ( 200, "text/plain", "Ok");
                                 }
@@ -773,14 +2367,63 @@ void bindServerCallback()
   wifi::getWifiManager().server.get()->on("/off", []()
                                 {
                                   // Light off
-                                  lightOff();
+                                  lightOff(getTransitionArg());
                                   // Send OK text
                                   wifi::getWifiManager().server.get()->send ( 200, "text/plain", "Ok");
                                 }
                               );
 
+  wifi::getWifiManager().server.get()->on("/brightness", []()
+                                {
+                                  // Brightness in percent, e.g. /brightness?value=12.5&transition=500
+                                  if (wifi::getWifiManager().server.get()->hasArg("value") &&
+                                      !setBrightnessPercent(wifi::getWifiManager().server.get()->arg("value").c_str(), getTransitionArg()))
+                                  {
+                                    wifi::getWifiManager().server.get()->send ( 400, "text/plain", "Wrong brightness value");
+                                    return;
+                                  }
+                                  // Send the brightness in percent
+                                  wifi::getWifiManager().server.get()->send ( 200, "text/plain", helpers::perMilleToPercentStr(brightness));
+                                }
+                              );
+
+  // Power calibration: /calibration?watts=116 with the light on and a load of known wattage, /calibration?clear=1
+  wifi::getWifiManager().server.get()->on("/calibration", []()
+                                {
+                                  uint16_t watts;
+                                  if (wifi::getWifiManager().server.get()->hasArg("clear"))
+                                    calibration::clear();
+                                  else if (wifi::getWifiManager().server.get()->hasArg("watts"))
+                                  {
+                                    if (!helpers::convertToInteger(wifi::getWifiManager().server.get()->arg("watts").c_str(), watts, 5) ||
+                                        !calibration::addPoint(watts))
+                                    {
+                                      wifi::getWifiManager().server.get()->send ( 400, "text/plain", "Failed to add the calibration point. The light should be on with the load");
+                                      return;
+                                    }
+                                  }
+                                  wifi::getWifiManager().server.get()->send ( 200, "application/json", calibration::pointsToJson());
+                                }
+                              );
+
+  // Binary trace of the frames exchanged with the STM32
+  trace::bindServerCallback();
+
+  // State of the STM32 from the last poll, no request sent to the STM32
+  wifi::getWifiManager().server.get()->on("/state", handleState);
+  // Counters of the link supervisor
+  wifi::getWifiManager().server.get()->on("/link", handleLink);
+
   // Handle to upload the configuration file
   wifi::getWifiManager().server.get()->on("/uploadSTM32Firmware", HTTP_GET, handleUploadSTM32Firmware);
+  // Progress of the update
+  wifi::getWifiManager().server.get()->on("/stm32update", handleFlashJobProgress);
+  // Timing of the last update
+  wifi::getWifiManager().server.get()->on("/stm32stats", handleFlashJobStats);
+  // Update from an image on a HTTP server
+  wifi::getWifiManager().server.get()->on("/fetchSTM32Firmware", handleFetchSTM32Firmware);
+  // Backup of the STM32 flash
+  wifi::getWifiManager().server.get()->on("/downloadSTM32Firmware", HTTP_GET, handleDownloadSTM32Firmware);
   // Upload file
   // - first callback is called after the request has ended with all parsed arguments
   // - second callback handles file upload at that location
@@ -798,11 +2441,13 @@ void handle()
   // Process packets from the STM32 MCU
   receivePacket();
 
-  if (cmdVersionReceived==false && millis()-STM32ResetTime>300)
-  {
-    STM32reset();
-    STM32ResetTime=millis();
-  }
+  // Reset the STM32 if it does not answer
+  superviseLink();
+
+  // Flash the stored image if the STM32 has another firmware, then a step of the update or of the read-out
+  provisionSTM32();
+  handleFlashJob();
+  handleReadout();
 
   // Check if there is new brightness value to publish
   if (publishedBrightness != brightness)
@@ -812,9 +2457,7 @@ void handle()
     // If no topic, we do not publish
     if (topic != NULL)
     {
-      char payload[5];
-      sprintf(payload, "%d", brightness);
-      if (mqtt::publishMQTT(topic, payload))
+      if (mqtt::publishMQTT(topic, helpers::perMilleToPercentStr(brightness)))
         // If the new brightness value has been succeefully published
         publishedBrightness = brightness;
     }
@@ -832,45 +2475,9 @@ void handle()
       stopBlinking();
     }
 
-    // Alternate on/off for the blinking
-    if (blinking)
-    {
-      // Using the pattern, find the new light state
-      long diff = currTime - lastBlinkingLightStateTime;
-      uint8_t pc = 0;
-      unsigned long sum = 0;
-      while (diff > sum)
-      {
-        // If at the end of the pattern, we come back
-        if (pc == 10)
-        {
-          lastBlinkingLightStateTime = lastBlinkingLightStateTime + sum;
-          diff = currTime - lastBlinkingLightStateTime;
-          logging::getLogStream().printf("light: loop over the pattern\n");
-          pc = 0;
-          sum = 0;
-        }
-        sum += blinkingPattern[pc];
-        pc++;
-      }
-      
-      bool newBlinkingLightState = ((pc-1)%2==0);
-      if (blinkingLightState != newBlinkingLightState)
-      {
-        blinkingLightState = newBlinkingLightState;
-        // alternate on/off
-        if (blinkingLightState)
-        {
-          logging::getLogStream().printf("light: light on for blinking\n");
-          sendCmdSetBrightness(maxBrightness);
-        }
-        else
-        {
-          logging::getLogStream().printf("light: light off for blinking\n");
-          sendCmdSetBrightness(minBrightness);
-        }
-      }
-    }
+    // Change the brightness at the end of the current step
+    if (blinking && (long)(currTime - nextBlinkingTime) >= 0)
+      updateBlinking(currTime);
   }
 
   // For the auto-off light
@@ -884,6 +2491,16 @@ void handle()
       lightOff();
     }
   }
+
+  // Keep the state of the STM32 up to date
+  pollState();
+
+  // Next frame of the effect
+  effects::handle();
+
+  // Send the brightness requested during this loop and the queued commands
+  flushBrightness();
+  processCommandQueue();
 }
 
 } // namespace dimmer
@@ -12,29 +12,60 @@
 
 namespace light 
 {
+  // State decoded from the CMD_GET_STATE answer of the STM32
+  struct State
+  {
+    unsigned long timestamp;    // millis() when the state was received, 0 if not received yet
+    uint16_t status;            // payload[0..1], unknown, always 0 so far
+    uint16_t brightness;        // payload[2..3], brightness level in per-mille
+    uint16_t reserved;          // payload[4..5], unknown, always 0 so far
+    uint16_t powerRaw;          // payload[6..7], raw power counter
+    uint32_t flags;             // payload[8..11], unknown, 0x80000000 so far
+    uint16_t wattage;           // in watts, computed from powerRaw with the calibration
+    uint8_t size;               // payload size
+    uint8_t raw[16];            // payload as received, for analysing the unknown bytes
+  };
+
   // getter
-  uint8_t &getWattage();
+  const State &getState();
 
   void mqttCallback(const char* paramID, const char* payload);
 
   void setMinBrightness(const char* str);
   void setMaxBrightness(const char* str);
+  void setBrightnessCurve(const char* str);
   void setDimmingParameters(const char* dimmingTypeStr, const char* debounceStr);
 
-  void setBrightness(uint8_t b);
-  ICACHE_RAM_ATTR void lightOn(bool noLightAutoTurnOff=false);
-  ICACHE_RAM_ATTR void lightOff();
-  ICACHE_RAM_ATTR void lightToggle(bool noLightAutoTurnOff=false);
-  ICACHE_RAM_ATTR bool lightIsOn();
+  // Transition time in ms; TRANSITION_DEFAULT for the one of the configuration
+  #define TRANSITION_DEFAULT 0xFFFF
+  void setTransitionTime(const char* str);
+
+  // Brightness in per-mille, or in percent with an optional decimal for the string
+  void setBrightness(uint16_t b, uint16_t transition=0);
+  bool setBrightnessPercent(const char* str, uint16_t transition=0);
+  void lightOn(bool noLightAutoTurnOff=false, uint16_t transition=TRANSITION_DEFAULT);
+  void lightOff(uint16_t transition=TRANSITION_DEFAULT);
+  void lightToggle(bool noLightAutoTurnOff=false, uint16_t transition=TRANSITION_DEFAULT);
+  bool lightIsOn();
+  // Switch the load off at once, whatever the minimum brightness (e.g. on overheating)
+  void cutOff();
 
   void STM32reset();
 
   void sendCmdGetVersion();
   void sendCmdGetState();
+  void printState();
+  void printCommandStats();
+  void printLinkStats();
+  void benchmarkCRC();
+  void flashStoredImage();
   void setBlinkingDuration(const char* durationStr);
   void setBlinkingPattern(const char *payload);
   void startBlinking();
   void stopBlinking();
+  void startEffect(const char *payload);
+  void setEffectLevel(uint16_t level);
+  void restoreBrightness();
   void setup();
   void handle();
   void updateParams();
@@ -7,6 +7,7 @@
 #include "wifi.h"
 #include "light.h"
 #include "switches.h"
+#include "calibration.h"
 
 namespace logging
 {
@@ -170,15 +171,21 @@ void printTelnetMenu()
   {
     Telnet.println("Commands:");
     Telnet.println(" res : reset the STM32 MCU");
-    Telnet.println(" s : get the state of the STM32 MCU");
+    Telnet.println(" s : print the last state of the STM32 MCU");
     Telnet.println(" v : get the version of the STM32 MCU");    
-    Telnet.println(" br000 to br100 : set the brightness between 0% and 100%");
+    Telnet.println(" ack : print the acknowledgement statistics of the STM32 commands");
+    Telnet.println(" link : print the health counters of the link to the STM32");
+    Telnet.println(" crcb : benchmark the CRC used to verify the STM32 flash");
+    Telnet.println(" prov : flash the STM32 with the image stored in /stm32.bin");
+    Telnet.println(" br0 to br100 : set the brightness between 0% and 100% (e.g. br12.5)");
     Telnet.println(" on or off : switch on/off the light");
     Telnet.println(" temp : enable/disable temperature logging and overheating alarm");
-    Telnet.println(" blpt xxx xxx xxx : set blinking pattern");
+    Telnet.println(" blpt xxx[:lvl] xxx[:lvl] ... : set blinking pattern");
     Telnet.println(" sab : start blinking");
     Telnet.println(" sob : stop blinking");
     Telnet.println(" bldu : set the blinking duration");
+    Telnet.println(" cal, cal <watts> or cal clear : print, add a point with the light on or clear the power calibration");
+    Telnet.println(" fx breathe|candle|sunrise [s] or fx stop : start/stop an effect");
   }
 }
 
@@ -189,18 +196,20 @@ void handle()
   {
     // 's' to send the "get state" command
     if (telnetCmd[0] == 's' && telnetCmd[1] == 0x0D)
-      light::sendCmdGetState();
-    else if (telnetCmd[0] == 'b' && telnetCmd[1] == 'r' && telnetCmd[5] == 0x0D)
-    {
-      // '0' to '9' to set the brightness from 0% to 90%
-      uint16_t v = (telnetCmd[2] - '0') * 100 + (telnetCmd[3] - '0') * 10 + (telnetCmd[4] - '0');
-      if (v >= 0 && v <= 100)
-        light::setBrightness(v);
-      else
-        logging::getLogStream().printf("wrong value for the brightness: %d\n", v);
-    }
+      light::printState();
+    else if (telnetCmd[0] == 'b' && telnetCmd[1] == 'r' && telnetCmd[2] >= '0' && telnetCmd[2] <= '9')
+      // Brightness in percent, with an optional decimal
+      light::setBrightnessPercent(telnetCmd+2);
+    else if (telnetCmd[0] == 'l' && telnetCmd[1] == 'i' && telnetCmd[2] == 'n' && telnetCmd[3] == 'k' && telnetCmd[4] == 0x0D)
+      light::printLinkStats();
+    else if (telnetCmd[0] == 'c' && telnetCmd[1] == 'r' && telnetCmd[2] == 'c' && telnetCmd[3] == 'b' && telnetCmd[4] == 0x0D)
+      light::benchmarkCRC();
+    else if (telnetCmd[0] == 'p' && telnetCmd[1] == 'r' && telnetCmd[2] == 'o' && telnetCmd[3] == 'v' && telnetCmd[4] == 0x0D)
+      light::flashStoredImage();
     else if (telnetCmd[0] == 'v' && telnetCmd[1] == 0x0D)
       light::sendCmdGetVersion();
+    else if (telnetCmd[0] == 'a' && telnetCmd[1] == 'c' && telnetCmd[2] == 'k' && telnetCmd[3] == 0x0D)
+      light::printCommandStats();
     else if (telnetCmd[0] == 'o' && telnetCmd[1] == 'n' && telnetCmd[2] == 0x0D)
       light::lightOn();
     else if (telnetCmd[0] == 'o' && telnetCmd[1] == 'f' && telnetCmd[2] == 'f' && telnetCmd[3] == 0x0D)
@@ -217,6 +226,10 @@ void handle()
       light::setBlinkingPattern(telnetCmd+5);
     else if (telnetCmd[0] == 'b' && telnetCmd[1] == 'l' && telnetCmd[2] == 'd' && telnetCmd[3] == 'u' && telnetCmd[4] == ' ')
       light::setBlinkingDuration(telnetCmd+5);
+    else if (telnetCmd[0] == 'c' && telnetCmd[1] == 'a' && telnetCmd[2] == 'l')
+      calibration::command(telnetCmd+3);
+    else if (telnetCmd[0] == 'f' && telnetCmd[1] == 'x' && telnetCmd[2] == ' ')
+      light::startEffect(telnetCmd+3);
     else
       // Command not recognized command, we print the menu options
       printTelnetMenu();
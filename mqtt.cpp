@@ -127,6 +127,15 @@ void publishMQTTTempAtRegularInterval()
       sprintf(payload, "%d", temperature);
       publishMQTT(topic, payload);
     }
+
+    // The power comes from the state polled in the background by the light
+    topic = wifi::getParamValueFromID("pubMqttPower");
+    if (topic != NULL && light::getState().timestamp != 0)
+    {
+      char payload[8];
+      sprintf(payload, "%d", light::getState().wattage);
+      publishMQTT(topic, payload);
+    }
   }
 }
 
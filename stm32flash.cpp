@@ -145,6 +145,84 @@ int flash_addr_to_page_ceil(const stm32_t *stm, uint32_t addr)
 	return addr ? page + 1 : page;
 }
 
+int flash_addr_to_page_floor(const stm32_t *stm, uint32_t addr)
+{
+	int page;
+	uint32_t *psize;
+
+	if (!(addr >= stm->dev->fl_start && addr <= stm->dev->fl_end))
+		return 0;
+
+	page = 0;
+	addr -= stm->dev->fl_start;
+	psize = stm->dev->fl_ps;
+
+	while (addr >= psize[0]) {
+		addr -= psize[0];
+		page++;
+		if (psize[1])
+			psize++;
+	}
+
+	return page;
+}
+
+uint32_t flash_page_to_addr(const stm32_t *stm, int page)
+{
+	int i;
+	uint32_t addr, *psize;
+
+	addr = stm->dev->fl_start;
+	psize = stm->dev->fl_ps;
+
+	for (i = 0; i < page; i++) {
+		addr += psize[0];
+		if (psize[1])
+			psize++;
+	}
+
+	return addr;
+}
+
+/* upper bounds of the buckets of the histograms, in us */
+const uint32_t stm32_stat_bounds[STM32_STAT_BUCKETS - 1] = {
+	100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000
+};
+
+struct stm32_stat stm32_stats[STM32_STAT_NB];
+
+static const char *stm32_stat_names[STM32_STAT_NB] = {
+	"init", "guessLen", "erase", "wmCmd", "wmAddr", "wmData"
+};
+
+void stm32_stats_reset(void)
+{
+	memset(stm32_stats, 0, sizeof(stm32_stats));
+}
+
+const char *stm32_stat_name(stm32_stat_t stat)
+{
+	return stm32_stat_names[stat];
+}
+
+/* add the time elapsed since t0 (from micros()) to a statistic */
+static void stm32_stat_add(stm32_stat_t stat, uint32_t t0)
+{
+	struct stm32_stat *st = &stm32_stats[stat];
+	uint32_t us = micros() - t0;
+	int i;
+
+	for (i = 0; i < STM32_STAT_BUCKETS - 1; i++)
+		if (us < stm32_stat_bounds[i])
+			break;
+	if (st->hist[i] < 0xFFFF)
+		st->hist[i]++;
+	st->count++;
+	st->total += us;
+	if (us > st->max)
+		st->max = us;
+}
+
 static void stm32_warn_stretching(const char *f)
 {
 	DEBUG_MSG("Attention !!!");
@@ -173,7 +251,7 @@ static stm32_err_t stm32_get_ack_timeout(const stm32_t *stm, uint32_t timeout)
 		ret = stream->readBytes(&byte, 1);
 		if (ret == 0 && timeout) {
 			t1 = millis();
-			if (t1 < t0 + timeout)
+			if (t1 - t0 < timeout)
 				continue;
 		}
 
@@ -243,10 +321,10 @@ static stm32_err_t stm32_resync(const stm32_t *stm)
 
 	buf[0] = STM32_CMD_ERR;
 	buf[1] = STM32_CMD_ERR ^ 0xFF;
-	while (t1 < t0 + STM32_RESYNC_TIMEOUT) {
+	while (t1 - t0 < STM32_RESYNC_TIMEOUT) {
 		ret = stream->write(buf, 2);
 		if (ret == 0) {
-			delay(500000);
+			delay(500);
 			t1 = millis();
 			continue;
 		}
@@ -274,8 +352,8 @@ static stm32_err_t stm32_resync(const stm32_t *stm)
  *
  * len is value of the first byte in the frame.
  */
-static stm32_err_t stm32_guess_len_cmd(const stm32_t *stm, uint8_t cmd,
-				       uint8_t *data, unsigned int len)
+static stm32_err_t stm32_guess_len_cmd_untimed(const stm32_t *stm, uint8_t cmd,
+					       uint8_t *data, unsigned int len)
 {
 	Stream *stream = stm->stream;
 	size_t ret;
@@ -321,6 +399,16 @@ static stm32_err_t stm32_guess_len_cmd(const stm32_t *stm, uint8_t cmd,
 	return STM32_ERR_OK;
 }
 
+static stm32_err_t stm32_guess_len_cmd(const stm32_t *stm, uint8_t cmd,
+				       uint8_t *data, unsigned int len)
+{
+	uint32_t t0 = micros();
+	stm32_err_t s_err = stm32_guess_len_cmd_untimed(stm, cmd, data, len);
+
+	stm32_stat_add(STM32_STAT_GUESS_LEN, t0);
+	return s_err;
+}
+
 /*
  * Some interface, e.g. UART, requires a specific init sequence to let STM32
  * autodetect the interface speed.
@@ -373,7 +461,7 @@ static stm32_err_t stm32_send_init_seq(const stm32_t *stm)
 			? (a) \
 			: (((prev) > (a)) ? (prev) : (a)))
 
-stm32_t *stm32_init(Stream *stream, const uint8_t flags, const char init)
+static stm32_t *stm32_init_untimed(Stream *stream, const uint8_t flags, const char init)
 {
 	uint8_t len, val, buf[257];
 	stm32_t *stm;
@@ -388,8 +476,10 @@ stm32_t *stm32_init(Stream *stream, const uint8_t flags, const char init)
     stm->cmd_get_reply = i2c_cmd_get_reply;
 
 	if ((stm->flags & STREAM_OPT_CMD_INIT) && init)
-		if (stm32_send_init_seq(stm) != STM32_ERR_OK)
+		if (stm32_send_init_seq(stm) != STM32_ERR_OK) {
+			stm32_close(stm);
 			return NULL;
+		}
 
 	/* get the version and read protection status  */
 	if (stm32_send_command(stm, STM32_CMD_GVR) != STM32_ERR_OK) {
@@ -399,8 +489,10 @@ stm32_t *stm32_init(Stream *stream, const uint8_t flags, const char init)
 
 	/* From AN, only UART bootloader returns 3 bytes */
 	len = (stm->flags & STREAM_OPT_GVR_ETX) ? 3 : 1;
-	if (stream->readBytes(buf, len) != len)
+	if (stream->readBytes(buf, len) != len) {
+		stm32_close(stm);
 		return NULL;
+	}
 	stm->version = buf[0];
 	stm->option1 = (stm->flags & STREAM_OPT_GVR_ETX) ? buf[1] : 0;
 	stm->option2 = (stm->flags & STREAM_OPT_GVR_ETX) ? buf[2] : 0;
@@ -417,8 +509,10 @@ stm32_t *stm32_init(Stream *stream, const uint8_t flags, const char init)
 				len = stm->cmd_get_reply[i].length;
 				break;
 			}
-	if (stm32_guess_len_cmd(stm, STM32_CMD_GET, buf, len) != STM32_ERR_OK)
+	if (stm32_guess_len_cmd(stm, STM32_CMD_GET, buf, len) != STM32_ERR_OK) {
+		stm32_close(stm);
 		return NULL;
+	}
 	len = buf[0] + 1;
 	stm->bl_version = buf[1];
 	new_cmds = 0;
@@ -481,6 +575,7 @@ stm32_t *stm32_init(Stream *stream, const uint8_t flags, const char init)
 	    || stm->cmd->gvr == STM32_CMD_ERR
 	    || stm->cmd->gid == STM32_CMD_ERR) {
 		DEBUG_MSG("Error: bootloader did not returned correct information from GET command");
+		stm32_close(stm);
 		return NULL;
 	}
 
@@ -519,6 +614,15 @@ stm32_t *stm32_init(Stream *stream, const uint8_t flags, const char init)
 	return stm;
 }
 
+stm32_t *stm32_init(Stream *stream, const uint8_t flags, const char init)
+{
+	uint32_t t0 = micros();
+	stm32_t *stm = stm32_init_untimed(stream, flags, init);
+
+	stm32_stat_add(STM32_STAT_INIT, t0);
+	return stm;
+}
+
 void stm32_close(stm32_t *stm)
 {
 	if (stm)
@@ -567,13 +671,19 @@ stm32_err_t stm32_read_memory(const stm32_t *stm, uint32_t address,
 	return STM32_ERR_OK;
 }
 
-stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
-			       const uint8_t data[], unsigned int len)
+/*
+ * Write a block; if crc is not NULL, the STM32 CRC of the block (with the
+ * padding) is added to it while the bootloader programs the flash.
+ */
+static stm32_err_t stm32_write_memory_crc(const stm32_t *stm, uint32_t address,
+					  const uint8_t data[], unsigned int len,
+					  uint32_t *crc)
 {
 	Stream *stream = stm->stream;
 	uint8_t cs, buf[256 + 2];
 	unsigned int i, aligned_len;
 	stm32_err_t s_err;
+	uint32_t t0;
 
 	if (!len)
 		return STM32_ERR_WRONG_DATA_LENGTH;
@@ -595,7 +705,9 @@ stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
 	}
 
 	/* send the address and checksum */
+	t0 = micros();
   s_err = stm32_send_command(stm, stm->cmd->wm);
+	stm32_stat_add(STM32_STAT_WM_CMD, t0);
 	if (s_err != STM32_ERR_OK)
 		return s_err;
 
@@ -604,9 +716,11 @@ stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
 	buf[2] = (address >> 8) & 0xFF;
 	buf[3] = address & 0xFF;
 	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
+	t0 = micros();
 	if (stream->write(buf, 5) != 5)
 		return STM32_ERR_WRITE;
   s_err = stm32_get_ack(stm);
+	stm32_stat_add(STM32_STAT_WM_ADDR, t0);
 	if (s_err != STM32_ERR_OK)
 		return s_err;
 
@@ -623,10 +737,16 @@ stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
 		buf[i + 1] = 0xFF;
 	}
 	buf[aligned_len + 1] = cs;
+	t0 = micros();
 	if (stream->write(buf, aligned_len + 2) != aligned_len + 2)
 		return STM32_ERR_WRITE;
 
+	/* the UART is still sending the end of the block */
+	if (crc)
+		*crc = stm32_sw_crc(*crc, buf + 1, aligned_len);
+
 	s_err = stm32_get_ack_timeout(stm, STM32_BLKWRITE_TIMEOUT);
+	stm32_stat_add(STM32_STAT_WM_DATA, t0);
 	if (s_err != STM32_ERR_OK) {
 		if (stm->flags & STREAM_OPT_STRETCH_W
 		    && stm->cmd->wm != STM32_CMD_WM_NS)
@@ -636,6 +756,19 @@ stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
 	return STM32_ERR_OK;
 }
 
+stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
+			       const uint8_t data[], unsigned int len)
+{
+	return stm32_write_memory_crc(stm, address, data, len, NULL);
+}
+
+stm32_err_t stm32_write_memory_and_crc(const stm32_t *stm, uint32_t address,
+				       const uint8_t data[], unsigned int len,
+				       uint32_t *crc)
+{
+	return stm32_write_memory_crc(stm, address, data, len, crc);
+}
+
 stm32_err_t stm32_wunprot_memory(const stm32_t *stm)
 {
 	Stream *stream = stm->stream;
@@ -873,7 +1006,7 @@ static stm32_err_t stm32_pages_erase(const stm32_t *stm, uint32_t spage, uint32_
 	return STM32_ERR_OK;
 }
 
-stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage, uint32_t pages)
+static stm32_err_t stm32_erase_memory_untimed(const stm32_t *stm, uint32_t spage, uint32_t pages)
 {
 	uint32_t n;
 	stm32_err_t s_err;
@@ -919,6 +1052,15 @@ stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage, uint32_t page
 	return STM32_ERR_OK;
 }
 
+stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage, uint32_t pages)
+{
+	uint32_t t0 = micros();
+	stm32_err_t s_err = stm32_erase_memory_untimed(stm, spage, pages);
+
+	stm32_stat_add(STM32_STAT_ERASE, t0);
+	return s_err;
+}
+
 /* detect CPU endian */
 char cpu_le() {
 	const uint32_t cpu_le_test = 0x12345678;
@@ -1074,12 +1216,13 @@ stm32_err_t stm32_crc_memory(const stm32_t *stm, uint32_t address,
  * But STM32 computes it on units of 32 bits word and swaps the
  * bytes of the word before the computation.
  * Due to byte swap, I cannot use any CRC available in existing
- * libraries, so here is a simple not optimized implementation.
+ * libraries. stm32_sw_crc_bitwise() is the simple not optimized
+ * implementation, kept as the reference for stm32_sw_crc().
  */
 #define CRCPOLY_BE	0x04c11db7
 #define CRC_MSBMASK	0x80000000
-#define CRC_INIT_VALUE	0xFFFFFFFF
-uint32_t stm32_sw_crc(uint32_t crc, uint8_t *buf, unsigned int len)
+#define CRC_INIT_VALUE	STM32_CRC_INIT
+uint32_t stm32_sw_crc_bitwise(uint32_t crc, uint8_t *buf, unsigned int len)
 {
 	int i;
 	uint32_t data;
@@ -1107,6 +1250,167 @@ uint32_t stm32_sw_crc(uint32_t crc, uint8_t *buf, unsigned int len)
 	return crc;
 }
 
+/*
+ * Table-driven implementation: feeding the word MSB first is the
+ * same as feeding its bytes to crc32_be() in the order 3, 2, 1, 0.
+ * It is the one of the ESP8266, it is also built on the host so that
+ * it can be tested and measured against the others.
+ */
+/* crc32_be() of each byte value, 1 KB in flash */
+static const uint32_t crc_table[256] PROGMEM = {
+	0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9,
+	0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
+	0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
+	0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd,
+	0x4c11db70, 0x48d0c6c7, 0x4593e01e, 0x4152fda9,
+	0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
+	0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011,
+	0x791d4014, 0x7ddc5da3, 0x709f7b7a, 0x745e66cd,
+	0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
+	0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5,
+	0xbe2b5b58, 0xbaea46ef, 0xb7a96036, 0xb3687d81,
+	0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
+	0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49,
+	0xc7361b4c, 0xc3f706fb, 0xceb42022, 0xca753d95,
+	0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
+	0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d,
+	0x34867077, 0x30476dc0, 0x3d044b19, 0x39c556ae,
+	0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
+	0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16,
+	0x018aeb13, 0x054bf6a4, 0x0808d07d, 0x0cc9cdca,
+	0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
+	0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02,
+	0x5e9f46bf, 0x5a5e5b08, 0x571d7dd1, 0x53dc6066,
+	0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
+	0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e,
+	0xbfa1b04b, 0xbb60adfc, 0xb6238b25, 0xb2e29692,
+	0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
+	0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a,
+	0xe0b41de7, 0xe4750050, 0xe9362689, 0xedf73b3e,
+	0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
+	0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686,
+	0xd5b88683, 0xd1799b34, 0xdc3abded, 0xd8fba05a,
+	0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
+	0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb,
+	0x4f040d56, 0x4bc510e1, 0x46863638, 0x42472b8f,
+	0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
+	0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47,
+	0x36194d42, 0x32d850f5, 0x3f9b762c, 0x3b5a6b9b,
+	0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
+	0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623,
+	0xf12f560e, 0xf5ee4bb9, 0xf8ad6d60, 0xfc6c70d7,
+	0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
+	0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f,
+	0xc423cd6a, 0xc0e2d0dd, 0xcda1f604, 0xc960ebb3,
+	0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
+	0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b,
+	0x9b3660c6, 0x9ff77d71, 0x92b45ba8, 0x9675461f,
+	0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
+	0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640,
+	0x4e8ee645, 0x4a4ffbf2, 0x470cdd2b, 0x43cdc09c,
+	0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
+	0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24,
+	0x119b4be9, 0x155a565e, 0x18197087, 0x1cd86d30,
+	0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
+	0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088,
+	0x2497d08d, 0x2056cd3a, 0x2d15ebe3, 0x29d4f654,
+	0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
+	0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c,
+	0xe3a1cbc1, 0xe760d676, 0xea23f0af, 0xeee2ed18,
+	0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
+	0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0,
+	0x9abc8bd5, 0x9e7d9662, 0x933eb0bb, 0x97ffad0c,
+	0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
+	0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4,
+};
+
+uint32_t stm32_sw_crc_table(uint32_t crc, uint8_t *buf, unsigned int len)
+{
+	if (len & 0x3) {
+		DEBUG_MSG("Buffer length must be multiple of 4 bytes");
+		return 0;
+	}
+
+	while (len) {
+		crc = (crc << 8) ^ pgm_read_dword(&crc_table[(crc >> 24) ^ buf[3]]);
+		crc = (crc << 8) ^ pgm_read_dword(&crc_table[(crc >> 24) ^ buf[2]]);
+		crc = (crc << 8) ^ pgm_read_dword(&crc_table[(crc >> 24) ^ buf[1]]);
+		crc = (crc << 8) ^ pgm_read_dword(&crc_table[(crc >> 24) ^ buf[0]]);
+		buf += 4;
+		len -= 4;
+	}
+	return crc;
+}
+
+#ifndef ARDUINO
+/*
+ * Slice-by-8 on the host: crc_tables[k][b] is the CRC of the byte b
+ * followed by k zero bytes, so that two words are processed at once.
+ * The 8 KB of tables are too much for the RAM of the ESP8266.
+ */
+static uint32_t crc_tables[8][256];
+static bool crc_tables_ready = false;
+
+static void stm32_sw_crc_init_tables(void)
+{
+	int i, j, k;
+	uint32_t crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = (uint32_t)i << 24;
+		for (j = 0; j < 8; j++)
+			if (crc & CRC_MSBMASK)
+				crc = (crc << 1) ^ CRCPOLY_BE;
+			else
+				crc = (crc << 1);
+		crc_tables[0][i] = crc;
+	}
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc_tables[k][i] = (crc_tables[k - 1][i] << 8) ^
+				crc_tables[0][crc_tables[k - 1][i] >> 24];
+	crc_tables_ready = true;
+}
+
+uint32_t stm32_sw_crc_slice8(uint32_t crc, uint8_t *buf, unsigned int len)
+{
+	uint32_t data, next;
+
+	if (len & 0x3) {
+		DEBUG_MSG("Buffer length must be multiple of 4 bytes");
+		return 0;
+	}
+	if (!crc_tables_ready)
+		stm32_sw_crc_init_tables();
+
+	while (len >= 8) {
+		data = crc ^ (buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24);
+		next = buf[4] | buf[5] << 8 | buf[6] << 16 | (uint32_t)buf[7] << 24;
+		crc = crc_tables[7][data >> 24] ^ crc_tables[6][(data >> 16) & 0xFF] ^
+		      crc_tables[5][(data >> 8) & 0xFF] ^ crc_tables[4][data & 0xFF] ^
+		      crc_tables[3][next >> 24] ^ crc_tables[2][(next >> 16) & 0xFF] ^
+		      crc_tables[1][(next >> 8) & 0xFF] ^ crc_tables[0][next & 0xFF];
+		buf += 8;
+		len -= 8;
+	}
+	if (len) {
+		data = crc ^ (buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24);
+		crc = crc_tables[3][data >> 24] ^ crc_tables[2][(data >> 16) & 0xFF] ^
+		      crc_tables[1][(data >> 8) & 0xFF] ^ crc_tables[0][data & 0xFF];
+	}
+	return crc;
+}
+#endif
+
+uint32_t stm32_sw_crc(uint32_t crc, uint8_t *buf, unsigned int len)
+{
+#ifdef ARDUINO
+	return stm32_sw_crc_table(crc, buf, len);
+#else
+	return stm32_sw_crc_slice8(crc, buf, len);
+#endif
+}
+
 stm32_err_t stm32_crc_wrapper(const stm32_t *stm, uint32_t address,
 			      uint32_t length, uint32_t *crc)
 {
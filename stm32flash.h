@@ -38,6 +38,8 @@
 #define STM32_MAX_RX_FRAME	256	/* cmd read memory */
 #define STM32_MAX_TX_FRAME	(1 + 256 + 1)	/* cmd write memory */
 
+#define STM32_CRC_INIT		0xFFFFFFFF	/* initial value for stm32_sw_crc() */
+
 #define STM32_MAX_PAGES		0x0000ffff
 #define STM32_MASS_ERASE	0x00100000 /* > 2 x max_pages */
 
@@ -98,12 +100,40 @@ struct stm32_dev {
 	uint32_t	flags;
 };
 
+/* timing of the bootloader commands, in microseconds */
+typedef enum {
+	STM32_STAT_INIT = 0,	/* stm32_init(), from the init sequence to the device ID */
+	STM32_STAT_GUESS_LEN,	/* GET and GID commands with a reply of variable length */
+	STM32_STAT_ERASE,	/* stm32_erase_memory() */
+	STM32_STAT_WM_CMD,	/* write memory: command sent up to its ACK */
+	STM32_STAT_WM_ADDR,	/* write memory: address sent up to its ACK */
+	STM32_STAT_WM_DATA,	/* write memory: data sent up to the ACK of the programming */
+	STM32_STAT_NB
+} stm32_stat_t;
+
+#define STM32_STAT_BUCKETS	10	/* the last bucket counts the durations above the last bound */
+
+struct stm32_stat {
+	uint32_t	count;
+	uint32_t	total;	/* us */
+	uint32_t	max;	/* us */
+	uint16_t	hist[STM32_STAT_BUCKETS];
+};
+
+extern struct stm32_stat stm32_stats[STM32_STAT_NB];
+extern const uint32_t stm32_stat_bounds[STM32_STAT_BUCKETS - 1];
+void stm32_stats_reset(void);
+const char *stm32_stat_name(stm32_stat_t stat);
+
 stm32_t *stm32_init(Stream *stream, const uint8_t flags, const char init);
 void stm32_close(stm32_t *stm);
 stm32_err_t stm32_read_memory(const stm32_t *stm, uint32_t address,
 			      uint8_t data[], unsigned int len);
 stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
 			       const uint8_t data[], unsigned int len);
+stm32_err_t stm32_write_memory_and_crc(const stm32_t *stm, uint32_t address,
+				       const uint8_t data[], unsigned int len,
+				       uint32_t *crc);
 stm32_err_t stm32_wunprot_memory(const stm32_t *stm);
 stm32_err_t stm32_wprot_memory(const stm32_t *stm);
 stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage,
@@ -117,5 +147,15 @@ stm32_err_t stm32_crc_memory(const stm32_t *stm, uint32_t address,
 stm32_err_t stm32_crc_wrapper(const stm32_t *stm, uint32_t address,
 			      uint32_t length, uint32_t *crc);
 uint32_t stm32_sw_crc(uint32_t crc, uint8_t *buf, unsigned int len);
+uint32_t stm32_sw_crc_bitwise(uint32_t crc, uint8_t *buf, unsigned int len);
+uint32_t stm32_sw_crc_table(uint32_t crc, uint8_t *buf, unsigned int len);
+#ifndef ARDUINO
+uint32_t stm32_sw_crc_slice8(uint32_t crc, uint8_t *buf, unsigned int len);
+#endif
+
+/* page geometry from the device table */
+int flash_addr_to_page_floor(const stm32_t *stm, uint32_t addr);
+int flash_addr_to_page_ceil(const stm32_t *stm, uint32_t addr);
+uint32_t flash_page_to_addr(const stm32_t *stm, int page);
 
 #endif
@@ -0,0 +1,100 @@
+#include "stm32frames.h"
+
+
+namespace stm32frames
+{
+
+// Each byte is written twice (at idx and idx+RING_SIZE) so that a frame is always contiguous
+// in memory and its payload can be processed without any copy
+#define RING_SIZE 512                   // power of 2, larger than the biggest frame (4 + 255 + 3 bytes)
+#define RING_MASK (RING_SIZE - 1)
+uint8_t ring[2 * RING_SIZE];
+uint16_t head = 0;                      // first byte of the frame being parsed
+uint16_t tail = 0;                      // where the next received byte is written
+uint16_t pos = 0;                       // number of bytes of the current frame already parsed
+uint16_t crc = 0;                       // checksum of the current frame, computed as the bytes arrive
+uint16_t skipped = 0;                   // bytes dropped while looking for a start marker
+
+uint16_t room()
+{
+  return RING_SIZE - (uint16_t)(tail - head);
+}
+
+void push(uint8_t b)
+{
+  ring[tail & RING_MASK] = b;
+  ring[(tail & RING_MASK) + RING_SIZE] = b;
+  tail++;
+}
+
+void resync()
+{
+  head++;
+  skipped++;
+  pos = 0;
+}
+
+uint16_t takeSkipped()
+{
+  uint16_t n = skipped;
+  skipped = 0;
+  return n;
+}
+
+const uint8_t *pending(uint16_t &len)
+{
+  len = pos;
+  return pos ? &ring[head & RING_MASK] : NULL;
+}
+
+Result next(const uint8_t *&frame, uint16_t &len)
+{
+  while ((uint16_t)(tail - head) > pos)
+  {
+    frame = &ring[head & RING_MASK];
+    uint8_t b = frame[pos];
+    uint8_t payload_size = (pos > 3) ? frame[3] : 0;
+
+    if (pos == 0)
+    {
+      // Skip everything until the start marker
+      if (b != STM32_FRAME_START_MARKER)
+      {
+        head++;
+        skipped++;
+        continue;
+      }
+      crc = 0;
+    }
+    else if (pos < 4 + payload_size)
+    {
+      // Packet counter, command, payload size and payload are part of the checksum
+      crc += b;
+    }
+    else if (pos == 5 + payload_size)
+    {
+      if (((frame[pos - 1] << 8) | b) != crc)
+      {
+        len = pos + 1;
+        resync();
+        return FRAME_BAD_CRC;
+      }
+    }
+    else if (pos == 6 + payload_size)
+    {
+      len = pos + 1;
+      if (b != STM32_FRAME_END_MARKER)
+      {
+        resync();
+        return FRAME_BAD_END;
+      }
+      head += len;
+      pos = 0;
+      return FRAME_OK;
+    }
+    pos++;
+  }
+  return FRAME_NONE;
+}
+
+}
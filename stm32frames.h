@@ -0,0 +1,35 @@
+#ifndef STM32FRAMES
+#define STM32FRAMES
+
+#include <Arduino.h>
+
+
+// Ring buffer and parser of the frames received from the STM32
+// Frame: start marker, packet counter, command, payload size, payload, checksum (2 bytes, big endian), end marker
+namespace stm32frames
+{
+  #define STM32_FRAME_START_MARKER 0x01
+  #define STM32_FRAME_END_MARKER 0x04
+  #define STM32_FRAME_OVERHEAD 7        // bytes of a frame without its payload
+
+  enum Result { FRAME_NONE, FRAME_OK, FRAME_BAD_CRC, FRAME_BAD_END };
+
+  // Free space in the ring buffer and adding a received byte
+  uint16_t room();
+  void push(uint8_t b);
+
+  // Parse the received bytes up to the next complete frame or the next broken one
+  // frame points into the ring buffer at the start marker and stays valid until the next push()
+  // len is the size of the frame, or the number of bytes parsed up to the error
+  // A broken frame only loses its start marker: the bytes after it are parsed again
+  Result next(const uint8_t *&frame, uint16_t &len);
+
+  // Start of the incomplete frame being parsed and its number of bytes, NULL when waiting for a start marker
+  const uint8_t *pending(uint16_t &len);
+  // Give up the frame being parsed (or the oldest byte), the bytes after its start marker are parsed again
+  void resync();
+  // Number of bytes dropped while looking for a start marker since the last call
+  uint16_t takeSkipped();
+}
+
+#endif
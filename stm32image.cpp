@@ -0,0 +1,720 @@
+#include "stm32image.h"
+
+#include <LittleFS.h>
+
+
+namespace stm32image
+{
+
+#define GZIP_MAX_WINDOW 32768
+#define GZIP_MIN_WINDOW 1024
+#define HEX_MAX_RECORD (5 + 255)        // length, address, type, up to 255 bytes of data and checksum
+
+File imageFile;
+Stream *source = NULL;                  // imageFile or the stream given to open()
+uint32_t sourceSize = 0;                // 0 if unknown
+uint32_t sourcePos = 0;                 // bytes of the source read so far
+char errorMsg[100] = {0x00};
+bool compressed = false;
+bool hex = false;
+uint32_t outputLen = 0;                 // bytes of the image returned so far
+
+bool fail(const char* msg)
+{
+  strncpy(errorMsg, msg, sizeof(errorMsg) - 1);
+  return false;
+}
+
+int failRead(const char* msg)
+{
+  fail(msg);
+  return -1;
+}
+
+// Input from the source, read in small blocks
+// The reads of a stream wait for the data up to the timeout of the stream; when its size is known,
+// it is not read beyond and a stream ending before is reported as truncated
+uint8_t inBuf[64];
+uint8_t inLen = 0, inPos = 0;
+
+int readInput(uint8_t *buf, unsigned int len)
+{
+  if (sourceSize > 0 && len > sourceSize - sourcePos)
+    len = sourceSize - sourcePos;
+  if (len == 0)
+    return 0;
+  int n = source->readBytes(buf, len);
+  if (n > 0)
+    sourcePos += n;
+  if (sourceSize > 0 && (unsigned int)n < len)
+  {
+    snprintf(errorMsg, sizeof(errorMsg), "truncated at %u of %u bytes", sourcePos, sourceSize);
+    return -1;
+  }
+  return n;
+}
+
+int readFileByte()
+{
+  if (inPos == inLen)
+  {
+    int n = readInput(inBuf, sizeof(inBuf));
+    if (n <= 0)
+      return -1;
+    inLen = n;
+    inPos = 0;
+  }
+  return inBuf[inPos++];
+}
+
+int readFile(uint8_t *buf, unsigned int len)
+{
+  unsigned int n = 0;
+  while (n < len && inPos < inLen)
+    buf[n++] = inBuf[inPos++];
+  if (n < len)
+  {
+    int r = readInput(buf + n, len - n);
+    if (r < 0)
+      return -1;
+    n += r;
+  }
+  return n;
+}
+
+
+// Inflate (RFC 1951) with a canonical Huffman decoding bit by bit, as done by tinf
+// The trees and the window are allocated only for a compressed image
+struct Tree
+{
+  uint16_t counts[16];                  // number of codes of each length
+  uint16_t symbols[288];                // symbols ordered by code
+};
+struct InflateState
+{
+  Tree litTree;
+  Tree distTree;
+  uint8_t lengths[288 + 32];
+};
+InflateState *inflateState = NULL;
+uint8_t *window = NULL;
+uint32_t windowMask = 0;
+uint32_t windowPos = 0;                 // bytes inflated so far
+uint32_t bitBuf = 0;
+uint8_t bitCount = 0;
+bool inputEnded = false;
+uint32_t crc32 = 0;
+
+enum BlockState { BLOCK_NONE, BLOCK_STORED, BLOCK_HUFFMAN, BLOCK_TRAILER, BLOCK_DONE };
+BlockState blockState = BLOCK_NONE;
+bool lastBlock = false;
+uint16_t storedLeft = 0;
+uint16_t matchLeft = 0;
+uint16_t matchDist = 0;
+
+const uint16_t lengthBase[29] PROGMEM = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const uint8_t lengthExtra[29] PROGMEM = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                          3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t distBase[30] PROGMEM = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t distExtra[30] PROGMEM = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+const uint8_t codeLengthOrder[19] PROGMEM = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// CRC-32 of gzip, 4 bits at a time
+const uint32_t crc32Table[16] PROGMEM = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+uint32_t getBits(uint8_t n)
+{
+  while (bitCount < n)
+  {
+    int b = readFileByte();
+    if (b < 0)
+    {
+      inputEnded = true;
+      b = 0;
+    }
+    bitBuf |= (uint32_t)b << bitCount;
+    bitCount += 8;
+  }
+  uint32_t v = bitBuf & ((1UL << n) - 1);
+  bitBuf >>= n;
+  bitCount -= n;
+  return v;
+}
+
+void buildTree(Tree &t, const uint8_t *lengths, uint16_t num)
+{
+  uint16_t offsets[16];
+  memset(t.counts, 0, sizeof(t.counts));
+  for (uint16_t i = 0; i < num; i++)
+    t.counts[lengths[i]]++;
+  t.counts[0] = 0;
+  for (uint16_t i = 0, sum = 0; i < 16; i++)
+  {
+    offsets[i] = sum;
+    sum += t.counts[i];
+  }
+  for (uint16_t i = 0; i < num; i++)
+    if (lengths[i])
+      t.symbols[offsets[lengths[i]]++] = i;
+}
+
+int decodeSymbol(const Tree &t)
+{
+  int sum = 0, cur = 0, len = 0;
+  do
+  {
+    cur = 2 * cur + getBits(1);
+    if (++len > 15)
+      return -1;
+    sum += t.counts[len];
+    cur -= t.counts[len];
+  } while (cur >= 0);
+  return t.symbols[sum + cur];
+}
+
+void buildFixedTrees()
+{
+  uint8_t *l = inflateState->lengths;
+  memset(l, 8, 144);
+  memset(l + 144, 9, 112);
+  memset(l + 256, 7, 24);
+  memset(l + 280, 8, 8);
+  buildTree(inflateState->litTree, l, 288);
+  memset(l, 5, 30);
+  buildTree(inflateState->distTree, l, 30);
+}
+
+bool buildDynamicTrees()
+{
+  uint8_t *l = inflateState->lengths;
+  uint16_t hlit = getBits(5) + 257;
+  uint8_t hdist = getBits(5) + 1;
+  uint8_t hclen = getBits(4) + 4;
+  if (hlit > 286 || hdist > 30)
+    return fail("gzip: wrong dynamic block");
+
+  // The code lengths are coded with a first tree, built in the distance tree
+  memset(l, 0, 19);
+  for (uint8_t i = 0; i < hclen; i++)
+    l[pgm_read_byte(&codeLengthOrder[i])] = getBits(3);
+  buildTree(inflateState->distTree, l, 19);
+
+  for (uint16_t n = 0; n < hlit + hdist;)
+  {
+    int sym = decodeSymbol(inflateState->distTree);
+    uint8_t len = 0, repeat;
+    if (sym < 0)
+      return fail("gzip: wrong code length");
+    if (sym < 16)
+    {
+      l[n++] = sym;
+      continue;
+    }
+    if (sym == 16)
+    {
+      if (n == 0)
+        return fail("gzip: wrong code length");
+      len = l[n - 1];
+      repeat = 3 + getBits(2);
+    }
+    else if (sym == 17)
+      repeat = 3 + getBits(3);
+    else
+      repeat = 11 + getBits(7);
+    if (n + repeat > hlit + hdist)
+      return fail("gzip: wrong code length");
+    memset(l + n, len, repeat);
+    n += repeat;
+  }
+  buildTree(inflateState->litTree, l, hlit);
+  buildTree(inflateState->distTree, l + hlit, hdist);
+  return true;
+}
+
+void putByte(uint8_t b, uint8_t *out)
+{
+  window[windowPos & windowMask] = b;
+  windowPos++;
+  crc32 = (crc32 >> 4) ^ pgm_read_dword(&crc32Table[(crc32 ^ b) & 0x0F]);
+  crc32 = (crc32 >> 4) ^ pgm_read_dword(&crc32Table[(crc32 ^ (b >> 4)) & 0x0F]);
+  *out = b;
+}
+
+// Check the CRC and the size in the gzip trailer
+bool readTrailer()
+{
+  // The rest of the last byte is padding
+  bitBuf = 0;
+  bitCount = 0;
+  uint32_t crc = getBits(16);
+  crc |= getBits(16) << 16;
+  uint32_t size = getBits(16);
+  size |= getBits(16) << 16;
+  if (inputEnded)
+    return fail("gzip: truncated file");
+  if (crc != ~crc32)
+    return fail("gzip: wrong CRC, the file is corrupted");
+  if (size != windowPos)
+    return fail("gzip: wrong size, the file is corrupted");
+  return true;
+}
+
+// Inflate up to len bytes; returns the number of bytes, 0 at the end or -1 on error
+int inflateRead(uint8_t *out, unsigned int len)
+{
+  unsigned int n = 0;
+  while (n < len && blockState != BLOCK_DONE)
+  {
+    if (inputEnded)
+      return failRead("gzip: truncated file");
+    if (matchLeft > 0)
+    {
+      putByte(window[(windowPos - matchDist) & windowMask], out + n++);
+      matchLeft--;
+    }
+    else if (blockState == BLOCK_STORED)
+    {
+      if (storedLeft == 0)
+      {
+        blockState = lastBlock ? BLOCK_TRAILER : BLOCK_NONE;
+        continue;
+      }
+      int b = readFileByte();
+      if (b < 0)
+        return failRead("gzip: truncated file");
+      putByte(b, out + n++);
+      storedLeft--;
+    }
+    else if (blockState == BLOCK_HUFFMAN)
+    {
+      int sym = decodeSymbol(inflateState->litTree);
+      if (sym < 0)
+        return failRead("gzip: wrong symbol");
+      if (sym < 256)
+        putByte(sym, out + n++);
+      else if (sym == 256)
+        blockState = lastBlock ? BLOCK_TRAILER : BLOCK_NONE;
+      else
+      {
+        // Length with its extra bits, then the distance
+        sym -= 257;
+        if (sym >= 29)
+          return failRead("gzip: wrong symbol");
+        matchLeft = pgm_read_word(&lengthBase[sym]) + getBits(pgm_read_byte(&lengthExtra[sym]));
+        int dist = decodeSymbol(inflateState->distTree);
+        if (dist < 0 || dist >= 30)
+          return failRead("gzip: wrong symbol");
+        matchDist = pgm_read_word(&distBase[dist]) + getBits(pgm_read_byte(&distExtra[dist]));
+        if (matchDist > windowPos)
+          return failRead("gzip: wrong distance");
+        if (matchDist > windowMask + 1)
+        {
+          snprintf(errorMsg, sizeof(errorMsg), "gzip: distance of %u bytes larger than the window, see tools/stm32gzip.py", matchDist);
+          return -1;
+        }
+      }
+    }
+    else if (blockState == BLOCK_TRAILER)
+    {
+      if (!readTrailer())
+        return -1;
+      blockState = BLOCK_DONE;
+    }
+    else
+    {
+      // Header of the next block
+      lastBlock = getBits(1);
+      uint8_t type = getBits(2);
+      if (type == 0)
+      {
+        bitBuf = 0;
+        bitCount = 0;
+        uint16_t size = getBits(16);
+        uint16_t nsize = getBits(16);
+        if (size != (uint16_t)~nsize)
+          return failRead("gzip: wrong stored block");
+        storedLeft = size;
+        blockState = BLOCK_STORED;
+      }
+      else if (type == 1)
+      {
+        buildFixedTrees();
+        blockState = BLOCK_HUFFMAN;
+      }
+      else if (type == 2)
+      {
+        if (!buildDynamicTrees())
+          return -1;
+        blockState = BLOCK_HUFFMAN;
+      }
+      else
+        return failRead("gzip: wrong block type");
+    }
+  }
+  return n;
+}
+
+// Skip the gzip header; the size of the window is chosen from the size of the image in the trailer
+// size: size of the image, 0 if unknown (stream)
+bool beginInflate(uint32_t size)
+{
+  uint8_t header[10];
+  if (readFile(header, 10) != 10 || header[0] != 0x1F || header[1] != 0x8B || header[2] != 8)
+    return fail("gzip: wrong header");
+  uint8_t flags = header[3];
+  if (flags & 0x04)
+  {
+    // Extra field
+    uint16_t xlen = readFileByte();
+    xlen |= readFileByte() << 8;
+    while (xlen-- > 0)
+      readFileByte();
+  }
+  // File name and comment
+  for (uint8_t f = 0x08; f <= 0x10; f <<= 1)
+    if (flags & f)
+    {
+      int c;
+      do
+        c = readFileByte();
+      while (c > 0);
+    }
+  // CRC of the header
+  if (flags & 0x02)
+  {
+    readFileByte();
+    readFileByte();
+  }
+
+  // Smaller window if the memory is missing; a distance larger than the window is reported when decoding
+  uint32_t windowSize = GZIP_MIN_WINDOW;
+  while ((size == 0 || windowSize < size) && windowSize < GZIP_MAX_WINDOW)
+    windowSize <<= 1;
+  inflateState = (InflateState*)malloc(sizeof(InflateState));
+  while (inflateState != NULL && window == NULL && windowSize >= GZIP_MIN_WINDOW)
+  {
+    window = (uint8_t*)malloc(windowSize);
+    if (window == NULL)
+      windowSize >>= 1;
+  }
+  if (inflateState == NULL || window == NULL)
+    return fail("gzip: not enough memory");
+  windowMask = windowSize - 1;
+  windowPos = 0;
+  bitBuf = 0;
+  bitCount = 0;
+  inputEnded = false;
+  crc32 = 0xFFFFFFFF;
+  blockState = BLOCK_NONE;
+  lastBlock = false;
+  storedLeft = 0;
+  matchLeft = 0;
+  return true;
+}
+
+
+// Decompressed or raw input of the image
+uint8_t srcBuf[64];
+uint8_t srcLen = 0, srcPos = 0;
+bool srcFailed = false;
+
+int readSource(uint8_t *buf, unsigned int len)
+{
+  unsigned int n = 0;
+  while (n < len && srcPos < srcLen)
+    buf[n++] = srcBuf[srcPos++];
+  if (n < len)
+  {
+    int r = compressed ? inflateRead(buf + n, len - n) : readFile(buf + n, len - n);
+    if (r < 0)
+    {
+      srcFailed = true;
+      return -1;
+    }
+    n += r;
+  }
+  return n;
+}
+
+int readSourceByte()
+{
+  if (srcPos == srcLen)
+  {
+    srcPos = 0;
+    srcLen = 0;
+    int n = compressed ? inflateRead(srcBuf, sizeof(srcBuf)) : readFile(srcBuf, sizeof(srcBuf));
+    if (n < 0)
+      srcFailed = true;
+    if (n <= 0)
+      return -1;
+    srcLen = n;
+  }
+  return srcBuf[srcPos++];
+}
+
+
+// Intel HEX: the data records are given in order of address, with 0xFF in the gaps
+uint8_t record[HEX_MAX_RECORD];
+uint32_t hexBase = 0;
+uint32_t maxImageSize = 0;
+uint32_t hexExtAddr = 0;                // from the extended segment or linear address records
+uint32_t hexNextAddr = 0;               // address of the next byte of the image
+uint32_t fillLeft = 0;
+uint8_t dataPos = 0, dataLeft = 0;
+bool hexEnded = false;
+
+int hexNibble(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+int hexByte()
+{
+  int hi = hexNibble(readSourceByte());
+  int lo = hexNibble(readSourceByte());
+  if (hi < 0 || lo < 0)
+    return -1;
+  return hi << 4 | lo;
+}
+
+// Next record of the file, checksum verified
+bool readRecord()
+{
+  int c;
+  do
+    c = readSourceByte();
+  while (c == '\r' || c == '\n' || c == ' ');
+  if (srcFailed)
+    return false;
+  if (c != ':')
+    return fail((c < 0) ? "hex: no end of file record" : "hex: wrong character");
+
+  int len = hexByte();
+  if (srcFailed)
+    return false;
+  if (len < 0)
+    return fail("hex: wrong record");
+  record[0] = len;
+  uint8_t sum = len;
+  for (int i = 1; i < len + 5; i++)
+  {
+    int b = hexByte();
+    if (srcFailed)
+      return false;
+    if (b < 0)
+      return fail("hex: wrong record");
+    record[i] = b;
+    sum += b;
+  }
+  if (sum != 0)
+    return fail("hex: wrong checksum");
+  return true;
+}
+
+bool processRecord()
+{
+  uint8_t len = record[0];
+  uint8_t type = record[3];
+  if (type == 0x00)
+  {
+    uint32_t addr = hexExtAddr + (record[1] << 8 | record[2]);
+    // Checked before the gap up to the record is filled: a record far away (e.g. the option bytes) would
+    // otherwise generate megabytes of 0xFF
+    if (addr < hexBase || addr - hexBase > maxImageSize || addr - hexBase + len > maxImageSize)
+    {
+      snprintf(errorMsg, sizeof(errorMsg), "hex: record at 0x%08X out of the flash", addr);
+      return false;
+    }
+    if (addr < hexNextAddr)
+    {
+      snprintf(errorMsg, sizeof(errorMsg), "hex: record at 0x%08X below the previous ones", addr);
+      return false;
+    }
+    fillLeft = addr - hexNextAddr;
+    dataPos = 4;
+    dataLeft = len;
+    hexNextAddr = addr + len;
+  }
+  else if (type == 0x01)
+    hexEnded = true;
+  else if (type == 0x02 && len == 2)
+    hexExtAddr = (uint32_t)(record[4] << 8 | record[5]) << 4;
+  else if (type == 0x04 && len == 2)
+    hexExtAddr = (uint32_t)(record[4] << 8 | record[5]) << 16;
+  else if (type != 0x03 && type != 0x05)
+    return fail("hex: unknown record type");
+  return true;
+}
+
+int hexRead(uint8_t *buf, unsigned int len)
+{
+  unsigned int n = 0;
+  while (n < len)
+  {
+    if (fillLeft > 0)
+    {
+      unsigned int k = (fillLeft < len - n) ? fillLeft : len - n;
+      memset(buf + n, 0xFF, k);
+      fillLeft -= k;
+      n += k;
+    }
+    else if (dataLeft > 0)
+    {
+      unsigned int k = (dataLeft < len - n) ? dataLeft : len - n;
+      memcpy(buf + n, record + dataPos, k);
+      dataPos += k;
+      dataLeft -= k;
+      n += k;
+    }
+    else if (hexEnded)
+      break;
+    else if (!readRecord() || !processRecord())
+      return -1;
+  }
+  // Only blank lines after the end of file record; this also checks the trailer of a compressed file
+  if (hexEnded && n == 0)
+  {
+    int c;
+    while ((c = readSourceByte()) >= 0)
+      if (c != '\r' && c != '\n' && c != ' ')
+        return failRead("hex: data after the end of file record");
+    if (srcFailed)
+      return -1;
+  }
+  return n;
+}
+
+
+// Common to the file and the stream, the source is set
+// imageSize: size of the image in the gzip trailer, 0 if unknown
+bool begin(uint32_t imageSize, uint32_t base, uint32_t maxSize)
+{
+  inLen = inPos = 0;
+  srcLen = srcPos = 0;
+  srcFailed = false;
+  outputLen = 0;
+  sourcePos = 0;
+
+  // The format is given by the first bytes: 0x1F 0x8B for gzip and ':' for Intel HEX
+  // They stay in the input buffer, a stream cannot be read again
+  int n = readInput(inBuf, sizeof(inBuf));
+  if (n < 0)
+  {
+    close();
+    return false;
+  }
+  inLen = n;
+  compressed = (inLen >= 2 && inBuf[0] == 0x1F && inBuf[1] == 0x8B);
+  if (compressed && !beginInflate(imageSize))
+  {
+    close();
+    return false;
+  }
+  int first = readSourceByte();
+  if (first >= 0)
+    srcPos--;
+  hex = (first == ':');
+  hexBase = base;
+  maxImageSize = maxSize;
+  hexExtAddr = 0;
+  hexNextAddr = base;
+  fillLeft = 0;
+  dataLeft = 0;
+  hexEnded = false;
+  return !srcFailed;
+}
+
+bool open(const char* path, uint32_t base, uint32_t maxSize)
+{
+  close();
+  errorMsg[0] = 0x00;
+  imageFile = LittleFS.open(path, "r");
+  if (!imageFile)
+  {
+    snprintf(errorMsg, sizeof(errorMsg), "failed to open %s", path);
+    return false;
+  }
+  source = &imageFile;
+  sourceSize = imageFile.size();
+
+  // Size of the image in the gzip trailer
+  uint32_t imageSize = 0;
+  uint8_t trailer[4];
+  if (sourceSize >= 18 && imageFile.seek(sourceSize - 4) && imageFile.read(trailer, 4) == 4)
+    imageSize = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (uint32_t)trailer[3] << 24;
+  imageFile.seek(0);
+  return begin(imageSize, base, maxSize);
+}
+
+bool open(Stream &stream, uint32_t size, uint32_t base, uint32_t maxSize)
+{
+  close();
+  errorMsg[0] = 0x00;
+  source = &stream;
+  sourceSize = size;
+  return begin(0, base, maxSize);
+}
+
+int read(uint8_t *buf, unsigned int len)
+{
+  int n = hex ? hexRead(buf, len) : readSource(buf, len);
+  if (n > 0 && outputLen + n > maxImageSize)
+    return failRead("the image is larger than the flash");
+  if (n > 0)
+    outputLen += n;
+  return n;
+}
+
+void close()
+{
+  if (imageFile)
+    imageFile.close();
+  source = NULL;
+  if (window)
+    free(window);
+  window = NULL;
+  if (inflateState)
+    free(inflateState);
+  inflateState = NULL;
+}
+
+const char* formatStr()
+{
+  if (compressed)
+    return hex ? "gzip/hex" : "gzip/bin";
+  return hex ? "hex" : "bin";
+}
+
+const char* error()
+{
+  return errorMsg;
+}
+
+uint32_t filePosition()
+{
+  return source ? sourcePos : 0;
+}
+
+uint32_t fileSize()
+{
+  return source ? sourceSize : 0;
+}
+
+uint32_t imageSize()
+{
+  return outputLen;
+}
+
+} // namespace stm32image
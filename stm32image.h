@@ -0,0 +1,32 @@
+#ifndef STM32IMAGE
+#define STM32IMAGE
+
+#include <Arduino.h>
+
+
+// Streaming decoder of the STM32 firmware stored on LittleFS or received from a stream: raw binary or Intel HEX,
+// optionally compressed with gzip
+// Only small buffers are used, the image is decoded while it is read
+namespace stm32image
+{
+  // base: address of the start of the flash, the HEX records are placed from there
+  // maxSize: size of the flash, the HEX records beyond are rejected as soon as their address is decoded
+  bool open(const char* path, uint32_t base, uint32_t maxSize);
+  // size: bytes to be read from the stream, 0 if unknown (up to the end of the stream)
+  bool open(Stream &stream, uint32_t size, uint32_t base, uint32_t maxSize);
+  // Next bytes of the image, the gaps between the HEX records are filled with 0xFF
+  // Returns the number of bytes, 0 at the end of the image (after the checksums have been verified) or -1 on error
+  int read(uint8_t *buf, unsigned int len);
+  void close();
+
+  // e.g. "gzip/hex"
+  const char* formatStr();
+  const char* error();
+  // Bytes of the file (or stream) read so far and its size
+  uint32_t filePosition();
+  uint32_t fileSize();
+  // Bytes of the image returned so far
+  uint32_t imageSize();
+}
+
+#endif
@@ -4,7 +4,6 @@
 #include "config.h"
 #include "mqtt.h"
 #include "switches.h"
-#include "ESP8266TimerInterrupt.h"
 
 
 namespace switches {
@@ -29,20 +28,11 @@ namespace switches {
   #define ALREADY_PUBLISHED           255
   #define NO_CHANGE                   255
 
-/*
-  #define INTERRUP_TIME       10      // Every 10 ms
-  #define SLOW_LED_BLINKING   25      // 250 ms
-  #define FAST_LED_BLINKNG    10      // 100 ms
-  #define LONG_CLICK_DURATION 50      // 500 ms to detect long click
-  #define DEBOUNCE_DURATION   20      // 200 ms
-  */
-  #define INTERRUP_TIME       25      // 25: Every 25 ms
-  #define SLOW_LED_BLINKING   10      // 250 ms
-  #define FAST_LED_BLINKNG    4       // 100 ms
-  #define LONG_CLICK_DURATION 20      // 500 ms to detect long click
-  #define DEBOUNCE_DURATION   4       // 4: 100 ms. If this value is too large, it does not detect double click
-  
-  ESP8266Timer ITimer;      // For the builtin Leb blinking
+  #define SLOW_LED_BLINKING   250     // ms
+  #define FAST_LED_BLINKING   100     // ms
+  #define LONG_CLICK_DURATION 500     // ms to detect long click
+  #define DEBOUNCE_DURATION   100000  // us, the edges after a change are ignored for this time. If this value is too large, it does not detect double click
+  #define SETTLED_DURATION    60000   // ms, a level held longer is taken as held forever (micros() wraps after 71 minutes)
 
   float temperature;        // Internal temperature
   bool overheatingAlarm = false;
@@ -62,27 +52,35 @@ namespace switches {
   unsigned long prevTime = millis();
 
   // For the LED switching
-  volatile uint8_t ledBlinkingMode=LED_UNKNOWN;
-  volatile uint8_t ledBlinkDuration=0;
-  volatile uint8_t ledBlinkTickCounter=0;
+  uint8_t ledBlinkingMode=LED_UNKNOWN;
+  unsigned long ledBlinkDuration=0;    // in ms, 0 for no blinking
+  unsigned long ledToggleTime=0;
   unsigned long ledOnTime=0;
 
 
-  // For computing the current state for the switch 
-  #ifdef SHELLY_SW0
-  volatile uint8_t sw0StateFrame[5];
-  volatile uint8_t sw0StateFrameDuration[5];
-  #endif
-
-  #ifdef SHELLY_SW1
-  volatile uint8_t sw1StateFrame[5];
-  volatile uint8_t sw1StateFrameDuration[5];
-  #endif
+  // The edges of the switches, timestamped by the GPIO interrupts and decoded by handle()
+  // Single producer (the interrupts, which do not nest) and single consumer (handle()): no lock is needed
+  #define SWITCH_EVENTS 32                          // power of two
+  volatile uint32_t switchEventTime[SWITCH_EVENTS]; // in us
+  volatile uint8_t switchEventID[SWITCH_EVENTS];
+  volatile uint8_t switchEventLevel[SWITCH_EVENTS];
+  volatile uint8_t switchEventHead=0;               // only written by the interrupts
+  volatile uint8_t switchEventTail=0;               // only written by handle()
+  volatile bool switchEventOverflow=false;
 
-  #ifdef SHELLY_SW2
-  volatile uint8_t sw2StateFrame[5];
-  volatile uint8_t sw2StateFrameDuration[5];
-  #endif
+  // For computing the current state for the switch from the debounced levels
+  struct SwitchInput
+  {
+    int8_t pin;                   // -1 if the switch does not exist
+    uint8_t rawLevel;             // level at the last edge
+    uint32_t rawTime;             // in us
+    uint32_t changeTime;          // in us, time of the last debounced change
+    bool settled;                 // the current level has been held for more than SETTLED_DURATION
+    bool longClickDone;
+    uint8_t stateFrame[5];        // the last debounced levels, the current one last
+    uint16_t stateFrameDuration[5];  // in ms, the one of the current level is set when it ends
+  };
+  SwitchInput switchInputs[3] = {{-1}, {-1}, {-1}};
 
   // The current state of the switch
   volatile uint8_t sw0State=ALREADY_PUBLISHED;
@@ -94,8 +92,8 @@ namespace switches {
     // If the new mode has been already set, nothing to be done
     if (ledBlinkingMode==ledMode)
       return;
-    ledBlinkTickCounter=0;
     ledBlinkingMode=ledMode;
+    ledToggleTime=millis();
     ledOnTime=0;
     pinMode(SHELLY_BUILTIN_LED, OUTPUT);
     switch(ledMode)
@@ -105,10 +103,10 @@ namespace switches {
       digitalWrite(SHELLY_BUILTIN_LED, HIGH);
       break;
       case LED_FAST_BLINKING:
-      ledBlinkDuration=4;         // 100 ms
+      ledBlinkDuration=FAST_LED_BLINKING;
       break;
       case LED_SLOW_BLINKING:
-      ledBlinkDuration=10;         // 250 ms
+      ledBlinkDuration=SLOW_LED_BLINKING;
       break;
       case LED_ON:
       ledBlinkDuration=0;         // No blinking
@@ -134,49 +132,58 @@ namespace switches {
     return sw0State;
   }
 
-  volatile uint8_t ICACHE_RAM_ATTR processFrame(volatile uint8_t newState, volatile uint8_t *swStateFrame, volatile uint8_t *swStateFrameDuration)
+  void ICACHE_RAM_ATTR pushEdge(uint8_t switchID, uint8_t pin)
   {
-    // For debouncing
-    if (swStateFrameDuration[4]<DEBOUNCE_DURATION)
-    {
-      swStateFrameDuration[4]++;
-    }
-    else if (newState != swStateFrame[4])
+    uint8_t head=switchEventHead;
+    uint8_t next=(head+1)&(SWITCH_EVENTS-1);
+    if (next==switchEventTail)
     {
-      swStateFrame[0]=swStateFrame[1];
-      swStateFrame[1]=swStateFrame[2];
-      swStateFrame[2]=swStateFrame[3];
-      swStateFrame[3]=swStateFrame[4];
-      swStateFrame[4]=newState;
-      
-      swStateFrameDuration[0]=swStateFrameDuration[1];
-      swStateFrameDuration[1]=swStateFrameDuration[2];
-      swStateFrameDuration[2]=swStateFrameDuration[3];
-      swStateFrameDuration[3]=swStateFrameDuration[4];
-      swStateFrameDuration[4]=1;
+      // Full: the level is read again by handle()
+      switchEventOverflow=true;
+      return;
     }
-    else if (swStateFrameDuration[4]<254)
-      swStateFrameDuration[4]++;
+    switchEventTime[head]=micros();
+    switchEventID[head]=switchID;
+    switchEventLevel[head]=digitalRead(pin);
+    // The event is published after it has been written
+    switchEventHead=next;
+  }
+
+  #ifdef SHELLY_SW0
+  void ICACHE_RAM_ATTR sw0Edge() { pushEdge(0, SHELLY_SW0); }
+  #endif
+  #ifdef SHELLY_SW1
+  void ICACHE_RAM_ATTR sw1Edge() { pushEdge(1, SHELLY_SW1); }
+  #endif
+  #ifdef SHELLY_SW2
+  void ICACHE_RAM_ATTR sw2Edge() { pushEdge(2, SHELLY_SW2); }
+  #endif
+
+  // The gesture ended by a change of the debounced level
+  uint8_t processFrame(SwitchInput &sw)
+  {
+    uint8_t *swStateFrame=sw.stateFrame;
+    uint16_t *swStateFrameDuration=sw.stateFrameDuration;
 
     if (switchType==TOGGLE_BUTTON)
     {
       // Toggle button
-      if (swStateFrame[3]!=switchStateForLightOff && swStateFrameDuration[3]<LONG_CLICK_DURATION && swStateFrame[4]==switchStateForLightOff && swStateFrameDuration[4]==1)
+      if (swStateFrame[3]!=switchStateForLightOff && swStateFrameDuration[3]<LONG_CLICK_DURATION && swStateFrame[4]==switchStateForLightOff)
       {
         light::lightOff();
         return BUTTON_OFF_ON_OFF;
       }
-      else if (swStateFrame[3]==switchStateForLightOff && swStateFrameDuration[3]<LONG_CLICK_DURATION && swStateFrame[4]!=switchStateForLightOff && swStateFrameDuration[4]==1)
+      else if (swStateFrame[3]==switchStateForLightOff && swStateFrameDuration[3]<LONG_CLICK_DURATION && swStateFrame[4]!=switchStateForLightOff)
       {
         light::lightOn();
         return BUTTON_ON_OFF_ON;
       }
-      else if (swStateFrame[4]!=switchStateForLightOff && swStateFrameDuration[4]==1)
+      else if (swStateFrame[4]!=switchStateForLightOff)
       {
         light::lightOn();
         return BUTTON_ON;
       }
-      else if (swStateFrame[4]==switchStateForLightOff && swStateFrameDuration[4]==1)
+      else
       {
         light::lightOff();
         return BUTTON_OFF;
@@ -185,132 +192,169 @@ namespace switches {
     else
     {
       // Push button
-      // Detect double click -> does not work
+      // Detect double click, the first click has already been reported as a short click
       if (swStateFrame[0]==switchStateForLightOff &&
           swStateFrame[1]!=switchStateForLightOff && swStateFrameDuration[1]<LONG_CLICK_DURATION &&
           swStateFrame[2]==switchStateForLightOff && swStateFrameDuration[2]<LONG_CLICK_DURATION &&
           swStateFrame[3]!=switchStateForLightOff && swStateFrameDuration[3]<LONG_CLICK_DURATION &&
-          swStateFrame[4]==switchStateForLightOff && swStateFrameDuration[4]==1)
+          swStateFrame[4]==switchStateForLightOff)
       {
         light::lightToggle();
         return BUTTON_DOUBLE_CLICK;
       }
       else if (swStateFrame[3]!=switchStateForLightOff && swStateFrameDuration[3]<LONG_CLICK_DURATION &&
-               swStateFrame[4]==switchStateForLightOff && swStateFrameDuration[4]==1)
+               swStateFrame[4]==switchStateForLightOff)
       {
         // short click
         light::lightToggle();
         return BUTTON_SHORT_CLICK;
       }
-      else if (swStateFrame[3]==switchStateForLightOff && swStateFrame[4]!=switchStateForLightOff && swStateFrameDuration[4]==LONG_CLICK_DURATION)
-      {
-        // Long click with parameter true to disable the light auto turn off
-        light::lightToggle(true);
-        return BUTTON_LONG_CLICK;
-      }
     }
     return NO_CHANGE;
   }
-  
-  void ICACHE_RAM_ATTR checkSwitch(void)
+
+  void setSwitchState(uint8_t switchID, uint8_t newState)
   {
-    volatile uint8_t newState,tmp;
+    if (newState==NO_CHANGE)
+      return;
+    getSwState(switchID)=newState;
+    if (switchID!=0)
+      return;
+    switch(newState)
+    {
+      case BUTTON_SHORT_CLICK:
+      logging::getLogStream().println("switch: BUTTON_SHORT_CLICK for built-in switch");
+      break;
+      case BUTTON_DOUBLE_CLICK:
+      logging::getLogStream().println("switch: BUTTON_DOUBLE_CLICK for built-in switch");
+      break;
+      case BUTTON_LONG_CLICK:
+      logging::getLogStream().println("switch: BUTTON_LONG_CLICK for built-in switch");
+      wifi::factoryReset();
+      break;
+    }
+  }
 
-    #ifdef SHELLY_SW0
-    newState=digitalRead(SHELLY_SW0);
-    tmp=processFrame(newState, sw0StateFrame, sw0StateFrameDuration);
-    if (tmp!=NO_CHANGE)
+  // New debounced level at the time t (in us)
+  void changeLevel(uint8_t switchID, uint8_t newState, uint32_t t)
+  {
+    SwitchInput &sw=switchInputs[switchID];
+    uint32_t duration=sw.settled ? SETTLED_DURATION : (t-sw.changeTime)/1000;
+    for (uint8_t i=0;i<4;i++)
     {
-      sw0State=tmp;
-      switch(sw0State)
-      {
-        case BUTTON_SHORT_CLICK:
-        logging::getLogStream().println("switch: BUTTON_SHORT_CLICK for built-in switch");
-        break;
-        case BUTTON_DOUBLE_CLICK:
-        logging::getLogStream().println("switch: BUTTON_DOUBLE_CLICK for built-in switch");
-        break;
-        case BUTTON_LONG_CLICK:
-        logging::getLogStream().println("switch: BUTTON_LONG_CLICK for built-in switch");
-        wifi::factoryReset();
-        break;
-      }
+      sw.stateFrame[i]=sw.stateFrame[i+1];
+      sw.stateFrameDuration[i]=sw.stateFrameDuration[i+1];
     }
-    #endif
-    
-    #ifdef SHELLY_SW1
-    newState=digitalRead(SHELLY_SW1);
-    tmp=processFrame(newState, sw1StateFrame, sw1StateFrameDuration);
-    if (tmp!=NO_CHANGE)
-      sw1State=tmp;
-    #endif
+    sw.stateFrameDuration[3]=min(duration, (uint32_t)0xFFFF);
+    sw.stateFrame[4]=newState;
+    sw.stateFrameDuration[4]=0;
+    sw.changeTime=t;
+    sw.settled=false;
+    sw.longClickDone=false;
+    setSwitchState(switchID, processFrame(sw));
+  }
 
-    #ifdef SHELLY_SW2
-    newState=digitalRead(SHELLY_SW2);
-    //logging::getLogStream().printf("%d",newState);            // For debugging
-    tmp=processFrame(newState, sw2StateFrame, sw2StateFrameDuration); 
-    if (tmp!=NO_CHANGE)
-      sw2State=tmp;   
-    #endif
+  // The first edge after the debounce time changes the level at once, the later ones are ignored until the end of the debounce time
+  void processEdge(uint8_t switchID, uint8_t level, uint32_t t)
+  {
+    SwitchInput &sw=switchInputs[switchID];
+    if (sw.pin<0)
+      return;
+    sw.rawLevel=level;
+    sw.rawTime=t;
+    if (level!=sw.stateFrame[4] && (sw.settled || t-sw.changeTime>=DEBOUNCE_DURATION))
+      changeLevel(switchID, level, t);
+  }
 
-    // For the built-in led blinking
-    if (ledBlinkDuration>0)
+  // What depends on the time only: the level reached during the debounce time and the long click
+  void checkSwitch(uint8_t switchID, uint32_t now)
+  {
+    SwitchInput &sw=switchInputs[switchID];
+    if (sw.pin<0)
+      return;
+    if (!sw.settled && now-sw.changeTime>=DEBOUNCE_DURATION && sw.rawLevel!=sw.stateFrame[4])
     {
-      ledBlinkTickCounter++;
-      if (ledBlinkTickCounter>ledBlinkDuration)
-      {
-        digitalWrite(SHELLY_BUILTIN_LED, !(digitalRead(SHELLY_BUILTIN_LED)));  //Invert Current State of LED
-        ledBlinkTickCounter=0;
-      }
+      uint32_t t=(sw.rawTime-sw.changeTime>=DEBOUNCE_DURATION) ? sw.rawTime : sw.changeTime+DEBOUNCE_DURATION;
+      changeLevel(switchID, sw.rawLevel, t);
+    }
+    if (!sw.settled && now-sw.changeTime>=(uint32_t)SETTLED_DURATION*1000)
+      sw.settled=true;
+    if (switchType==PUSH_BUTTON && !sw.longClickDone &&
+        sw.stateFrame[3]==switchStateForLightOff && sw.stateFrame[4]!=switchStateForLightOff &&
+        (sw.settled || now-sw.changeTime>=(uint32_t)LONG_CLICK_DURATION*1000))
+    {
+      // Long click with parameter true to disable the light auto turn off
+      sw.longClickDone=true;
+      light::lightToggle(true);
+      setSwitchState(switchID, BUTTON_LONG_CLICK);
     }
   }
-  
-  void setup()
+
+  void handleSwitches()
   {
-    uint8_t state;
-    
-    #ifdef SHELLY_SW0
-    pinMode(SHELLY_SW0, INPUT_PULLUP);  // only works with INPUT_PULLUP
-    state=digitalRead(SHELLY_SW0);
-    for (int i=0;i<sizeof(sw0StateFrame);i++)
+    // The events are processed in the order of the edges, even if loop() has been delayed
+    while (switchEventTail!=switchEventHead)
     {
-      sw0StateFrameDuration[i]=255;
-      sw0StateFrame[i]=state;
+      uint8_t tail=switchEventTail;
+      processEdge(switchEventID[tail], switchEventLevel[tail], switchEventTime[tail]);
+      switchEventTail=(tail+1)&(SWITCH_EVENTS-1);
     }
-    #endif
+    uint32_t now=micros();
+    if (switchEventOverflow)
+    {
+      // Some edges have been lost, the levels are read again
+      switchEventOverflow=false;
+      for (uint8_t i=0;i<3;i++)
+        if (switchInputs[i].pin>=0)
+          processEdge(i, digitalRead(switchInputs[i].pin), now);
+    }
+    for (uint8_t i=0;i<3;i++)
+      checkSwitch(i, now);
+  }
 
-    #ifdef SHELLY_SW1
-    pinMode(SHELLY_SW1, INPUT);
-    state=digitalRead(SHELLY_SW1);
+  void setupSwitch(uint8_t switchID, uint8_t pin, uint8_t mode, void (*isr)(void))
+  {
+    SwitchInput &sw=switchInputs[switchID];
+    pinMode(pin, mode);
     // Initialise the frame with the current state of the switch
     // By default, the light is off when the switch is powering on
-    for (int i=0;i<sizeof(sw1StateFrame);i++)
+    sw.pin=pin;
+    sw.rawLevel=digitalRead(pin);
+    sw.rawTime=micros();
+    sw.changeTime=sw.rawTime;
+    sw.settled=true;
+    sw.longClickDone=true;
+    for (int i=0;i<sizeof(sw.stateFrame);i++)
     {
-      sw1StateFrameDuration[i]=255;
-      sw1StateFrame[i]=state;
+      sw.stateFrameDuration[i]=0xFFFF;
+      sw.stateFrame[i]=sw.rawLevel;
     }
+    attachInterrupt(digitalPinToInterrupt(pin), isr, CHANGE);
+  }
+  
+  void setup()
+  {
+    // The edges are timestamped by the GPIO interrupts, there is no interrupt when the switches do not change
+    #ifdef SHELLY_SW0
+    setupSwitch(0, SHELLY_SW0, INPUT_PULLUP, sw0Edge);  // only works with INPUT_PULLUP
+    #endif
+
+    #ifdef SHELLY_SW1
+    setupSwitch(1, SHELLY_SW1, INPUT, sw1Edge);
     #endif
     
     #ifdef SHELLY_SW2
-    pinMode(SHELLY_SW2, INPUT);
-    state=digitalRead(SHELLY_SW2);
-    for (int i=0;i<sizeof(sw2StateFrame);i++)
-    {
-      sw2StateFrameDuration[i]=255;
-      sw2StateFrame[i]=state;
-    }
+    setupSwitch(2, SHELLY_SW2, INPUT, sw2Edge);
     #endif
-    
-    // Interrup every 25 ms, misses click with 50 ms
-    // Bug: interrup should be disable when firmware is uploading
-    ITimer.attachInterruptInterval(1000 * INTERRUP_TIME, checkSwitch);
   }
 
-  // Disable timer interrupt. This is needed for the OTA firmware update since it can corrupt the uploading
+  // Disable the GPIO interrupts. This is needed for the OTA firmware update since it can corrupt the uploading
   void disableInterrupt()
   {
-    ITimer.detachInterrupt();
-    logging::getLogStream().println("switch: timer interrupt disable");
+    for (uint8_t i=0;i<3;i++)
+      if (switchInputs[i].pin>=0)
+        detachInterrupt(digitalPinToInterrupt(switchInputs[i].pin));
+    logging::getLogStream().println("switch: GPIO interrupts disabled");
   }
   
   void overheating(int temperature)
@@ -320,10 +364,8 @@ namespace switches {
     {
       if (temperatureLogging)
         logging::getLogStream().printf("light: overheating; the light is switched off.\n");
-      light::setBrightness(0);            // Brightness to 0
-      light::stopBlinking();      // Stop blinking
-      if (temperatureLogging)
-        logging::getLogStream().printf("light: stop blinking\n");
+      // The level 0 of the STM32, not the minimum brightness; the blinking is stopped too
+      light::cutOff();
     }
     overheatingAlarm = true;
   }
@@ -405,6 +447,9 @@ namespace switches {
   
   void handle()
   { 
+    // Debounce and decode the edges of the switches
+    handleSwitches();
+
     // Publish new values to MQTT if needed
     #ifdef SHELLY_SW0
     publishMQTTChangeSwitch(0);
@@ -454,6 +499,12 @@ namespace switches {
     {
       mqttOverheatingAlarm=false;
     }
+    // For the built-in led blinking
+    if (ledBlinkDuration>0 && now-ledToggleTime>=ledBlinkDuration)
+    {
+      digitalWrite(SHELLY_BUILTIN_LED, !(digitalRead(SHELLY_BUILTIN_LED)));  //Invert Current State of LED
+      ledToggleTime=now;
+    }
     // Switch off the builtin led if its mode is on after one minute
     if ((ledOnTime!=0) && (ledBlinkingMode==LED_ON) && (now-ledOnTime>60000))
     {
@@ -0,0 +1,48 @@
+#include "Arduino.h"
+
+namespace
+{
+uint64_t now = 0;
+
+void defaultIdle()
+{
+  hostAdvance(1000);
+}
+
+void (*idleHandler)() = defaultIdle;
+}
+
+uint64_t hostMicros()
+{
+  return now;
+}
+
+void hostAdvance(uint64_t us)
+{
+  now += us;
+}
+
+void hostSetIdleHandler(void (*handler)())
+{
+  idleHandler = handler ? handler : defaultIdle;
+}
+
+unsigned long millis()
+{
+  return (unsigned long)(now / 1000);
+}
+
+unsigned long micros()
+{
+  return (unsigned long)now;
+}
+
+void delay(unsigned long ms)
+{
+  hostAdvance((uint64_t)ms * 1000);
+}
+
+void yield()
+{
+  idleHandler();
+}
@@ -0,0 +1,31 @@
+// Minimal host replacement of the Arduino core, to build stm32flash.cpp and the other modules outside of the ESP8266
+// The clock is virtual: it only moves when the code waits, see hostAdvance() and yield()
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+// Flash data is plain memory on the host
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+
+// Virtual time in microseconds since the start of the program
+uint64_t hostMicros();
+void hostAdvance(uint64_t us);
+// Called by yield() while the code is waiting for something, it must move the clock forward
+// By default the clock moves by 1 ms
+void hostSetIdleHandler(void (*handler)());
+
+#include "Stream.h"
+
+#endif
@@ -0,0 +1,29 @@
+// Minimal host replacement of LittleFS: no file can be opened, the images are given as streams
+#ifndef LITTLEFS_H
+#define LITTLEFS_H
+
+#include "Stream.h"
+
+class File : public Stream
+{
+  public:
+    explicit operator bool() const { return false; }
+    void close() {}
+    size_t size() const { return 0; }
+    size_t position() const { return 0; }
+    bool seek(uint32_t) { return false; }
+    int read(uint8_t *, size_t) { return 0; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    size_t write(uint8_t) override { return 0; }
+};
+
+struct FSClass
+{
+  File open(const char *, const char *) { return File(); }
+};
+
+inline FSClass LittleFS;
+
+#endif
@@ -0,0 +1,69 @@
+// Minimal host replacement of the Arduino Stream class, with the timed reads of the ESP8266 core
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include "Arduino.h"
+
+class Stream
+{
+  public:
+    virtual ~Stream() {}
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual size_t write(uint8_t byte) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+      size_t n = 0;
+      while (n < size && write(buffer[n]))
+        n++;
+      return n;
+    }
+    virtual void flush() {}
+
+    void setTimeout(unsigned long timeout)
+    {
+      _timeout = timeout;
+    }
+    unsigned long getTimeout() const
+    {
+      return _timeout;
+    }
+
+    // Read until the buffer is full or nothing comes for _timeout ms
+    virtual size_t readBytes(uint8_t *buffer, size_t length)
+    {
+      size_t count = 0;
+      while (count < length)
+      {
+        int c = timedRead();
+        if (c < 0)
+          break;
+        buffer[count++] = (uint8_t)c;
+      }
+      return count;
+    }
+    size_t readBytes(char *buffer, size_t length)
+    {
+      return readBytes((uint8_t *)buffer, length);
+    }
+
+  protected:
+    int timedRead()
+    {
+      unsigned long start = millis();
+      do
+      {
+        int c = read();
+        if (c >= 0)
+          return c;
+        yield();
+      } while (millis() - start < _timeout);
+      return -1;
+    }
+
+    unsigned long _timeout = 1000;
+};
+
+#endif
@@ -0,0 +1,202 @@
+// Benchmark of stm32flash.cpp against the emulated bootloader of the STM32
+// The times are those of the virtual clock, i.e. what the flashing takes on the device,
+// except the host time which measures the CPU cost of the flasher and of the emulator
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "stm32emu.h"
+#include "../stm32flash.h"
+
+namespace
+{
+#define FLASH_START 0x08000000
+#define PAGE_SIZE 0x400
+#define MAX_ATTEMPTS 3
+
+struct Result
+{
+  bool ok = false;
+  int attempts = 0;
+  uint64_t init = 0, erase = 0, write = 0, crc = 0;   // in us of the virtual clock
+};
+
+std::vector<uint8_t> loadImage(const char *path)
+{
+  std::vector<uint8_t> image;
+  FILE *f = fopen(path, "rb");
+  if (f)
+  {
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+      image.insert(image.end(), buf, buf + n);
+    fclose(f);
+  }
+  if (image.empty())
+  {
+    // Pseudo random image of the size of the firmware of the STM32
+    uint32_t seed = 1;
+    image.resize(37848);
+    for (uint8_t &b : image)
+    {
+      seed = seed * 1103515245 + 12345;
+      b = seed >> 16;
+    }
+  }
+  return image;
+}
+
+// Flash the image as light.cpp does: init, erase of the pages, write by blocks of 256 bytes,
+// check of the CRC. Any error restarts the whole sequence after a reset of the STM32.
+Result flash(STM32Emulator &emu, const std::vector<uint8_t> &image)
+{
+  Result r;
+  uint32_t pages = (image.size() + PAGE_SIZE - 1) / PAGE_SIZE;
+  uint32_t length = (image.size() + 3) & ~3;
+  std::vector<uint8_t> padded(image);
+  padded.resize(length, 0xFF);
+  uint32_t expected = stm32_sw_crc(STM32_CRC_INIT, padded.data(), length);
+
+  while (!r.ok && r.attempts < MAX_ATTEMPTS)
+  {
+    r.attempts++;
+    emu.reset();
+    uint64_t t = hostMicros();
+    stm32_t *stm = stm32_init(&emu, STREAM_SERIAL, 1);
+    r.init += hostMicros() - t;
+    if (stm == NULL)
+      continue;
+
+    t = hostMicros();
+    stm32_err_t s_err = stm32_erase_memory(stm, 0, pages);
+    r.erase += hostMicros() - t;
+
+    t = hostMicros();
+    for (size_t offset = 0; s_err == STM32_ERR_OK && offset < image.size(); offset += 256)
+    {
+      size_t len = image.size() - offset < 256 ? image.size() - offset : 256;
+      s_err = stm32_write_memory(stm, FLASH_START + offset, image.data() + offset, len);
+    }
+    r.write += hostMicros() - t;
+
+    if (s_err == STM32_ERR_OK)
+    {
+      uint32_t crc = 0;
+      t = hostMicros();
+      s_err = stm32_crc_wrapper(stm, FLASH_START, length, &crc);
+      r.crc += hostMicros() - t;
+      r.ok = s_err == STM32_ERR_OK && crc == expected;
+    }
+    stm32_close(stm);
+  }
+  return r;
+}
+
+void printStats()
+{
+  for (int i = 0; i < STM32_STAT_NB; i++)
+  {
+    const struct stm32_stat &st = stm32_stats[i];
+    if (st.count)
+      printf("    %-8s %6u calls, mean %6u us, max %6u us\n", stm32_stat_name((stm32_stat_t)i), st.count,
+             st.total / st.count, st.max);
+  }
+}
+
+void benchTiming(const std::vector<uint8_t> &image)
+{
+  static const uint32_t bauds[] = {115200, 230400, 460800};
+  printf("%-8s %-4s %8s %8s %8s %8s %8s %9s %9s\n", "baud", "crc", "init ms", "erase ms", "write ms", "crc ms",
+         "total ms", "KB/s", "host ms");
+  for (uint32_t baud : bauds)
+  {
+    for (int crcCmd = 0; crcCmd < 2; crcCmd++)
+    {
+      STM32EmuConfig config;
+      config.byteTime = (11 * 1000000 + baud - 1) / baud;     // 8E1
+      config.crcCmd = crcCmd;
+      STM32Emulator emu(config);
+      stm32_stats_reset();
+      auto h0 = std::chrono::steady_clock::now();
+      Result r = flash(emu, image);
+      auto h1 = std::chrono::steady_clock::now();
+      uint64_t total = r.init + r.erase + r.write + r.crc;
+      printf("%-8u %-4s %8.1f %8.1f %8.1f %8.1f %8.1f %9.1f %9.2f%s\n", baud, crcCmd ? "yes" : "no",
+             r.init / 1000.0, r.erase / 1000.0, r.write / 1000.0, r.crc / 1000.0, total / 1000.0,
+             image.size() * 1000.0 / total, std::chrono::duration<double, std::milli>(h1 - h0).count(),
+             r.ok ? "" : " FAILED");
+      if (baud == 115200 && !crcCmd)
+        printStats();
+    }
+  }
+}
+
+void benchFaults(const std::vector<uint8_t> &image)
+{
+  // Rates in parts per million
+  static const struct
+  {
+    uint32_t nack, drop;
+  } rates[] = {{0, 0}, {100, 0}, {0, 10}, {1000, 0}, {0, 100}, {1000, 100}};
+  const int runs = 50;
+  printf("\n%-6s %-6s %8s %8s %10s %10s\n", "nack", "drop", "ok", "retried", "mean ms", "max ms");
+  for (auto &rate : rates)
+  {
+    int ok = 0, retried = 0;
+    uint64_t total = 0, worst = 0;
+    for (int seed = 1; seed <= runs; seed++)
+    {
+      STM32Emulator emu;
+      emu.setRandomFaults(seed, rate.nack, rate.drop);
+      Result r = flash(emu, image);
+      uint64_t t = r.init + r.erase + r.write + r.crc;
+      ok += r.ok;
+      retried += r.attempts > 1;
+      total += t;
+      if (t > worst)
+        worst = t;
+    }
+    printf("%-6u %-6u %5d/%-2d %8d %10.1f %10.1f\n", rate.nack, rate.drop, ok, runs, retried,
+           total / 1000.0 / runs, worst / 1000.0);
+  }
+}
+}
+
+// Throughput of the software CRC: the reference bit by bit, the byte table of the ESP8266 and the slice-by-8 of the host
+void benchCRC(std::vector<uint8_t> image)
+{
+  static const struct
+  {
+    const char *name;
+    uint32_t (*crc)(uint32_t, uint8_t *, unsigned int);
+  } impls[] = {
+    {"bitwise", stm32_sw_crc_bitwise},
+    {"table", stm32_sw_crc_table},
+    {"slice-by-8", stm32_sw_crc_slice8},
+  };
+  image.resize((image.size() + 3) & ~3, 0xFF);
+  printf("\n%-12s %10s %10s %12s\n", "CRC", "MB", "ms", "MB/s");
+  for (auto &impl : impls)
+  {
+    // About 64 MB for the table implementations, the bitwise one is much slower
+    int rounds = (impl.crc == stm32_sw_crc_bitwise ? 8 : 64) * 1048576 / image.size();
+    uint32_t crc = STM32_CRC_INIT;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++)
+      crc = impl.crc(crc, image.data(), image.size());
+    auto t1 = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    double mb = (double)rounds * image.size() / 1048576;
+    printf("%-12s %10.1f %10.1f %12.1f   (CRC 0x%08X)\n", impl.name, mb, ms, mb * 1000 / ms, crc);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<uint8_t> image = loadImage(argc > 1 ? argv[1] : "../STM32 Firmware/stm_3F_02.bin");
+  printf("image of %u bytes\n\n", (unsigned)image.size());
+  benchTiming(image);
+  benchFaults(image);
+  benchCRC(image);
+  return 0;
+}
@@ -0,0 +1,195 @@
+// Throughput and fuzz benchmark of the parser of the frames received from the STM32 (stm32frames.cpp)
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "../stm32frames.h"
+
+namespace
+{
+#define FIFO_SIZE 128                   // bytes moved from the UART FIFO at each call of receivePacket()
+
+uint32_t rng = 1;
+
+uint32_t random32()
+{
+  // xorshift32
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+// Frame as sent by the STM32, the payload starts with the index of the frame
+void appendFrame(std::vector<uint8_t> &stream, uint32_t index, uint8_t payloadSize)
+{
+  size_t start = stream.size();
+  stream.push_back(STM32_FRAME_START_MARKER);
+  stream.push_back(index);
+  stream.push_back(0x10);
+  stream.push_back(payloadSize);
+  for (uint8_t i = 0; i < payloadSize; i++)
+    stream.push_back(i < 4 ? index >> (8 * i) : random32());
+  uint16_t crc = 0;
+  for (size_t i = start + 1; i < stream.size(); i++)
+    crc += stream[i];
+  stream.push_back(crc >> 8);
+  stream.push_back(crc);
+  stream.push_back(STM32_FRAME_END_MARKER);
+}
+
+struct Counts
+{
+  uint32_t ok = 0, badCrc = 0, badEnd = 0, timeouts = 0, skipped = 0;
+  std::vector<uint32_t> indexes;       // index of each good frame
+};
+
+// Feed the stream by chunks of FIFO_SIZE bytes, as receivePacket() does, and give up an incomplete
+// frame once the stream is over, as the timeout of light.cpp does when the line stays quiet
+Counts parse(const std::vector<uint8_t> &stream, bool keepIndexes)
+{
+  Counts c;
+  const uint8_t *frame;
+  uint16_t len;
+  size_t i = 0;
+  while (true)
+  {
+    size_t n = 0;
+    for (uint16_t room = stm32frames::room(); room > 0 && n < FIFO_SIZE && i < stream.size(); room--, n++)
+      stm32frames::push(stream[i++]);
+    if (n == 0)
+    {
+      if (i == stream.size() && stm32frames::pending(len) == NULL)
+        break;
+      stm32frames::resync();
+      c.timeouts++;
+    }
+    stm32frames::Result result;
+    while ((result = stm32frames::next(frame, len)) != stm32frames::FRAME_NONE)
+    {
+      if (result == stm32frames::FRAME_OK)
+      {
+        c.ok++;
+        if (keepIndexes && frame[3] >= 4)
+          c.indexes.push_back(frame[4] | frame[5] << 8 | frame[6] << 16 | (uint32_t)frame[7] << 24);
+      }
+      else if (result == stm32frames::FRAME_BAD_CRC)
+        c.badCrc++;
+      else
+        c.badEnd++;
+    }
+    c.skipped += stm32frames::takeSkipped();
+  }
+  return c;
+}
+
+void benchThroughput()
+{
+  struct
+  {
+    const char *name;
+    int noise;                          // random bytes between two frames
+    bool markers;                       // noise made of start markers followed by a big payload size
+  } cases[] = {
+    {"clean frames", 0, false},
+    {"noise between frames", 16, false},
+    {"false start markers", 4, true},
+  };
+  printf("%-22s %8s %8s %8s %8s %10s %10s\n", "stream", "bytes", "frames", "badCrc", "skipped", "ns/byte", "MB/s");
+  for (auto &test : cases)
+  {
+    std::vector<uint8_t> stream;
+    rng = 1;
+    for (uint32_t n = 0; stream.size() < 1000000; n++)
+    {
+      appendFrame(stream, n, 4 + random32() % 28);
+      for (int k = 0; k < test.noise; k++)
+        stream.push_back(test.markers ? (k % 2 ? 0xFF : STM32_FRAME_START_MARKER) : 0x80 | random32());
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    Counts c = parse(stream, false);
+    auto t1 = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    printf("%-22s %8u %8u %8u %8u %10.2f %10.1f\n", test.name, (unsigned)stream.size(), c.ok, c.badCrc, c.skipped,
+           ns / stream.size(), stream.size() * 1000.0 / ns);
+  }
+}
+
+// Random frames with random corruption: every frame left intact must come out of the parser,
+// unless a false frame happens to be valid and swallows it
+bool fuzz(int runs)
+{
+  bool ok = true;
+  uint32_t totalIntact = 0, totalLost = 0, totalFalse = 0;
+  for (int run = 1; run <= runs; run++)
+  {
+    rng = run;
+    std::vector<uint8_t> stream;
+    std::vector<bool> intact;
+    for (uint32_t n = 0; n < 2000; n++)
+    {
+      std::vector<uint8_t> frame;
+      appendFrame(frame, n, 4 + random32() % 40);
+      bool corrupted = random32() % 10 == 0;
+      if (corrupted)
+      {
+        uint32_t pos = random32() % frame.size();
+        switch (random32() % 4)
+        {
+          case 0:
+            frame[pos] ^= 1 << (random32() % 8);
+            break;
+          case 1:
+            frame.erase(frame.begin() + pos);
+            break;
+          case 2:
+            // inside the frame, a byte before the start marker is just noise
+            frame.insert(frame.begin() + 1 + pos % (frame.size() - 1), random32());
+            break;
+          default:
+            // payload size corrupted
+            frame[3] = 0xF0 | random32();
+            break;
+        }
+      }
+      intact.push_back(!corrupted);
+      stream.insert(stream.end(), frame.begin(), frame.end());
+      if (random32() % 20 == 0)
+        stream.push_back(random32());
+    }
+
+    Counts c = parse(stream, true);
+    std::vector<bool> seen(intact.size(), false);
+    uint32_t falseFrames = 0;
+    for (uint32_t index : c.indexes)
+    {
+      if (index < seen.size() && intact[index] && !seen[index])
+        seen[index] = true;
+      else
+        falseFrames++;
+    }
+    uint32_t lost = 0, nbIntact = 0;
+    for (size_t i = 0; i < intact.size(); i++)
+    {
+      nbIntact += intact[i];
+      lost += intact[i] && !seen[i];
+    }
+    if (lost > falseFrames)
+    {
+      printf("fuzz run %d: %u intact frames lost, %u false frames\n", run, lost, falseFrames);
+      ok = false;
+    }
+    totalIntact += nbIntact;
+    totalLost += lost;
+    totalFalse += falseFrames;
+  }
+  printf("\nfuzz: %d runs, %u intact frames, %u lost, %u false frames accepted: %s\n", runs, totalIntact, totalLost,
+         totalFalse, ok ? "ok" : "FAILED");
+  return ok;
+}
+}
+
+int main()
+{
+  benchThroughput();
+  return fuzz(200) ? 0 : 1;
+}
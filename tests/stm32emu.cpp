@@ -0,0 +1,525 @@
+#include "stm32emu.h"
+
+#define ACK 0x79
+#define NACK 0x1F
+
+#define CMD_INIT 0x7F
+#define CMD_GET 0x00
+#define CMD_GVR 0x01
+#define CMD_GID 0x02
+#define CMD_RM 0x11
+#define CMD_GO 0x21
+#define CMD_WM 0x31
+#define CMD_ER 0x43
+#define CMD_EE 0x44
+#define CMD_CRC 0xA1
+
+namespace
+{
+// The emulator that moves the virtual clock while the flasher waits for a reply
+STM32Emulator *current = NULL;
+}
+
+STM32Emulator::STM32Emulator(const STM32EmuConfig &config)
+  : cfg(config), flashMem(config.flashSize, 0xFF), ramMem(config.ramSize, 0x00)
+{
+  current = this;
+  hostSetIdleHandler(idle);
+}
+
+STM32Emulator::~STM32Emulator()
+{
+  if (current == this)
+  {
+    current = NULL;
+    hostSetIdleHandler(NULL);
+  }
+}
+
+void STM32Emulator::idle()
+{
+  // Jump to the next byte sent by the bootloader, if any
+  if (current && !current->replies.empty() && current->replies.front().readyTime > hostMicros())
+    hostAdvance(current->replies.front().readyTime - hostMicros());
+  else
+    hostAdvance(1000);
+}
+
+void STM32Emulator::reset()
+{
+  state = WAIT_INIT;
+  frame.clear();
+  replies.clear();
+  lineInFreeTime = lineOutFreeTime = hostMicros();
+}
+
+void STM32Emulator::nackNext(uint8_t command, int count)
+{
+  nackCmd = command;
+  nackCount = count;
+}
+
+void STM32Emulator::dropReply(uint32_t skip)
+{
+  dropReplyAt = st.bytesOut + st.droppedBytes + skip;
+}
+
+void STM32Emulator::dropRequest(uint32_t skip)
+{
+  dropRequestAt = st.bytesIn + st.droppedBytes + skip;
+}
+
+void STM32Emulator::setRandomFaults(uint32_t seed, uint32_t nack, uint32_t drop)
+{
+  rng = seed ? seed : 1;
+  nackRate = nack;
+  dropRate = drop;
+}
+
+bool STM32Emulator::randomly(uint32_t rate)
+{
+  if (rate == 0)
+    return false;
+  // xorshift32
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng % 1000000 < rate;
+}
+
+bool STM32Emulator::faultNack()
+{
+  if (nackCount > 0 && cmd == nackCmd)
+  {
+    nackCount--;
+    return true;
+  }
+  return randomly(nackRate);
+}
+
+uint8_t *STM32Emulator::memory(uint32_t addr, uint32_t length)
+{
+  if (addr >= cfg.flashStart && addr - cfg.flashStart + length <= cfg.flashSize)
+    return flashMem.data() + addr - cfg.flashStart;
+  if (addr >= cfg.ramStart && addr - cfg.ramStart + length <= cfg.ramSize)
+    return ramMem.data() + addr - cfg.ramStart;
+  return NULL;
+}
+
+const uint8_t *STM32Emulator::memory(uint32_t addr, uint32_t length) const
+{
+  return const_cast<STM32Emulator *>(this)->memory(addr, length);
+}
+
+uint32_t STM32Emulator::crc(uint32_t addr, uint32_t length) const
+{
+  const uint8_t *p = memory(addr, length);
+  uint32_t crc = 0xFFFFFFFF;
+  if (p == NULL || (length & 3))
+    return 0;
+  for (uint32_t i = 0; i < length; i += 4)
+  {
+    crc ^= p[i] | p[i + 1] << 8 | p[i + 2] << 16 | (uint32_t)p[i + 3] << 24;
+    for (int b = 0; b < 32; b++)
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+  }
+  return crc;
+}
+
+// Host side of the UART
+
+int STM32Emulator::available()
+{
+  int n = 0;
+  for (const Reply &r : replies)
+  {
+    if (r.readyTime > hostMicros())
+      break;
+    n++;
+  }
+  return n;
+}
+
+int STM32Emulator::read()
+{
+  if (replies.empty() || replies.front().readyTime > hostMicros())
+    return -1;
+  uint8_t byte = replies.front().byte;
+  replies.pop_front();
+  return byte;
+}
+
+int STM32Emulator::peek()
+{
+  if (replies.empty() || replies.front().readyTime > hostMicros())
+    return -1;
+  return replies.front().byte;
+}
+
+size_t STM32Emulator::write(uint8_t byte)
+{
+  // The byte reaches the STM32 once the previous ones and itself are on the line
+  uint64_t time = (lineInFreeTime > hostMicros() ? lineInFreeTime : hostMicros()) + cfg.byteTime;
+  lineInFreeTime = time;
+  if ((int64_t)(st.bytesIn + st.droppedBytes) == dropRequestAt || randomly(dropRate))
+  {
+    if ((int64_t)(st.bytesIn + st.droppedBytes) == dropRequestAt)
+      dropRequestAt = -1;
+    st.droppedBytes++;
+    return 1;
+  }
+  st.bytesIn++;
+  receive(byte, time);
+  return 1;
+}
+
+// STM32 side of the UART
+
+void STM32Emulator::send(uint8_t byte, uint64_t time)
+{
+  uint64_t ready = (time > lineOutFreeTime ? time : lineOutFreeTime) + cfg.byteTime;
+  lineOutFreeTime = ready;
+  if ((int64_t)(st.bytesOut + st.droppedBytes) == dropReplyAt || randomly(dropRate))
+  {
+    if ((int64_t)(st.bytesOut + st.droppedBytes) == dropReplyAt)
+      dropReplyAt = -1;
+    st.droppedBytes++;
+    return;
+  }
+  st.bytesOut++;
+  replies.push_back({byte, ready});
+}
+
+void STM32Emulator::ack(uint64_t time)
+{
+  send(ACK, time);
+}
+
+void STM32Emulator::nack(uint64_t time)
+{
+  st.nacks++;
+  send(NACK, time);
+  expect(WAIT_CMD, 1);
+}
+
+void STM32Emulator::expect(State next, size_t length)
+{
+  state = next;
+  frame.clear();
+  frameLength = length;
+}
+
+bool STM32Emulator::supported(uint8_t command) const
+{
+  switch (command)
+  {
+    case CMD_GET:
+    case CMD_GVR:
+    case CMD_GID:
+    case CMD_RM:
+    case CMD_GO:
+    case CMD_WM:
+      return true;
+    case CMD_ER:
+    case CMD_EE:
+      return command == cfg.eraseCmd;
+    case CMD_CRC:
+      return cfg.crcCmd;
+  }
+  return false;
+}
+
+void STM32Emulator::receive(uint8_t byte, uint64_t time)
+{
+  time += cfg.latency;
+  switch (state)
+  {
+    case RUNNING:
+      return;
+    case WAIT_INIT:
+      // The bootloader measures the baud rate on the init byte and ignores anything else
+      if (byte == CMD_INIT)
+      {
+        ack(time);
+        expect(WAIT_CMD, 1);
+      }
+      return;
+    case WAIT_CMD:
+      cmd = byte;
+      state = WAIT_CMD_CPL;
+      return;
+    case WAIT_CMD_CPL:
+      if (byte != (uint8_t)(cmd ^ 0xFF) || !supported(cmd))
+      {
+        nack(time);
+        return;
+      }
+      st.commands++;
+      startCommand(time);
+      return;
+    default:
+      break;
+  }
+
+  frame.push_back(byte);
+  // The length of these frames is in their first bytes
+  if (state == WAIT_WRITE_DATA && frame.size() == 1)
+    frameLength = frame[0] + 3;
+  else if (state == WAIT_ERASE && cmd == CMD_ER && frame.size() == 1)
+    frameLength = frame[0] == 0xFF ? 2 : frame[0] + 3;
+  else if (state == WAIT_ERASE && cmd == CMD_EE && frame.size() == 2)
+  {
+    uint16_t n = frame[0] << 8 | frame[1];
+    frameLength = n >= 0xFFF0 ? 3 : 2 * (n + 1) + 3;
+  }
+  if (frame.size() < frameLength)
+    return;
+
+  switch (state)
+  {
+    case WAIT_ADDRESS:
+      endAddress(time);
+      break;
+    case WAIT_READ_LEN:
+      endReadLength(time);
+      break;
+    case WAIT_WRITE_DATA:
+      endWrite(time);
+      break;
+    case WAIT_ERASE:
+      endErase(time);
+      break;
+    case WAIT_CRC_LEN:
+      endCrcLength(time);
+      break;
+    default:
+      break;
+  }
+}
+
+void STM32Emulator::startCommand(uint64_t time)
+{
+  switch (cmd)
+  {
+    case CMD_GET:
+    case CMD_GVR:
+    case CMD_GID:
+      if (faultNack())
+      {
+        nack(time);
+        return;
+      }
+      ack(time);
+      if (cmd == CMD_GET)
+      {
+        uint8_t cmds[] = {CMD_GET, CMD_GVR, CMD_GID, CMD_RM, CMD_GO, CMD_WM, cfg.eraseCmd, CMD_CRC};
+        uint8_t n = cfg.crcCmd ? sizeof(cmds) : sizeof(cmds) - 1;
+        send(n, time);
+        send(cfg.version, time);
+        for (uint8_t i = 0; i < n; i++)
+          send(cmds[i], time);
+      }
+      else if (cmd == CMD_GVR)
+      {
+        send(cfg.version, time);
+        send(0x00, time);
+        send(0x00, time);
+      }
+      else
+      {
+        send(0x01, time);
+        send(cfg.pid >> 8, time);
+        send(cfg.pid & 0xFF, time);
+      }
+      ack(time);
+      expect(WAIT_CMD, 1);
+      return;
+    case CMD_ER:
+    case CMD_EE:
+      ack(time);
+      expect(WAIT_ERASE, cmd == CMD_ER ? 1 : 2);
+      return;
+    default:
+      ack(time);
+      expect(WAIT_ADDRESS, 5);
+      return;
+  }
+}
+
+void STM32Emulator::endAddress(uint64_t time)
+{
+  if ((frame[0] ^ frame[1] ^ frame[2] ^ frame[3]) != frame[4])
+  {
+    nack(time);
+    return;
+  }
+  address = (uint32_t)frame[0] << 24 | frame[1] << 16 | frame[2] << 8 | frame[3];
+  if (memory(address, 1) == NULL || (cmd == CMD_GO && faultNack()))
+  {
+    nack(time);
+    return;
+  }
+  ack(time);
+  switch (cmd)
+  {
+    case CMD_RM:
+      expect(WAIT_READ_LEN, 2);
+      break;
+    case CMD_GO:
+      jumpAddress = address;
+      expect(RUNNING, 0);
+      break;
+    case CMD_WM:
+      expect(WAIT_WRITE_DATA, 1);
+      break;
+    case CMD_CRC:
+      expect(WAIT_CRC_LEN, 5);
+      break;
+  }
+}
+
+void STM32Emulator::endReadLength(uint64_t time)
+{
+  uint32_t n = frame[0] + 1;
+  const uint8_t *p = memory(address, n);
+  if (frame[1] != (uint8_t)(frame[0] ^ 0xFF) || p == NULL || faultNack())
+  {
+    nack(time);
+    return;
+  }
+  ack(time);
+  for (uint32_t i = 0; i < n; i++)
+    send(p[i], time);
+  expect(WAIT_CMD, 1);
+}
+
+void STM32Emulator::endWrite(uint64_t time)
+{
+  uint32_t n = frame[0] + 1;
+  uint8_t cs = 0;
+  for (size_t i = 0; i < frame.size() - 1; i++)
+    cs ^= frame[i];
+  uint8_t *p = memory(address, n);
+  if (cs != frame.back() || (n & 3) || p == NULL || faultNack())
+  {
+    nack(time);
+    return;
+  }
+  const uint8_t *data = frame.data() + 1;
+  if (address >= cfg.flashStart && address - cfg.flashStart < cfg.flashSize)
+  {
+    // The flash is programmed by half-words, which must be erased unless they are left unchanged
+    for (uint32_t i = 0; i < n; i += 2)
+    {
+      uint16_t value = data[i] | data[i + 1] << 8;
+      uint16_t old = p[i] | p[i + 1] << 8;
+      if (value == 0xFFFF)
+        continue;
+      if (old != 0xFFFF)
+      {
+        nack(time);
+        return;
+      }
+      p[i] = data[i];
+      p[i + 1] = data[i + 1];
+      time += cfg.halfWordProgramTime;
+      st.programmedBytes += 2;
+    }
+  }
+  else
+    memcpy(p, data, n);
+  ack(time);
+  expect(WAIT_CMD, 1);
+}
+
+void STM32Emulator::endErase(uint64_t time)
+{
+  uint8_t cs = 0;
+  for (size_t i = 0; i < frame.size() - 1; i++)
+    cs ^= frame[i];
+  // The mass erase of the erase command is 0xFF followed by its complement
+  if (cmd == CMD_ER && frame[0] == 0xFF)
+    cs = 0x00;
+  if (cs != frame.back() || faultNack())
+  {
+    nack(time);
+    return;
+  }
+
+  uint32_t pageCount = cfg.flashSize / cfg.pageSize;
+  std::vector<uint32_t> pages;
+  bool mass = false;
+  if (cmd == CMD_ER)
+  {
+    if (frame[0] == 0xFF)
+      mass = true;
+    else
+      for (size_t i = 1; i < frame.size() - 1; i++)
+        pages.push_back(frame[i]);
+  }
+  else
+  {
+    uint16_t n = frame[0] << 8 | frame[1];
+    if (n == 0xFFFF)
+      mass = true;
+    else if (n >= 0xFFF0)
+    {
+      // bank erase is not available on this device
+      nack(time);
+      return;
+    }
+    else
+      for (size_t i = 2; i < frame.size() - 1; i += 2)
+        pages.push_back(frame[i] << 8 | frame[i + 1]);
+  }
+
+  if (mass)
+  {
+    memset(flashMem.data(), 0xFF, flashMem.size());
+    st.erasedPages += pageCount;
+    time += cfg.massEraseTime;
+  }
+  else
+  {
+    for (uint32_t page : pages)
+    {
+      if (page >= pageCount)
+      {
+        nack(time);
+        return;
+      }
+    }
+    for (uint32_t page : pages)
+    {
+      memset(flashMem.data() + page * cfg.pageSize, 0xFF, cfg.pageSize);
+      st.erasedPages++;
+      time += cfg.pageEraseTime;
+    }
+  }
+  ack(time);
+  expect(WAIT_CMD, 1);
+}
+
+void STM32Emulator::endCrcLength(uint64_t time)
+{
+  uint32_t length = (uint32_t)frame[0] << 24 | frame[1] << 16 | frame[2] << 8 | frame[3];
+  if ((frame[0] ^ frame[1] ^ frame[2] ^ frame[3]) != frame[4] || (length & 3) ||
+      memory(address, length) == NULL || faultNack())
+  {
+    nack(time);
+    return;
+  }
+  ack(time);
+  // The CRC unit takes 4 cycles of 8 MHz per word
+  time += length / 8;
+  ack(time);
+  uint32_t value = crc(address, length);
+  uint8_t cs = 0;
+  for (int shift = 24; shift >= 0; shift -= 8)
+  {
+    send(value >> shift, time);
+    cs ^= value >> shift;
+  }
+  send(cs, time);
+  expect(WAIT_CMD, 1);
+}
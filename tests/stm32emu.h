@@ -0,0 +1,136 @@
+// Emulation of the UART bootloader of the STM32 (ST application note AN3155), seen from the ESP8266 as a Stream
+// The timing of the UART and of the flash is simulated with the virtual clock of Arduino.cpp
+#ifndef STM32EMU_H
+#define STM32EMU_H
+
+#include <deque>
+#include <vector>
+#include <Stream.h>
+
+struct STM32EmuConfig
+{
+  uint16_t pid = 0x440;                   // STM32F030x8 of the Shelly Dimmer 2
+  uint8_t version = 0x31;                 // bootloader version
+  uint32_t flashStart = 0x08000000;
+  uint32_t flashSize = 0x10000;
+  uint32_t pageSize = 0x400;
+  uint32_t ramStart = 0x20000000;
+  uint32_t ramSize = 0x2000;
+  uint8_t eraseCmd = 0x44;                // 0x43 for the erase command or 0x44 for the extended erase
+  bool crcCmd = false;                    // the bootloader of the STM32F030 has no CRC command
+
+  uint32_t byteTime = 96;                 // in us, one byte on the UART (11 bits in 8E1 at 115200 bauds)
+  uint32_t latency = 20;                  // in us, from the last byte of a request to the reply
+  uint32_t pageEraseTime = 20000;         // in us
+  uint32_t massEraseTime = 40000;         // in us
+  uint32_t halfWordProgramTime = 53;      // in us
+};
+
+struct STM32EmuStats
+{
+  uint32_t commands = 0;
+  uint32_t nacks = 0;
+  uint32_t bytesIn = 0;                   // received from the host
+  uint32_t bytesOut = 0;                  // sent to the host
+  uint32_t droppedBytes = 0;
+  uint32_t erasedPages = 0;
+  uint32_t programmedBytes = 0;
+};
+
+class STM32Emulator : public Stream
+{
+  public:
+    explicit STM32Emulator(const STM32EmuConfig &config = STM32EmuConfig());
+    ~STM32Emulator();
+
+    // Reset the STM32 in its bootloader, the flash is kept
+    void reset();
+
+    // Fault injection
+    // Reply NACK instead of the last ACK of the next count commands cmd, without executing them
+    void nackNext(uint8_t cmd, int count = 1);
+    // Drop the byte sent to the host (or received from the host) after skipping this number of bytes
+    void dropReply(uint32_t skip = 0);
+    void dropRequest(uint32_t skip = 0);
+    // Random faults, in parts per million: NACK of a command, lost byte in either direction
+    void setRandomFaults(uint32_t seed, uint32_t nackRate, uint32_t dropRate);
+
+    const STM32EmuConfig &config() const { return cfg; }
+    const STM32EmuStats &stats() const { return st; }
+    uint8_t *flash() { return flashMem.data(); }
+    bool running() const { return state == RUNNING; }
+    uint32_t goAddress() const { return jumpAddress; }
+    // CRC of the STM32 CRC unit on 32-bit words, bit by bit as the hardware does
+    uint32_t crc(uint32_t address, uint32_t length) const;
+
+    // Stream
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t byte) override;
+    using Stream::write;
+
+  private:
+    enum State
+    {
+      WAIT_INIT,
+      WAIT_CMD,
+      WAIT_CMD_CPL,
+      WAIT_ADDRESS,
+      WAIT_READ_LEN,
+      WAIT_WRITE_DATA,
+      WAIT_ERASE,
+      WAIT_CRC_LEN,
+      RUNNING
+    };
+
+    struct Reply
+    {
+      uint8_t byte;
+      uint64_t readyTime;
+    };
+
+    void receive(uint8_t byte, uint64_t time);
+    void startCommand(uint64_t time);
+    void endAddress(uint64_t time);
+    void endReadLength(uint64_t time);
+    void endWrite(uint64_t time);
+    void endErase(uint64_t time);
+    void endCrcLength(uint64_t time);
+    bool supported(uint8_t cmd) const;
+    bool faultNack();
+    bool randomly(uint32_t rate);
+    uint8_t *memory(uint32_t address, uint32_t length);
+    const uint8_t *memory(uint32_t address, uint32_t length) const;
+    void send(uint8_t byte, uint64_t time);
+    void ack(uint64_t time);
+    void nack(uint64_t time);
+    void expect(State next, size_t length);
+    static void idle();
+
+    STM32EmuConfig cfg;
+    STM32EmuStats st;
+    std::vector<uint8_t> flashMem;
+    std::vector<uint8_t> ramMem;
+
+    State state = WAIT_INIT;
+    uint8_t cmd = 0;
+    uint32_t address = 0;
+    uint32_t jumpAddress = 0;
+    std::vector<uint8_t> frame;           // bytes of the current step of the command
+    size_t frameLength = 0;
+
+    std::deque<Reply> replies;
+    uint64_t lineInFreeTime = 0;          // the host to STM32 line is busy until then
+    uint64_t lineOutFreeTime = 0;         // the STM32 to host line is busy until then
+
+    uint8_t nackCmd = 0;
+    int nackCount = 0;
+    int64_t dropReplyAt = -1;
+    int64_t dropRequestAt = -1;
+    uint32_t rng = 0;
+    uint32_t nackRate = 0;
+    uint32_t dropRate = 0;
+};
+
+#endif
@@ -0,0 +1,109 @@
+// Tests of the brightness levels sent to the STM32 (levels.cpp)
+#include <stdio.h>
+#include "../levels.h"
+
+namespace
+{
+int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) \
+    { \
+      printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+void testWindow()
+{
+  levels::setCurve(BRIGHTNESS_CURVE_LINEAR);
+  levels::setMinimum(100);
+  levels::setMaximum(600);
+  CHECK(levels::toSTM32(0) == 100);
+  CHECK(levels::toSTM32(500) == 350);
+  CHECK(levels::toSTM32(1000) == 600);
+  CHECK(levels::toSTM32(2000) == 600);
+  CHECK(levels::fromWindow(0) == 100);
+  CHECK(levels::fromWindow(0xFFFF) == 600);
+
+  // Clamping of the window
+  levels::setMinimum(300);
+  CHECK(levels::minimum() == 200);
+  levels::setMaximum(150);
+  CHECK(levels::maximum() == 200);
+  levels::setMaximum(1200);
+  CHECK(levels::maximum() == 1000);
+
+  // The perceptual curve keeps the ends of the window and is below the linear one
+  levels::setCurve(BRIGHTNESS_CURVE_PERCEPTUAL);
+  CHECK(levels::toSTM32(0) == 200);
+  CHECK(levels::toSTM32(1000) == 1000);
+  CHECK(levels::toSTM32(500) < 600);
+  levels::setCurve(BRIGHTNESS_CURVE_LINEAR);
+}
+
+void testSlot()
+{
+  uint16_t level, transition;
+  while (levels::take(level, transition));
+  CHECK(!levels::take(level, transition));
+
+  uint32_t coalesced = levels::coalesced();
+  levels::request(100, 500);
+  levels::request(300, 1000);
+  CHECK(levels::coalesced() == coalesced + 1);
+  CHECK(levels::take(level, transition));
+  CHECK(level == 300 && transition == 1000);
+  CHECK(!levels::take(level, transition));
+}
+
+void testCutOff()
+{
+  static const uint16_t minimums[] = {0, 1, 25, 100, 200};
+  for (uint16_t minimum : minimums)
+  {
+    for (uint8_t curve = BRIGHTNESS_CURVE_LINEAR; curve <= BRIGHTNESS_CURVE_PERCEPTUAL; curve++)
+    {
+      levels::setMinimum(minimum);
+      levels::setMaximum(1000);
+      levels::setCurve(curve);
+      uint16_t level, transition;
+      // The user level 0 is the minimum of the window, the light may stay on
+      levels::request(levels::toSTM32(0), 0);
+      CHECK(levels::take(level, transition));
+      CHECK(level == minimum);
+
+      // The cut-off replaces a pending request with a transition and sends 0 at once
+      levels::request(levels::toSTM32(800), 2000);
+      levels::cutOff();
+      CHECK(levels::take(level, transition));
+      CHECK(level == 0);
+      CHECK(transition == 0);
+    }
+  }
+  levels::setCurve(BRIGHTNESS_CURVE_LINEAR);
+}
+}
+
+int main()
+{
+  struct
+  {
+    const char *name;
+    void (*run)();
+  } tests[] = {
+    {"window", testWindow},
+    {"slot", testSlot},
+    {"cutOff", testCutOff},
+  };
+
+  for (auto &test : tests)
+  {
+    int before = failures;
+    test.run();
+    printf("%s %s\n", failures == before ? "ok  " : "FAIL", test.name);
+  }
+  printf("%d failure(s)\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,298 @@
+// Tests of stm32flash.cpp against the emulated bootloader of the STM32
+#include <stdio.h>
+#include <vector>
+#include "stm32emu.h"
+#include "../stm32flash.h"
+
+namespace
+{
+int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) \
+    { \
+      printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+#define FLASH_START 0x08000000
+#define PAGE_SIZE 0x400
+
+// Pseudo random image, different from the erased flash
+std::vector<uint8_t> makeImage(size_t size, uint32_t seed)
+{
+  std::vector<uint8_t> image(size);
+  for (size_t i = 0; i < size; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    image[i] = seed >> 16;
+  }
+  return image;
+}
+
+// Erase the pages of the image then write it by blocks of 256 bytes, as light.cpp does
+stm32_err_t flashImage(stm32_t *stm, const std::vector<uint8_t> &image)
+{
+  uint32_t pages = (image.size() + PAGE_SIZE - 1) / PAGE_SIZE;
+  stm32_err_t s_err = stm32_erase_memory(stm, 0, pages);
+  for (size_t offset = 0; s_err == STM32_ERR_OK && offset < image.size(); offset += 256)
+  {
+    size_t len = image.size() - offset < 256 ? image.size() - offset : 256;
+    s_err = stm32_write_memory(stm, FLASH_START + offset, image.data() + offset, len);
+  }
+  return s_err;
+}
+
+void testInit()
+{
+  STM32Emulator emu;
+  stm32_t *stm = stm32_init(&emu, STREAM_SERIAL, 1);
+  CHECK(stm != NULL);
+  if (stm == NULL)
+    return;
+  CHECK(stm->pid == 0x440);
+  CHECK(stm->bl_version == 0x31);
+  CHECK(stm->version == 0x31);
+  CHECK(stm->dev->fl_start == FLASH_START);
+  CHECK(stm->dev->fl_end == FLASH_START + 0x10000);
+  stm32_close(stm);
+
+  // The bootloader is already initialized: connect without the init sequence
+  stm = stm32_init(&emu, STREAM_SERIAL, 0);
+  CHECK(stm != NULL);
+  stm32_close(stm);
+  // The init byte is taken as the start of a command, the port does not recover from it
+  CHECK(stm32_init(&emu, STREAM_SERIAL, 1) == NULL);
+  emu.reset();
+  stm = stm32_init(&emu, STREAM_SERIAL, 1);
+  CHECK(stm != NULL);
+  stm32_close(stm);
+
+  // Unknown device
+  STM32EmuConfig config;
+  config.pid = 0x123;
+  STM32Emulator other(config);
+  CHECK(stm32_init(&other, STREAM_SERIAL, 1) == NULL);
+}
+
+void testNoBootloader()
+{
+  STM32Emulator emu;
+  // Every reply byte is lost, as if the STM32 was not in its bootloader
+  emu.setRandomFaults(1, 0, 1000000);
+  unsigned long t0 = millis();
+  CHECK(stm32_init(&emu, STREAM_SERIAL, 1) == NULL);
+  // The read timeout of the stream is 1 s
+  CHECK(millis() - t0 >= 1000);
+}
+
+void testEraseWriteCrc(uint8_t eraseCmd, bool crcCmd)
+{
+  STM32EmuConfig config;
+  config.eraseCmd = eraseCmd;
+  config.crcCmd = crcCmd;
+  STM32Emulator emu(config);
+  stm32_t *stm = stm32_init(&emu, STREAM_SERIAL, 1);
+  CHECK(stm != NULL);
+  if (stm == NULL)
+    return;
+
+  // Old firmware everywhere, the new image is shorter and not aligned
+  memset(emu.flash(), 0x00, config.flashSize);
+  std::vector<uint8_t> image = makeImage(5 * PAGE_SIZE + 123, eraseCmd);
+  CHECK(flashImage(stm, image) == STM32_ERR_OK);
+  CHECK(memcmp(emu.flash(), image.data(), image.size()) == 0);
+  // The last block is padded with 0xFF, the next pages are not erased
+  CHECK(emu.flash()[image.size()] == 0xFF);
+  CHECK(emu.flash()[6 * PAGE_SIZE - 1] == 0xFF);
+  CHECK(emu.flash()[6 * PAGE_SIZE] == 0x00);
+  CHECK(emu.stats().erasedPages == 6);
+
+  uint32_t length = (image.size() + 3) & ~3;
+  uint32_t crc = 0;
+  CHECK(stm32_crc_wrapper(stm, FLASH_START, length, &crc) == STM32_ERR_OK);
+  CHECK(crc == emu.crc(FLASH_START, length));
+  std::vector<uint8_t> padded(image);
+  padded.resize(length, 0xFF);
+  CHECK(crc == stm32_sw_crc(STM32_CRC_INIT, padded.data(), length));
+  CHECK(crc == stm32_sw_crc_bitwise(STM32_CRC_INIT, padded.data(), length));
+
+  // The CRC computed while writing matches the one of the bootloader
+  crc = STM32_CRC_INIT;
+  CHECK(stm32_erase_memory(stm, 0, 1) == STM32_ERR_OK);
+  for (uint32_t offset = 0; offset < PAGE_SIZE; offset += 256)
+    CHECK(stm32_write_memory_and_crc(stm, FLASH_START + offset, image.data() + offset, 256, &crc) == STM32_ERR_OK);
+  CHECK(crc == emu.crc(FLASH_START, PAGE_SIZE));
+
+  // Mass erase
+  CHECK(stm32_erase_memory(stm, 0, STM32_MASS_ERASE) == STM32_ERR_OK);
+  CHECK(emu.flash()[0] == 0xFF && emu.flash()[config.flashSize - 1] == 0xFF);
+  stm32_close(stm);
+}
+
+void testReadAndGo()
+{
+  STM32Emulator emu;
+  stm32_t *stm = stm32_init(&emu, STREAM_SERIAL, 1);
+  CHECK(stm != NULL);
+  if (stm == NULL)
+    return;
+  std::vector<uint8_t> image = makeImage(256, 7);
+  memcpy(emu.flash() + 0x100, image.data(), image.size());
+  uint8_t buf[256];
+  CHECK(stm32_read_memory(stm, FLASH_START + 0x100, buf, sizeof(buf)) == STM32_ERR_OK);
+  CHECK(memcmp(buf, image.data(), sizeof(buf)) == 0);
+  // Out of the flash
+  CHECK(stm32_read_memory(stm, FLASH_START + 0x10000, buf, 4) != STM32_ERR_OK);
+
+  CHECK(stm32_go(stm, FLASH_START) == STM32_ERR_OK);
+  CHECK(emu.running());
+  CHECK(emu.goAddress() == FLASH_START);
+  stm32_close(stm);
+}
+
+void testWriteNotErased()
+{
+  STM32Emulator emu;
+  stm32_t *stm = stm32_init(&emu, STREAM_SERIAL, 1);
+  CHECK(stm != NULL);
+  if (stm == NULL)
+    return;
+  std::vector<uint8_t> image = makeImage(256, 3);
+  memset(emu.flash(), 0x00, PAGE_SIZE);
+  // The flash refuses to program a half-word that is not erased
+  CHECK(stm32_write_memory(stm, FLASH_START, image.data(), 256) == STM32_ERR_NACK);
+  // Erasing the page again before retrying the block is what makes it work
+  CHECK(stm32_erase_memory(stm, 0, 1) == STM32_ERR_OK);
+  CHECK(stm32_write_memory(stm, FLASH_START, image.data(), 256) == STM32_ERR_OK);
+  CHECK(memcmp(emu.flash(), image.data(), 256) == 0);
+  stm32_close(stm);
+}
+
+void testFaults()
+{
+  STM32Emulator emu;
+  stm32_t *stm = stm32_init(&emu, STREAM_SERIAL, 1);
+  CHECK(stm != NULL);
+  if (stm == NULL)
+    return;
+  std::vector<uint8_t> image = makeImage(256, 5);
+  CHECK(stm32_erase_memory(stm, 0, 1) == STM32_ERR_OK);
+
+  // NACK of the bootloader
+  emu.nackNext(0x31);
+  CHECK(stm32_write_memory(stm, FLASH_START, image.data(), 256) == STM32_ERR_NACK);
+  CHECK(emu.flash()[0] == 0xFF);
+  CHECK(stm32_write_memory(stm, FLASH_START, image.data(), 256) == STM32_ERR_OK);
+
+  emu.nackNext(0x44);
+  CHECK(stm32_erase_memory(stm, 0, 1) != STM32_ERR_OK);
+  CHECK(memcmp(emu.flash(), image.data(), 256) == 0);
+  CHECK(stm32_erase_memory(stm, 0, 1) == STM32_ERR_OK);
+
+  // Lost ACK: the write is done but the flasher sees a timeout, and the link is still in sync
+  emu.dropReply(2);
+  unsigned long t0 = millis();
+  CHECK(stm32_write_memory(stm, FLASH_START, image.data(), 256) == STM32_ERR_READ);
+  CHECK(millis() - t0 >= 1000);
+  CHECK(memcmp(emu.flash(), image.data(), 256) == 0);
+  uint32_t crc;
+  CHECK(stm32_crc_wrapper(stm, FLASH_START, 256, &crc) == STM32_ERR_OK);
+  CHECK(crc == emu.crc(FLASH_START, 256));
+
+  // Lost data byte: the bootloader waits for the end of the frame and the write fails
+  CHECK(stm32_erase_memory(stm, 0, 1) == STM32_ERR_OK);
+  emu.dropRequest(10);
+  CHECK(stm32_write_memory(stm, FLASH_START, image.data(), 256) != STM32_ERR_OK);
+  CHECK(emu.flash()[0] == 0xFF);
+  stm32_close(stm);
+
+  // After a reset of the STM32, the flasher connects again
+  emu.reset();
+  stm = stm32_init(&emu, STREAM_SERIAL, 1);
+  CHECK(stm != NULL);
+  stm32_close(stm);
+}
+
+// The optimized software CRCs give the result of the reference bit by bit for any length and alignment,
+// and in several calls as in one
+void testSoftwareCrc()
+{
+  std::vector<uint8_t> data = makeImage(4096 + 8, 11);
+  uint32_t seed = 1;
+  for (int i = 0; i < 2000; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    unsigned int offset = (seed >> 16) % 8;
+    seed = seed * 1103515245 + 12345;
+    unsigned int len = ((seed >> 16) % 1025) * 4;
+    seed = seed * 1103515245 + 12345;
+    uint32_t init = (i % 2) ? STM32_CRC_INIT : seed;
+    uint8_t *buf = data.data() + offset;
+
+    uint32_t expected = stm32_sw_crc_bitwise(init, buf, len);
+    CHECK(stm32_sw_crc_table(init, buf, len) == expected);
+    CHECK(stm32_sw_crc_slice8(init, buf, len) == expected);
+    CHECK(stm32_sw_crc(init, buf, len) == expected);
+
+    unsigned int split = len ? ((seed >> 8) % (len / 4 + 1)) * 4 : 0;
+    CHECK(stm32_sw_crc_slice8(stm32_sw_crc_slice8(init, buf, split), buf + split, len - split) == expected);
+    CHECK(stm32_sw_crc_table(stm32_sw_crc_table(init, buf, split), buf + split, len - split) == expected);
+  }
+}
+
+void testTiming()
+{
+  STM32EmuConfig config;
+  STM32Emulator emu(config);
+  stm32_t *stm = stm32_init(&emu, STREAM_SERIAL, 1);
+  CHECK(stm != NULL);
+  if (stm == NULL)
+    return;
+  uint64_t t0 = hostMicros();
+  CHECK(stm32_erase_memory(stm, 0, 4) == STM32_ERR_OK);
+  uint64_t eraseTime = hostMicros() - t0;
+  CHECK(eraseTime >= 4 * config.pageEraseTime);
+  CHECK(eraseTime < 4 * config.pageEraseTime + 100 * config.byteTime);
+
+  std::vector<uint8_t> image = makeImage(256, 9);
+  t0 = hostMicros();
+  CHECK(stm32_write_memory(stm, FLASH_START, image.data(), 256) == STM32_ERR_OK);
+  uint64_t writeTime = hostMicros() - t0;
+  // 2 + 5 + 258 bytes sent, 3 ACK, 128 half-words programmed
+  uint64_t expected = (2 + 5 + 258) * config.byteTime + 128 * config.halfWordProgramTime;
+  CHECK(writeTime >= expected);
+  CHECK(writeTime < expected + 3 * (config.byteTime + config.latency) + 1000);
+  stm32_close(stm);
+}
+}
+
+int main()
+{
+  struct
+  {
+    const char *name;
+    void (*run)();
+  } tests[] = {
+    {"init", testInit},
+    {"noBootloader", testNoBootloader},
+    {"eraseWriteCrc", [] { testEraseWriteCrc(0x44, false); }},
+    {"eraseWriteCrc (erase, CRC command)", [] { testEraseWriteCrc(0x43, true); }},
+    {"readAndGo", testReadAndGo},
+    {"writeNotErased", testWriteNotErased},
+    {"faults", testFaults},
+    {"softwareCrc", testSoftwareCrc},
+    {"timing", testTiming},
+  };
+
+  for (auto &test : tests)
+  {
+    int before = failures;
+    test.run();
+    printf("%s %s\n", failures == before ? "ok  " : "FAIL", test.name);
+  }
+  printf("%d failure(s)\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,165 @@
+// Tests of the decoder of the STM32 images (stm32image.cpp), fed from a stream
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "Stream.h"
+#include "../stm32image.h"
+
+namespace
+{
+int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) \
+    { \
+      printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+#define FLASH_START 0x08000000
+#define FLASH_SIZE 0x10000
+
+class MemoryStream : public Stream
+{
+  public:
+    explicit MemoryStream(const std::string &data) : data(data) {}
+    int available() override { return data.size() - pos; }
+    int read() override { return pos < data.size() ? (uint8_t)data[pos++] : -1; }
+    int peek() override { return pos < data.size() ? (uint8_t)data[pos] : -1; }
+    size_t write(uint8_t) override { return 0; }
+
+  private:
+    std::string data;
+    size_t pos = 0;
+};
+
+// Intel HEX record with its checksum
+std::string record(uint8_t type, uint16_t addr, const std::vector<uint8_t> &data)
+{
+  std::vector<uint8_t> bytes = {(uint8_t)data.size(), (uint8_t)(addr >> 8), (uint8_t)addr, type};
+  bytes.insert(bytes.end(), data.begin(), data.end());
+  uint8_t sum = 0;
+  for (uint8_t b : bytes)
+    sum += b;
+  bytes.push_back(-sum);
+  std::string line = ":";
+  char hex[3];
+  for (uint8_t b : bytes)
+  {
+    sprintf(hex, "%02X", b);
+    line += hex;
+  }
+  return line + "\r\n";
+}
+
+std::string extendedAddress(uint32_t addr)
+{
+  return record(0x04, 0, {(uint8_t)(addr >> 24), (uint8_t)(addr >> 16)});
+}
+
+std::string endOfFile()
+{
+  return record(0x01, 0, {});
+}
+
+// Decode the whole image; returns false on error, out gets the bytes decoded up to the error
+bool decode(const std::string &file, std::vector<uint8_t> &out, uint32_t size = 0)
+{
+  MemoryStream stream(file);
+  out.clear();
+  if (!stm32image::open(stream, size, FLASH_START, FLASH_SIZE))
+    return false;
+  uint8_t buf[256];
+  int n;
+  while ((n = stm32image::read(buf, sizeof(buf))) > 0)
+    out.insert(out.end(), buf, buf + n);
+  stm32image::close();
+  return n == 0;
+}
+
+void testHex()
+{
+  std::string file = extendedAddress(FLASH_START) + record(0x00, 0x0000, {1, 2, 3, 4}) +
+                     record(0x00, 0x0010, {5, 6}) + endOfFile();
+  std::vector<uint8_t> out;
+  CHECK(decode(file, out));
+  CHECK(out.size() == 0x12);
+  CHECK(out[0] == 1 && out[3] == 4);
+  // The gap is filled with 0xFF
+  CHECK(out[4] == 0xFF && out[0x0F] == 0xFF);
+  CHECK(out[0x10] == 5 && out[0x11] == 6);
+  CHECK(strcmp(stm32image::formatStr(), "hex") == 0);
+
+  // Record ending at the end of the flash
+  file = extendedAddress(FLASH_START) + record(0x00, FLASH_SIZE - 2, {7, 8}) + endOfFile();
+  CHECK(decode(file, out));
+  CHECK(out.size() == FLASH_SIZE && out[FLASH_SIZE - 1] == 8);
+}
+
+void testHexOutOfFlash()
+{
+  std::vector<uint8_t> out;
+  // The option bytes of the STM32F0 are far above the flash: the record is rejected before filling the gap
+  std::string file = extendedAddress(FLASH_START) + record(0x00, 0x0000, {1, 2, 3, 4}) +
+                     extendedAddress(0x1FFF0000) + record(0x00, 0xF800, {0xAA, 0x55}) + endOfFile();
+  CHECK(!decode(file, out));
+  CHECK(out.size() <= 256);
+  CHECK(strstr(stm32image::error(), "out of the flash") != NULL);
+
+  // Crossing the end of the flash
+  file = extendedAddress(FLASH_START) + record(0x00, FLASH_SIZE - 1, {1, 2}) + endOfFile();
+  CHECK(!decode(file, out));
+  CHECK(out.empty());
+
+  // Below the flash
+  file = extendedAddress(0x07FF0000) + record(0x00, 0xFFF0, {1, 2}) + endOfFile();
+  CHECK(!decode(file, out));
+
+  // Below the previous records
+  file = extendedAddress(FLASH_START) + record(0x00, 0x0010, {1, 2}) + record(0x00, 0x0000, {3, 4}) + endOfFile();
+  CHECK(!decode(file, out));
+  CHECK(strstr(stm32image::error(), "below the previous") != NULL);
+}
+
+void testBinary()
+{
+  std::string image(1000, 0x5A);
+  std::vector<uint8_t> out;
+  CHECK(decode(image, out, image.size()));
+  CHECK(out.size() == image.size());
+  CHECK(strcmp(stm32image::formatStr(), "bin") == 0);
+
+  // Larger than the flash
+  std::string large(FLASH_SIZE + 1, 0x5A);
+  CHECK(!decode(large, out));
+  CHECK(out.size() <= FLASH_SIZE);
+
+  // The stream ends before its announced size
+  CHECK(!decode(image, out, image.size() + 10));
+  CHECK(strstr(stm32image::error(), "truncated") != NULL);
+}
+}
+
+int main()
+{
+  struct
+  {
+    const char *name;
+    void (*run)();
+  } tests[] = {
+    {"hex", testHex},
+    {"hexOutOfFlash", testHexOutOfFlash},
+    {"binary", testBinary},
+  };
+
+  for (auto &test : tests)
+  {
+    int before = failures;
+    test.run();
+    printf("%s %s\n", failures == before ? "ok  " : "FAIL", test.name);
+  }
+  printf("%d failure(s)\n", failures);
+  return failures ? 1 : 0;
+}
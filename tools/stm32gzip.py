@@ -0,0 +1,32 @@
+#!/usr/bin/env python3
+"""
+Compress a STM32 firmware (.bin or .hex) for the upload page of the Shelly Dimmer 2 firmware.
+
+The dimmer inflates the image with a window of at most 32 KB, or less when the memory
+is missing. A smaller window keeps the back-references within reach:
+    python3 tools/stm32gzip.py "STM32 Firmware/stm_3F_02.bin" stm_3F_02.bin.gz
+"""
+
+import argparse
+import zlib
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="firmware in binary or Intel HEX format")
+    parser.add_argument("output", help="gzip file to upload")
+    parser.add_argument("--window", type=int, default=12, choices=range(9, 16),
+                        help="log2 of the window size (default: 12, i.e. 4 KB)")
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as f:
+        data = f.read()
+    compressor = zlib.compressobj(9, zlib.DEFLATED, 16 + args.window)
+    compressed = compressor.compress(data) + compressor.flush()
+    with open(args.output, "wb") as f:
+        f.write(compressed)
+    print("%d bytes compressed to %d bytes with a window of %d bytes" % (len(data), len(compressed), 1 << args.window))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""
+Decoder for the STM32 protocol trace of the Shelly Dimmer 2 firmware.
+
+Download the trace from the dimmer and print it as a timeline:
+    curl -o stm32trace.bin http://<dimmer IP>/stm32trace.bin
+    python3 tools/stm32trace.py stm32trace.bin
+
+The file format is defined in trace.cpp (little endian):
+    header: magic "STRC", version (u8), record size (u8), number of records (u16),
+            total number of records (u32), micros() at download (u32)
+    record: micros() (u32), length (u16), sequence number (u16), direction | status (u8), frame (27 bytes)
+"""
+
+import argparse
+import struct
+import sys
+
+HEADER = struct.Struct("<4sBBHII")
+RECORD = struct.Struct("<IHHB")
+
+COMMANDS = {
+    0x01: "GET_VERSION",
+    0x02: "SET_BRIGHTNESS",
+    0x03: "SET_BRIGHTNESS_ADVANCED",
+    0x10: "GET_STATE",
+    0x20: "SET_DIMMING_PARAMETERS",
+    0x30: "SET_DIMMING_TYPE_2",
+    0x31: "SET_DIMMING_TYPE_3",
+}
+
+STATUS = {0: "ok", 1: "bad checksum", 2: "bad end marker", 3: "skipped", 4: "rx overflow",
+          5: "incomplete"}
+
+
+def decode_payload(direction, cmd, payload):
+    """Short description of the payloads which are understood"""
+    if cmd == 0x02 and direction == "TX" and len(payload) >= 2:
+        return "level %d permille" % struct.unpack_from("<H", payload)[0]
+    if cmd == 0x03 and direction == "TX" and len(payload) >= 4:
+        level, rate = struct.unpack_from("<HH", payload)
+        return "level %d permille, fade rate %d" % (level, rate)
+    if cmd == 0x10 and direction == "RX" and len(payload) >= 8:
+        _, brightness, _, power = struct.unpack_from("<HHHH", payload)
+        return "brightness %d permille, raw power %d" % (brightness, power)
+    return payload.hex(" ").upper()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("trace", help="file downloaded from /stm32trace.bin")
+    parser.add_argument("--raw", action="store_true", help="print the bytes of every frame")
+    args = parser.parse_args()
+
+    with open(args.trace, "rb") as f:
+        data = f.read()
+    if len(data) < HEADER.size:
+        sys.exit("file too short")
+    magic, version, record_size, nb_records, total_records, now = HEADER.unpack_from(data)
+    if magic != b"STRC" or version != 2:
+        sys.exit("not a STM32 trace (magic %r, version %d)" % (magic, version))
+    print("%d records (%d since boot or clear, %d lost)" % (nb_records, total_records, total_records - nb_records))
+
+    previous = None
+    for i in range(nb_records):
+        offset = HEADER.size + i * record_size
+        if offset + record_size > len(data):
+            sys.exit("truncated file at record %d" % i)
+        timestamp, length, seq, flags = RECORD.unpack_from(data, offset)
+        frame = data[offset + RECORD.size:offset + record_size]
+        direction = "RX" if flags & 0x80 else "TX"
+        status = STATUS.get(flags & 0x7F, "status %d" % (flags & 0x7F))
+
+        # Time relative to the download and to the previous record, micros() wraps after 71 minutes
+        age = ((now - timestamp) & 0xFFFFFFFF) / 1000.0
+        delta = ((timestamp - previous) & 0xFFFFFFFF) if previous is not None else 0
+        previous = timestamp
+
+        line = "%5d  -%10.3f ms  +%8d us  %s  " % (seq, age, delta, direction)
+        if flags & 0x7F in (3, 4):
+            line += "%s %d bytes" % (status, length)
+        else:
+            stored = frame[:min(length, len(frame))]
+            counter = stored[1] if len(stored) > 1 else 0
+            cmd = stored[2] if len(stored) > 2 else 0
+            payload = stored[4:4 + stored[3]] if len(stored) > 3 else b""
+            line += "#%3d %-24s" % (counter, COMMANDS.get(cmd, "0x%02X" % cmd))
+            if status != "ok":
+                line += " " + status
+            line += " " + decode_payload(direction, cmd, payload)
+            if length > len(frame):
+                line += " (truncated from %d bytes)" % length
+            line = line.rstrip()
+            if args.raw:
+                line += "\n" + " " * 44 + stored.hex(" ").upper()
+        print(line)
+
+
+if __name__ == "__main__":
+    main()
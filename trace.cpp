@@ -0,0 +1,92 @@
+#include "trace.h"
+#include "wifi.h"
+
+
+namespace trace
+{
+
+// Fixed-size records in a ring buffer, the oldest ones are overwritten
+#define TRACE_NB_RECORDS 64
+#define TRACE_FRAME_SIZE 27             // longer frames are truncated, fills the record up to 36 bytes
+#define TRACE_MAGIC "STRC"
+#define TRACE_VERSION 2
+
+struct Record
+{
+  uint32_t timestamp;                   // micros()
+  uint16_t len;                         // size of the frame (up to 262 bytes), or number of bytes skipped
+  uint16_t seq;                         // sequence number of the record
+  uint8_t flags;                        // direction | status
+  uint8_t frame[TRACE_FRAME_SIZE];
+};
+
+// Header of the downloaded file, followed by the records from the oldest to the newest
+struct Header
+{
+  char magic[4];
+  uint8_t version;
+  uint8_t recordSize;
+  uint16_t nbRecords;                   // number of records in the file
+  uint32_t totalRecords;                // number of records since the boot or the last clear
+  uint32_t timestamp;                   // micros() when downloading
+};
+
+Record records[TRACE_NB_RECORDS];
+uint32_t totalRecords = 0;
+
+void record(Direction dir, Status status, const uint8_t *frame, uint16_t len)
+{
+  Record &r = records[totalRecords % TRACE_NB_RECORDS];
+  r.timestamp = micros();
+  r.flags = dir | status;
+  r.len = len;
+  r.seq = totalRecords;
+  uint8_t n = 0;
+  if (frame != NULL)
+  {
+    n = (len > TRACE_FRAME_SIZE) ? TRACE_FRAME_SIZE : len;
+    memcpy(r.frame, frame, n);
+  }
+  memset(r.frame + n, 0x00, TRACE_FRAME_SIZE - n);
+  totalRecords++;
+}
+
+void clear()
+{
+  totalRecords = 0;
+}
+
+// Download the trace: /stm32trace.bin, with ?clear=1 to clear it afterwards
+void handleDownload()
+{
+  uint16_t nbRecords = (totalRecords < TRACE_NB_RECORDS) ? totalRecords : TRACE_NB_RECORDS;
+  Header header;
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.recordSize = sizeof(Record);
+  header.nbRecords = nbRecords;
+  header.totalRecords = totalRecords;
+  header.timestamp = micros();
+
+  ESP8266WebServer *server = wifi::getWifiManager().server.get();
+  server->setContentLength(sizeof(Header) + nbRecords * sizeof(Record));
+  server->sendHeader("Content-Disposition", "attachment; filename=stm32trace.bin");
+  server->send(200, "application/octet-stream", "");
+  server->sendContent((const char*)&header, sizeof(header));
+  // From the oldest record to the newest, in two parts when the ring has wrapped
+  uint16_t first = (totalRecords - nbRecords) % TRACE_NB_RECORDS;
+  uint16_t n = (first + nbRecords > TRACE_NB_RECORDS) ? TRACE_NB_RECORDS - first : nbRecords;
+  server->sendContent((const char*)&records[first], n * sizeof(Record));
+  if (n < nbRecords)
+    server->sendContent((const char*)&records[0], (nbRecords - n) * sizeof(Record));
+
+  if (server->hasArg("clear"))
+    clear();
+}
+
+void bindServerCallback()
+{
+  wifi::getWifiManager().server.get()->on("/stm32trace.bin", handleDownload);
+}
+
+} // namespace trace
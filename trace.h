@@ -0,0 +1,21 @@
+#ifndef TRACE
+#define TRACE
+
+#include <Arduino.h>
+
+
+// Binary trace of the frames exchanged with the STM32, decoded with tools/stm32trace.py
+namespace trace
+{
+  enum Direction { TRACE_TX = 0x00, TRACE_RX = 0x80 };
+  enum Status { TRACE_OK = 0, TRACE_BAD_CRC = 1, TRACE_BAD_END = 2, TRACE_SKIPPED = 3, TRACE_OVERFLOW = 4,
+                TRACE_TIMEOUT = 5 };
+
+  // frame: the whole frame from the start marker; len: its size (for TRACE_SKIPPED, the number of bytes skipped)
+  void record(Direction dir, Status status, const uint8_t *frame, uint16_t len);
+  void clear();
+
+  void bindServerCallback();
+}
+
+#endif
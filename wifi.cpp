@@ -56,6 +56,8 @@ WiFiManagerParameter MQTTParams[] =
   WiFiManagerParameter("pubMqttSwitchEvents", "Switch events", "switch/shellyDevice", 100),
   WiFiManagerParameter("pubMqttAlarmOverheat", "Overheat alarm", "shellyDevice/alarm/overheat", 100),
   WiFiManagerParameter("pubMqttTemperature", "Internal temperature", "temperature/shellyDevice", 100),
+  WiFiManagerParameter("pubMqttPower", "Power consumption (watts)", "power/shellyDevice", 100),
+  WiFiManagerParameter("pubMqttSTM32Update", "Progress of the STM32 firmware update", "stm32update/shellyDevice", 100),
 
   // The MQTT subscribe
   WiFiManagerParameter("<br/><br/><hr><h3>MQTT subscribe</h3>"),
@@ -66,8 +68,12 @@ WiFiManagerParameter MQTTParams[] =
   WiFiManagerParameter("subMqttLightAllOff", "Topic for switching off all lights", "switchOffAll", 100),
   WiFiManagerParameter("subMqttBlinkingPattern", "Topic for starting blinking with the pattern given in the MQTT message. \
                                                   The pattern is optional. It is specified with a sequence of integers indicating \
-                                                  the duration of the on/off states. The durations are in tenths of seconds.", "startBlinking", 100),
+                                                  the duration of the on/off states. The durations are in tenths of seconds. A brightness level in percent \
+                                                  can be given for a step with duration:level (e.g. 5:100 5:20 10:0).", "startBlinking", 100),
   WiFiManagerParameter("subMqttBlinkingDuration", "Topic for changing the blinking duration in seconds", "setBlinkingDuration", 100),
+  WiFiManagerParameter("subMqttBrightness", "Topic for setting the brightness in percent (e.g. 12.5)", "brightness/shellyDevice", 100),
+  WiFiManagerParameter("subMqttEffect", "Topic for starting an effect: breathe [period in s], candle, sunrise [duration in s] or stop", "effect/shellyDevice", 100),
+  WiFiManagerParameter("subMqttSTM32Fetch", "Topic for updating the STM32 firmware from the URL given in the MQTT message (add \" diff\" to only write the changed pages)", "stm32fetch/shellyDevice", 100),
 };
 
 // The debugging options
@@ -410,7 +416,7 @@ void factoryReset()
 
 void prepareOTA()
 {
-  // Disable timer interrupt since it can corrupt the OTA update
+  // Disable the interrupts of the switches since they can corrupt the OTA update
   switches::disableInterrupt(),
   // Disable the serial connection since it can also corrupt the OTA update
   Serial.end();